@@ -11,9 +11,428 @@
 #include <sstream>
 #include <thread>
 #include <mutex>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+
+#ifdef PSILOG_HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "PSILog.h"
 
+// How long the asynchronous writer thread sleeps when all of the rings are empty,
+// logging threads wake it up earlier when they push to a ring
+static const int ASYNC_IDLE_WAIT_MS = 50;
+
+// Most entries the writer thread takes from a ring to write to the outputs at once
+static const size_t ASYNC_BATCH_SIZE = 64;
+
+// Source of unique logger ids
+static std::atomic<uint64_t> next_logger_id { 1 };
+
+// Source of thread indexes, see psilog_thread_index()
+static std::atomic<uint32_t> next_thread_index { 1 };
+
+uint32_t psilog_thread_index() {
+	static thread_local uint32_t thread_index = next_thread_index++;
+	return thread_index;
+}
+
+// Render cache for the records the current thread writes directly
+static thread_local PSILogRenderCache thread_render_cache;
+
+// Takes the thread's render cache into use for one record
+// A log call made while writing a record, like from an output, gets a temporary cache
+class PSILogRenderCacheLease {
+public:
+	PSILogRenderCacheLease() :
+		_cache(thread_render_cache.in_use == true ? &_fallback : &thread_render_cache)
+	{
+		_cache->in_use = true;
+		_cache->count = 0;
+	}
+
+	~PSILogRenderCacheLease() {
+		_cache->in_use = false;
+	}
+
+	PSILogRenderCacheLease(const PSILogRenderCacheLease &) = delete;
+	PSILogRenderCacheLease &operator =(const PSILogRenderCacheLease &) = delete;
+
+	PSILogRenderCache &get() { return *_cache; }
+
+private:
+	PSILogRenderCache *_cache;
+	PSILogRenderCache _fallback;
+};
+
+// Asynchronous rings of the current thread, one for each logger it has logged to
+struct PSILogThreadRing {
+	uint64_t logger_id;
+	std::shared_ptr<PSILogRing> ring;
+};
+static thread_local std::vector<PSILogThreadRing> thread_rings;
+
+// Backtraces of the current thread, one for each logger it has kept entries for,
+// freed when the thread exits
+struct PSILogThreadBacktrace {
+	uint64_t logger_id;
+	std::weak_ptr<bool> logger_alive;
+	PSILogBacktrace backtrace;
+};
+static thread_local std::vector<PSILogThreadBacktrace> thread_backtraces;
+
+// Fatal signals the crash handler catches, and the handlers they had before
+static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+static const size_t CRASH_SIGNAL_COUNT = sizeof(crash_signals) / sizeof(crash_signals[0]);
+static struct sigaction previous_crash_actions[CRASH_SIGNAL_COUNT];
+
+// Logger with the crash handler installed, and whether a crash is being handled
+static std::atomic<PSILog *> crash_logger { nullptr };
+static std::atomic<bool> crash_handling { false };
+
+// Local time offset from UTC the prefixes were last rendered with, for the crash
+// handler which can't call localtime_r()
+static std::atomic<long> crash_utc_offset { 0 };
+
+// How long the crash handler waits for the writer thread to finish freeing a ring,
+// it may never finish if the crash left the allocator locked
+static const int CRASH_RING_WAIT_MS = 100;
+
+// Write the whole buffer, without anything that isn't async-signal-safe
+static void write_all(int fd, const char *data, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (written <= 0) {
+			return;
+		}
+		data += written;
+		length -= written;
+	}
+}
+
+// Entry text the crash handler renders into a buffer allocated up front,
+// text that doesn't fit is cut
+struct PSILogEmergencyText {
+	char *data;
+	size_t capacity;
+	size_t length;
+
+	void append(const char *text, size_t text_length) {
+		text_length = std::min(text_length, capacity - length);
+		memcpy(data + length, text, text_length);
+		length += text_length;
+	}
+
+	void append(char c) {
+		if (length < capacity) {
+			data[length++] = c;
+		}
+	}
+};
+
+static void emergency_append_unsigned(PSILogEmergencyText &out, unsigned long long value, unsigned base) {
+	static const char digits[] = "0123456789abcdef";
+	char text[24];
+	size_t count = 0;
+
+	do {
+		text[count++] = digits[value % base];
+		value /= base;
+	} while (value != 0);
+
+	while (count > 0) {
+		out.append(text[--count]);
+	}
+}
+
+static void emergency_append_signed(PSILogEmergencyText &out, long long value) {
+	if (value < 0) {
+		out.append('-');
+		emergency_append_unsigned(out, 0ULL - (unsigned long long)value, 10);
+	} else {
+		emergency_append_unsigned(out, (unsigned long long)value, 10);
+	}
+}
+
+// Floating point by hand, snprintf() is not async-signal-safe
+// Fixed notation with precision decimals, trimming the trailing zeros when trim is set,
+// and values too large for that with an exponent
+static void emergency_append_double(PSILogEmergencyText &out, double value, int precision, bool trim) {
+	if (value != value) {
+		out.append("nan", 3);
+		return;
+	}
+
+	if (value < 0) {
+		out.append('-');
+		value = -value;
+	}
+
+	if (value > 1.7e308) {
+		out.append("inf", 3);
+		return;
+	}
+
+	int exponent = 0;
+	while (value >= 1e18) {
+		value /= 10;
+		exponent++;
+	}
+
+	precision = std::min(precision, 18);
+	unsigned long long scale = 1;
+	for (int i = 0; i < precision; i++) {
+		scale *= 10;
+	}
+
+	unsigned long long whole = (unsigned long long)value;
+	unsigned long long fraction = (unsigned long long)((value - (double)whole) * (double)scale + 0.5);
+	if (fraction >= scale) {
+		whole++;
+		fraction -= scale;
+	}
+
+	emergency_append_unsigned(out, whole, 10);
+
+	char digits[20];
+	int count = precision;
+	for (int i = count - 1; i >= 0; i--) {
+		digits[i] = '0' + (char)(fraction % 10);
+		fraction /= 10;
+	}
+
+	while (trim == true && count > 0 && digits[count - 1] == '0') {
+		count--;
+	}
+
+	if (count > 0) {
+		out.append('.');
+		out.append(digits, count);
+	}
+
+	if (exponent > 0) {
+		out.append("e+", 2);
+		emergency_append_unsigned(out, exponent, 10);
+	}
+}
+
+// Read an argument from the payload, false if the payload ends before it
+template <typename T>
+static bool emergency_read(const char *&payload, const char *end, T &value) {
+	if ((size_t)(end - payload) < sizeof(T)) {
+		return false;
+	}
+
+	memcpy(&value, payload, sizeof(T));
+	payload += sizeof(T);
+
+	return true;
+}
+
+template <typename T>
+static bool emergency_append_integer(PSILogEmergencyText &out, char type, const char *&payload, const char *end) {
+	T value;
+	if (emergency_read(payload, end, value) == false) {
+		return false;
+	}
+
+	if (type == 'x') {
+		emergency_append_unsigned(out, (typename std::make_unsigned<T>::type)value, 16);
+	} else if (std::is_signed<T>::value == true) {
+		emergency_append_signed(out, (long long)value);
+	} else {
+		emergency_append_unsigned(out, (unsigned long long)value, 10);
+	}
+
+	return true;
+}
+
+template <typename T>
+static bool emergency_append_float(PSILogEmergencyText &out, char type, int precision,
+				   const char *&payload, const char *end) {
+	T value;
+	if (emergency_read(payload, end, value) == false) {
+		return false;
+	}
+
+	emergency_append_double(out, (double)value, precision, type != 'f');
+
+	return true;
+}
+
+// Decode one argument of type code from the payload, formatted by the placeholder
+// type, 'x' for hexadecimal and 'f' for fixed notation, or 0 for {}
+// Returns false if the payload ends before the argument
+static bool emergency_append_arg(PSILogEmergencyText &out, char code, char type, int precision,
+				 const char *&payload, const char *end) {
+	switch (code) {
+	case 'b':
+	case 'c': {
+		char value;
+		if (emergency_read(payload, end, value) == false) {
+			return false;
+		}
+
+		// Characters are numbers only with {:x} and {:d}
+		if (type == 'x') {
+			emergency_append_unsigned(out, (unsigned char)value, 16);
+		} else if (type == 'd') {
+			emergency_append_signed(out, value);
+		} else {
+			out.append(code == 'b' ? (value != 0 ? '1' : '0') : value);
+		}
+		return true;
+	}
+	case 's': return emergency_append_integer<int16_t>(out, type, payload, end);
+	case 'i': return emergency_append_integer<int32_t>(out, type, payload, end);
+	case 'l': return emergency_append_integer<int64_t>(out, type, payload, end);
+	case 'S': return emergency_append_integer<uint16_t>(out, type, payload, end);
+	case 'I': return emergency_append_integer<uint32_t>(out, type, payload, end);
+	case 'L': return emergency_append_integer<uint64_t>(out, type, payload, end);
+	case 'f': return emergency_append_float<float>(out, type, precision, payload, end);
+	case 'd': return emergency_append_float<double>(out, type, precision, payload, end);
+	case 'D': return emergency_append_float<long double>(out, type, precision, payload, end);
+	case 'z': {
+		uint32_t length;
+		if (emergency_read(payload, end, length) == false || length > (size_t)(end - payload)) {
+			return false;
+		}
+		out.append(payload, length);
+		payload += length;
+		return true;
+	}
+	}
+
+	return false;
+}
+
+// Render a deferred entry like the writer thread would, decoding the arguments
+// by the type codes of the call site signature, without allocating
+static void emergency_render_deferred(PSILogEmergencyText &out, const PSILogCallSite &site,
+				      const char *payload, size_t payload_length) {
+	const char *end = payload + payload_length;
+	const char *signature = site.get_signature();
+	const char *p = site.get_format();
+
+	while (*p != '\0') {
+		if ((p[0] == '{' && p[1] == '{') || (p[0] == '}' && p[1] == '}')) {
+			out.append(p[0]);
+			p += 2;
+			continue;
+		}
+
+		const char *close = p;
+		if (p[0] == '{' && *signature != '\0') {
+			while (*close != '\0' && *close != '}') {
+				close++;
+			}
+		}
+
+		if (*close != '}') {
+			out.append(*p++);
+			continue;
+		}
+
+		// {:x}, {:d}, {:f}, {:.Nf} or {:s}, the type is the last character
+		char type = close - p > 2 && p[1] == ':' ? close[-1] : '\0';
+		int precision = 6;
+		if (type == 'f' && p[2] == '.') {
+			precision = 0;
+			for (const char *digit = p + 3; digit < close - 1; digit++) {
+				precision = precision * 10 + (*digit - '0');
+			}
+		}
+
+		if (emergency_append_arg(out, *signature++, type, precision, payload, end) == false) {
+			return;
+		}
+		p = close + 1;
+	}
+}
+
+// Render "[HH:MM:SS] [thread id] " with the last known UTC offset
+static void emergency_append_prefix(PSILogEmergencyText &out, std::time_t time, const PSILogRing &ring) {
+	long seconds_of_day = (long)((time + crash_utc_offset.load()) % 86400);
+	if (seconds_of_day < 0) {
+		seconds_of_day += 86400;
+	}
+
+	const long fields[] = { seconds_of_day / 3600, seconds_of_day / 60 % 60, seconds_of_day % 60 };
+	out.append('[');
+	for (int i = 0; i < 3; i++) {
+		if (i > 0) {
+			out.append(':');
+		}
+		out.append('0' + (char)(fields[i] / 10));
+		out.append('0' + (char)(fields[i] % 10));
+	}
+	out.append("] [", 3);
+	out.append(ring.get_thread_text(), ring.get_thread_text_length());
+	out.append("] ", 2);
+}
+
+static void restore_crash_actions() {
+	for (size_t i = 0; i < CRASH_SIGNAL_COUNT; i++) {
+		sigaction(crash_signals[i], &previous_crash_actions[i], nullptr);
+	}
+}
+
+static void crash_handler(int signal) {
+	int saved_errno = errno;
+
+	// A crash while handling the crash goes straight to the previous handlers
+	PSILog *log = crash_logger.load();
+	if (log != nullptr && crash_handling.exchange(true) == false) {
+		log->write_emergency(signal);
+	}
+
+	restore_crash_actions();
+	errno = saved_errno;
+
+	// Delivered once we return, for faults also the instruction faults again
+	raise(signal);
+}
+
+PSILog::PSILog() :
+	_outputs(&_no_outputs),
+	_id(next_logger_id++)
+{}
+
+// Stop the asynchronous writer thread, making sure everything queued gets written
+PSILog::~PSILog() {
+	uninstall_crash_handler();
+	set_async(false);
+
+	// Release our references to the rings, threads still holding a reference
+	// will prune theirs the next time they log
+	RingNode *node = _rings.load();
+	while (node != nullptr) {
+		RingNode *next = node->next;
+		node->ring->set_closed(true);
+		delete node;
+		node = next;
+	}
+
+	if (_outputs.load() != &_no_outputs) {
+		delete _outputs.load();
+	}
+}
+
 // Default logger() << "Log message" overriding
 // Override the PSILog functor operator, to return a LogStream that
 // references this logger. This way the the operations are thread safe, as
@@ -28,103 +447,2280 @@ PSILogStream PSILog::operator ()(int log_level) {
 	return PSILogStream(*this, log_level);
 }
 
+// Push an entry to the calling thread's ring
+// Returns false if asynchronous mode is off, and the entry should be written directly
+template <typename Fill>
+bool PSILog::push_async(Fill fill) {
+	PSILogRing *ring = get_thread_ring();
+
+	// Mark the ring active before checking the state, so that a stopping
+	// writer thread either sees us pushing, or we see it stopping
+	while (true) {
+		ring->set_producer_active(true);
+		int state = _async_state.load();
+		if (state == ASYNC_RUNNING) {
+			break;
+		}
+
+		ring->set_producer_active(false);
+		if (state == ASYNC_OFF) {
+			return false;
+		}
+
+		// Wait for the writer thread to drain before writing directly,
+		// so that our earlier entries are written first
+		std::this_thread::yield();
+	}
+
+	// Ring full, apply our overflow policy
+	while (ring->try_push(fill) == false) {
+		if (_async_overflow == OVERFLOW_DROP_NEWEST) {
+			ring->add_dropped();
+			break;
+		}
+
+		// Discard the oldest entry, unless the writer thread is just
+		// finishing with it, in which case the slot is free soon anyway
+		if (_async_overflow == OVERFLOW_DROP_OLDEST && ring->get_head_slot_busy() == false) {
+			if (ring->consume_one([] (PSILogAsyncEntry &) {}) == true) {
+				ring->add_dropped();
+			}
+			continue;
+		}
+
+		// Sleep until the writer thread has taken entries out. The count is raised
+		// before checking, so that the writer thread either sees us waiting,
+		// or we see the slots it freed.
+		std::unique_lock<std::mutex> lock(_async_wake_mutex);
+		_async_blocked++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (ring->full() == true) {
+			_async_wake.notify_one();
+			_async_not_full.wait_for(lock, std::chrono::milliseconds(ASYNC_IDLE_WAIT_MS));
+		}
+		_async_blocked--;
+	}
+
+	ring->set_producer_active(false);
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (_async_sleeping.load() == true) {
+		wake_async_thread();
+	}
+
+	return true;
+}
+
 // Apply formatting and dispatch the log message to all of our outputs
 void PSILog::log(const std::string &entry, int log_level) {
-	std::stringstream entry_ss;
+	log(entry.data(), entry.size(), log_level);
+}
+
+void PSILog::log(const char *entry, size_t length, int log_level) {
+	auto timestamp = std::chrono::system_clock::now();
+
+	if (_backtrace_size != 0) {
+		// Keep the text of filtered out entries for later
+		if (is_backtraced(log_level) == true) {
+			PSILogAsyncEntry &kept = get_thread_backtrace().push(_backtrace_size);
+			kept.entry.assign(entry, length);
+			kept.log_level = log_level;
+			kept.site = nullptr;
+			kept.render = nullptr;
+			kept.timestamp = timestamp;
+			return;
+		}
+
+		if ((log_level & LogLevel::ERR) != 0) {
+			write_backtrace();
+		}
+	}
+
+	write_entry(entry, length, log_level, timestamp);
+}
+
+void PSILog::write_entry(const char *entry, size_t length, int log_level,
+			 std::chrono::system_clock::time_point timestamp) {
+	std::thread::id thread_id = std::this_thread::get_id();
+	uint32_t thread_index = psilog_thread_index();
+
+	// In asynchronous mode hand the entry over to the writer thread, which renders it.
+	// The ring slots keep their string capacity, so copying doesn't allocate.
+	if (_async_state != ASYNC_OFF) {
+		bool pushed = push_async([&] (PSILogAsyncEntry &async_entry) {
+			async_entry.entry.assign(entry, length);
+			async_entry.log_level = log_level;
+			async_entry.site = nullptr;
+			async_entry.render = nullptr;
+			async_entry.timestamp = timestamp;
+			async_entry.thread_id = thread_id;
+			async_entry.thread_index = thread_index;
+		});
+
+		if (pushed == true) {
+			return;
+		}
+	}
+
+	PSILogRenderCacheLease lease;
+
+	PSILogRecord record;
+	record.log_level = log_level;
+	record.timestamp = timestamp;
+	record.thread_id = thread_id;
+	record.thread_index = thread_index;
+	record.message = entry;
+	record.message_length = length;
+	record.layout = &_layout;
+	record.cache = &lease.get();
+	write_to_outputs(record);
+}
+
+// Copy the payload to the writer thread, or render it right away when synchronous
+void PSILog::log_deferred_payload(const PSILogCallSite &site, PSILogRenderFunc render,
+				  const std::string &payload, int log_level) {
+	auto timestamp = std::chrono::system_clock::now();
+
+	if (_backtrace_size != 0) {
+		// Kept unformatted, rendered only if an error comes
+		if (is_backtraced(log_level) == true) {
+			PSILogAsyncEntry &kept = get_thread_backtrace().push(_backtrace_size);
+			kept.entry.assign(payload);
+			kept.log_level = log_level;
+			kept.site = &site;
+			kept.render = render;
+			kept.timestamp = timestamp;
+			return;
+		}
+
+		if ((log_level & LogLevel::ERR) != 0) {
+			write_backtrace();
+		}
+	}
+
+	write_deferred(site, render, payload, log_level, timestamp);
+}
+
+void PSILog::write_deferred(const PSILogCallSite &site, PSILogRenderFunc render,
+			    const std::string &payload, int log_level,
+			    std::chrono::system_clock::time_point timestamp) {
+	std::thread::id thread_id = std::this_thread::get_id();
+	uint32_t thread_index = psilog_thread_index();
+
+	if (_async_state != ASYNC_OFF) {
+		bool pushed = push_async([&] (PSILogAsyncEntry &async_entry) {
+			async_entry.entry.assign(payload);
+			async_entry.log_level = log_level;
+			async_entry.site = &site;
+			async_entry.render = render;
+			async_entry.timestamp = timestamp;
+			async_entry.thread_id = thread_id;
+			async_entry.thread_index = thread_index;
+		});
+
+		if (pushed == true) {
+			return;
+		}
+	}
+
+	// Rendered only if an output asks for the text
+	PSILogRenderCacheLease lease;
+
+	PSILogRecord record;
+	record.log_level = log_level;
+	record.timestamp = timestamp;
+	record.thread_id = thread_id;
+	record.thread_index = thread_index;
+	record.site = &site;
+	record.render = render;
+	record.payload = payload.data();
+	record.payload_length = payload.size();
+	record.layout = &_layout;
+	record.cache = &lease.get();
+	write_to_outputs(record);
+}
+
+// The time and thread are those of the logging call
+PSILogRecord PSILog::get_async_record(const PSILogAsyncEntry &async_entry) const {
+	PSILogRecord record;
+	record.log_level = async_entry.log_level;
+	record.timestamp = async_entry.timestamp;
+	record.thread_id = async_entry.thread_id;
+	record.thread_index = async_entry.thread_index;
+	record.layout = &_layout;
 
-	// Insert the prefix in the beginning of the entry
-	if (get_add_prefix() == true) {
-		std::string prefix = get_log_entry_prefix(entry);
-		entry_ss << prefix << entry;
+	if (async_entry.site != nullptr) {
+		record.site = async_entry.site;
+		record.render = async_entry.render;
+		record.payload = async_entry.entry.data();
+		record.payload_length = async_entry.entry.size();
 	} else {
-		entry_ss << entry;
+		record.message = async_entry.entry.data();
+		record.message_length = async_entry.entry.size();
 	}
 
+	return record;
+}
+
+PSILogThreadBuffer &PSILog::get_deferred_buffer() {
+	static thread_local PSILogThreadBuffer buffer;
+	return buffer;
+}
+
+PSILogThreadBuffer &PSILog::get_format_buffer() {
+	static thread_local PSILogThreadBuffer buffer;
+	return buffer;
+}
+
+// Write the record to all of our outputs
+void PSILog::write_to_outputs(const PSILogRecord &record) {
 	// Add default output if we don't have any outputters
-	if (_outputs.size() == 0) {
-		add_output(make_unique<PSILogConsoleOutput>());
+	if (_outputs.load() == &_no_outputs) {
+		add_default_output();
 	}
 
-	// Write to all of our outputs
-	for (const auto &outputter : _outputs) {
-		outputter->write_log_entry(entry_ss.str(), log_level);
+	OutputsSnapshot snapshot(*this);
+	const auto &outputs = snapshot.get();
+	for (size_t i = 0; i < outputs.size(); i++) {
+		if (outputs[i]->get_retains_entries() == false) {
+			write_through_breaker(outputs, i, 1, [&] {
+				return outputs[i]->write_log_record(record);
+			});
+		}
 	}
+
+	write_to_retaining_outputs(outputs, record);
 }
 
-// Get the default log entry prefix, return a timestamp for now
-// TODO: provide a way for the user to override this method, to implement custom
-// prefixes easily
-std::string PSILog::get_log_entry_prefix(const std::string &log_entry) const {
-	std::string formatted;
-	std::stringstream ss;
-	std::thread::id thread_id = std::this_thread::get_id();
+// Outputs keeping the entries get them one by one
+void PSILog::write_batch_to_outputs(const PSILogRecord *records, size_t count) {
+	if (_outputs.load() == &_no_outputs) {
+		add_default_output();
+	}
 
-	// Append time and current thread id to the entry
-	auto t = std::time(nullptr);
-	auto tm = *std::localtime(&t);
-	ss << std::put_time(&tm, "[%H:%M:%S] ") << "[" << thread_id << "] ";
+	OutputsSnapshot snapshot(*this);
+	const auto &outputs = snapshot.get();
+	for (size_t i = 0; i < outputs.size(); i++) {
+		if (outputs[i]->get_retains_entries() == false) {
+			write_through_breaker(outputs, i, count, [&] {
+				return outputs[i]->write_log_entries(records, count);
+			});
+		}
+	}
 
-	return ss.str();
+	for (size_t i = 0; i < count; i++) {
+		write_to_retaining_outputs(outputs, records[i]);
+	}
 }
 
-// Message all of our outputters to flush their output
-void PSILog::flush() {
-	for (const auto &outputter : _outputs) {
-		outputter->flush();
+// One shared copy of the text for each layout, usually there is only one
+void PSILog::write_to_retaining_outputs(const std::vector<std::shared_ptr<PSILogOutput>> &outputs,
+					const PSILogRecord &record) {
+	PSILogSharedEntry shared_entry;
+	const PSILogLayout *shared_layout = nullptr;
+
+	for (size_t i = 0; i < outputs.size(); i++) {
+		const auto &outputter = outputs[i];
+		if (outputter->get_retains_entries() == false) {
+			continue;
+		}
+
+		// Not rendered at all for a tripped output
+		write_through_breaker(outputs, i, 1, [&] {
+			if (shared_entry == nullptr || outputter->get_layout() != shared_layout) {
+				shared_entry = std::make_shared<const std::string>(outputter->get_text(record));
+				shared_layout = outputter->get_layout();
+			}
+			return outputter->write_shared_log_entry(shared_entry, record.log_level);
+		});
 	}
 }
 
-// Add output destination to our chain of outputs
-void PSILog::add_output(std::unique_ptr<PSILogOutput> output) {
-	assert(output != nullptr);
-	_outputs.push_back(std::move(output));
+// Without a breaker enabled, this is just the write
+template <typename Write>
+void PSILog::write_through_breaker(const std::vector<std::shared_ptr<PSILogOutput>> &outputs,
+				   size_t index, size_t entries, Write write) {
+	PSILogBreaker &breaker = outputs[index]->get_breaker();
+	if (breaker.get_enabled() == false) {
+		write();
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	PSILogBreaker::Decision decision = breaker.allow(start, entries);
+	if (decision == PSILogBreaker::BREAKER_SKIP) {
+		return;
+	}
+
+	bool success = write();
+	PSILogBreaker::Change change = breaker.record(decision, success, std::chrono::steady_clock::now() - start);
+	if (change != PSILogBreaker::BREAKER_UNCHANGED) {
+		write_breaker_change(outputs, index, change);
+	}
 }
 
-// Default console output implementation
-// Write the the log entry to console
-bool PSILogConsoleOutput::write_log_entry(const std::string &log_entry, int log_level) {
-	// Log errors to stderr
-	if (log_level == PSILog::ERR) {
-		std::cerr << log_entry;
-		std::cerr.flush();
+// Written straight to the outputs not tripped, a recovered output included,
+// so the gap in its entries is explained
+void PSILog::write_breaker_change(const std::vector<std::shared_ptr<PSILogOutput>> &outputs,
+				  size_t index, int change) {
+	PSILogOutput &changed = *outputs[index];
+	PSILogBreaker &breaker = changed.get_breaker();
+
+	std::string message = "Log output ";
+	if (changed.get_name().empty() == true) {
+		message += "#";
+		psilog_append(message, (unsigned long long)index + 1);
 	} else {
-		std::cout << log_entry;
-		std::cout.flush();
+		message += changed.get_name();
 	}
 
-	return true;
+	if (change == PSILogBreaker::BREAKER_TRIPPED) {
+		message += " tripped after ";
+		psilog_append(message, (unsigned long long)breaker.get_failure_limit());
+		message += " failed or slow writes, skipping it\n";
+	} else {
+		message += " recovered, ";
+		psilog_append(message, (unsigned long long)breaker.take_skipped());
+		message += " entries skipped\n";
+	}
+
+	PSILogRenderCacheLease lease;
+
+	PSILogRecord record;
+	record.log_level = LogLevel::WARN;
+	record.timestamp = std::chrono::system_clock::now();
+	record.thread_id = std::this_thread::get_id();
+	record.thread_index = psilog_thread_index();
+	record.message = message.data();
+	record.message_length = message.size();
+	record.layout = &_layout;
+	record.cache = &lease.get();
+
+	for (const auto &outputter : outputs) {
+		if (outputter->get_breaker().get_tripped() == false) {
+			outputter->write_log_record(record);
+		}
+	}
 }
 
-void PSILogConsoleOutput::flush() {
-	std::cerr.flush();
-	std::cout.flush();
+void PSILog::set_backtrace(size_t size, int levels) {
+	_backtrace_size = size;
+	_backtrace_levels = levels;
+	update_logged();
 }
 
-// Default file output implementation
-PSILogFileOutput::PSILogFileOutput(const char *output_path) {
-	//fprintf(stderr, "Initialized FileOutput with output_path = %s\n", output_path);
-	_output_path = output_path;
+// The backtrace holds at most the backtrace size entries, and goes away with the
+// thread, so threads logging only synchronously don't register a ring with us
+PSILogBacktrace &PSILog::get_thread_backtrace() {
+	for (auto it = thread_backtraces.begin(); it != thread_backtraces.end(); ) {
+		if (it->logger_id == _id) {
+			return it->backtrace;
+		}
 
-	// Open the file for appending at the end of the log file
-	_fs.open(output_path, std::fstream::out | std::fstream::app);
+		// Prune backtraces of destroyed loggers while we are at it
+		if (it->logger_alive.expired() == true) {
+			it = thread_backtraces.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	thread_backtraces.push_back({ _id, _alive, PSILogBacktrace() });
+
+	return thread_backtraces.back().backtrace;
 }
 
-PSILogFileOutput::~PSILogFileOutput() {
-	_fs.close();
+// Write the kept entries in the order they were logged, before the error that
+// triggered writing them
+void PSILog::write_backtrace() {
+	PSILogBacktrace &backtrace = get_thread_backtrace();
+	if (backtrace.size() == 0) {
+		return;
+	}
+
+	backtrace.drain([this] (const PSILogAsyncEntry &kept) {
+		if (kept.site != nullptr) {
+			write_deferred(*kept.site, kept.render, kept.entry, kept.log_level, kept.timestamp);
+		} else {
+			write_entry(kept.entry.data(), kept.entry.size(), kept.log_level, kept.timestamp);
+		}
+	});
 }
 
-void PSILogFileOutput::flush() {
-	_fs.flush();
+void PSILog::install_crash_handler() {
+	if (_emergency_text == nullptr) {
+		_emergency_text.reset(new char[EMERGENCY_ENTRY_SIZE]);
+	}
+
+	// Kept up to date by the prefix rendering from here on
+	std::time_t now = std::time(nullptr);
+	struct tm tm;
+	localtime_r(&now, &tm);
+	crash_utc_offset.store(tm.tm_gmtoff);
+
+	PSILog *previous = crash_logger.exchange(this);
+	if (previous != nullptr) {
+		return;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = crash_handler;
+	sigemptyset(&action.sa_mask);
+
+	for (size_t i = 0; i < CRASH_SIGNAL_COUNT; i++) {
+		sigaction(crash_signals[i], &action, &previous_crash_actions[i]);
+	}
 }
 
-// Write the the log entry to our file
-bool PSILogFileOutput::write_log_entry(const std::string &log_entry, int log_level) {
-	// The operations should already be thread safe, but let's just make sure
-	// file operations are guarded behind a mutex
-	std::lock_guard<std::mutex> guard(_mutex);
+void PSILog::uninstall_crash_handler() {
+	PSILog *expected = this;
+	if (crash_logger.compare_exchange_strong(expected, nullptr) == true) {
+		restore_crash_actions();
+	}
+}
 
-	_fs << log_entry;
-	_fs.flush();
+void PSILog::write_emergency(int signal) {
+	// Without registering as a reader, waiting for us would hang a thread replacing
+	// the outputs. Replacing them at the moment of the crash is unlikely enough.
+	const auto &outputs = _outputs.load()->outputs;
 
-	return true;
+	// Entries the outputs have buffered came before the ones still in the rings
+	for (const auto &outputter : outputs) {
+		outputter->flush_emergency();
+	}
+
+	// The writer thread sees crash_handling and stops freeing rings, wait for
+	// one it is already freeing. Nanosleep is async-signal-safe.
+	for (int waited = 0; _rings_freeing.load() == true && waited < CRASH_RING_WAIT_MS; waited++) {
+		struct timespec delay = { 0, 1000000 };
+		nanosleep(&delay, nullptr);
+	}
+
+	// Consuming with the CAS of the rings is safe even if the writer thread is
+	// in the middle of consuming from the same ring
+	PSILogEmergencyText text { _emergency_text.get(), EMERGENCY_ENTRY_SIZE, 0 };
+	bool add_prefix = _layout.get_add_prefix();
+	for (RingNode *node = _rings.load(); node != nullptr; node = node->next) {
+		const PSILogRing &ring = *node->ring;
+		while (node->ring->consume_one([&text, &outputs, &ring, add_prefix] (PSILogAsyncEntry &async_entry) {
+			text.length = 0;
+			if (add_prefix == true) {
+				emergency_append_prefix(text, std::chrono::system_clock::to_time_t(async_entry.timestamp), ring);
+			}
+
+			if (async_entry.site != nullptr) {
+				emergency_render_deferred(text, *async_entry.site, async_entry.entry.data(), async_entry.entry.size());
+				text.append('\n');
+			} else {
+				text.append(async_entry.entry.data(), async_entry.entry.size());
+			}
+
+			// A cut entry still ends the line
+			if (text.length == text.capacity) {
+				text.data[text.length - 1] = '\n';
+			}
+
+			for (const auto &outputter : outputs) {
+				outputter->write_emergency(text.data, text.length, async_entry.log_level);
+			}
+		}) == true) {
+		}
+	}
+
+	// Signal names by hand, strsignal() is not async-signal-safe
+	const char *name = "signal";
+	switch (signal) {
+	case SIGSEGV: name = "SIGSEGV"; break;
+	case SIGBUS: name = "SIGBUS"; break;
+	case SIGFPE: name = "SIGFPE"; break;
+	case SIGILL: name = "SIGILL"; break;
+	case SIGABRT: name = "SIGABRT"; break;
+	}
+
+	char marker[128];
+	size_t length = 0;
+	auto append = [&marker, &length] (const char *text) {
+		while (*text != '\0' && length < sizeof(marker) - 1) {
+			marker[length++] = *text++;
+		}
+	};
+
+	char number[16];
+	int digits = 0;
+	for (int value = signal; digits == 0 || value > 0; value /= 10) {
+		number[digits++] = '0' + value % 10;
+	}
+	std::reverse(number, number + digits);
+	number[digits] = '\0';
+
+	append("*** Crashed with ");
+	append(name);
+	append(" (");
+	append(number);
+	append("), pending log entries written ***\n");
+
+	for (const auto &outputter : outputs) {
+		outputter->write_emergency(marker, length, LogLevel::ERR);
+	}
+}
+
+static std::string thread_id_text(std::thread::id thread_id);
+
+// Find the ring of the calling thread, creating one on the first call
+PSILogRing *PSILog::get_thread_ring() {
+	for (auto it = thread_rings.begin(); it != thread_rings.end(); ) {
+		if (it->logger_id == _id) {
+			return it->ring.get();
+		}
+
+		// Prune rings of destroyed loggers while we are at it
+		if (it->ring->get_closed() == true) {
+			it = thread_rings.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	// Register a new ring, pushing to the head of our list of rings
+	auto ring = std::make_shared<PSILogRing>(_async_queue_size);
+	ring->set_thread_text(thread_id_text(std::this_thread::get_id()));
+	RingNode *node = new RingNode { ring, _rings.load() };
+	while (_rings.compare_exchange_weak(node->next, node) == false) {
+	}
+
+	thread_rings.push_back({ _id, ring });
+	_async_ring_count++;
+
+	return ring.get();
+}
+
+// Write everything currently in the rings to our outputs
+size_t PSILog::drain_rings() {
+	size_t written = 0;
+	uint64_t dropped = 0;
+	RingNode *prev = nullptr;
+	RingNode *node = _rings.load();
+
+	// Entries are copied out of the ring before writing, so that the slot is
+	// free again while the outputs are busy. The slots and our batch keep their
+	// string capacity, so once they have grown copying doesn't allocate.
+	// Swapping the strings instead would circulate the slot strings through
+	// the batch, and a producer could get a short one back for a long entry.
+	static thread_local PSILogAsyncEntry async_entries[ASYNC_BATCH_SIZE];
+	static thread_local PSILogRenderCache render_caches[ASYNC_BATCH_SIZE];
+	PSILogRecord batch[ASYNC_BATCH_SIZE];
+
+	while (node != nullptr) {
+		PSILogRing *ring = node->ring.get();
+		size_t ring_written = 0;
+
+		// Up to the capacity in batches, so that a busy thread doesn't keep us here
+		while (ring_written < ring->get_capacity()) {
+			size_t count = 0;
+			while (count < ASYNC_BATCH_SIZE && ring_written + count < ring->get_capacity()) {
+				PSILogAsyncEntry &async_entry = async_entries[count];
+				bool consumed = ring->consume_one([&async_entry] (PSILogAsyncEntry &slot_entry) {
+					async_entry.entry.assign(slot_entry.entry);
+					async_entry.log_level = slot_entry.log_level;
+					async_entry.site = slot_entry.site;
+					async_entry.render = slot_entry.render;
+					async_entry.timestamp = slot_entry.timestamp;
+					async_entry.thread_id = slot_entry.thread_id;
+					async_entry.thread_index = slot_entry.thread_index;
+				});
+
+				if (consumed == false) {
+					break;
+				}
+
+				// Rendered by the outputs wanting text, each layout once
+				render_caches[count].count = 0;
+				batch[count] = get_async_record(async_entry);
+				batch[count].cache = &render_caches[count];
+				count++;
+			}
+
+			if (count == 0) {
+				break;
+			}
+
+			// The slots are free again, let threads waiting on a full ring go on
+			// while we write
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (_async_blocked.load() > 0) {
+				std::lock_guard<std::mutex> guard(_async_wake_mutex);
+				_async_not_full.notify_all();
+			}
+
+			write_batch_to_outputs(batch, count);
+			ring_written += count;
+		}
+		written += ring_written;
+		dropped += node->ring->take_dropped();
+
+		RingNode *next = node->next;
+
+		// The thread that owned this ring has exited if we hold the only
+		// reference, free the ring once it's empty
+		bool orphaned = false;
+		if (node->ring.use_count() == 1) {
+			std::atomic_thread_fence(std::memory_order_acquire);
+			orphaned = node->ring->empty();
+		}
+
+		// The crash handler walks the rings without a lock, so none are freed once
+		// it has started. The flag is set before checking, so that the handler
+		// either sees us freeing, or we see it handling the crash.
+		if (orphaned == true) {
+			_rings_freeing.store(true);
+			if (crash_handling.load() == true) {
+				_rings_freeing.store(false);
+				orphaned = false;
+			}
+		}
+
+		if (orphaned == true) {
+			// Unlinking the head races with threads registering new rings,
+			// in which case the node is found again from the new head
+			RingNode *expected = node;
+			if (prev == nullptr && _rings.compare_exchange_strong(expected, next) == false) {
+				prev = _rings.load();
+				while (prev->next != node) {
+					prev = prev->next;
+				}
+			}
+
+			if (prev != nullptr) {
+				prev->next = next;
+			}
+
+			delete node;
+			_async_ring_count--;
+			_rings_freeing.store(false);
+		} else {
+			prev = node;
+		}
+
+		node = next;
+	}
+
+	// Let the outputs know we have lost entries
+	if (dropped > 0) {
+		_async_dropped += dropped;
+		std::string message;
+		psilog_append(message, (unsigned long long)dropped);
+		message += " messages dropped\n";
+
+		PSILogRenderCacheLease lease;
+
+		PSILogRecord record;
+		record.log_level = LogLevel::WARN;
+		record.timestamp = std::chrono::system_clock::now();
+		record.thread_id = std::this_thread::get_id();
+		record.thread_index = psilog_thread_index();
+		record.message = message.data();
+		record.message_length = message.size();
+		record.layout = &_layout;
+		record.cache = &lease.get();
+		write_to_outputs(record);
+	}
+
+	return written;
+}
+
+// Check if all of the rings are empty, and if any thread is in the middle of a push
+bool PSILog::rings_empty() const {
+	for (RingNode *node = _rings.load(); node != nullptr; node = node->next) {
+		if (node->ring->empty() == false) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool PSILog::rings_idle() const {
+	for (RingNode *node = _rings.load(); node != nullptr; node = node->next) {
+		if (node->ring->get_producer_active() == true) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void PSILog::wake_async_thread() {
+	std::lock_guard<std::mutex> guard(_async_wake_mutex);
+	_async_wake.notify_one();
+}
+
+// Start or stop the asynchronous writer thread
+void PSILog::set_async(bool async) {
+	std::lock_guard<std::mutex> guard(_async_mutex);
+
+	if (async == true) {
+		if (_async_state != ASYNC_OFF) {
+			return;
+		}
+
+		_async_state = ASYNC_RUNNING;
+		_async_thread = std::thread(&PSILog::async_thread_main, this);
+	} else {
+		if (_async_state != ASYNC_RUNNING) {
+			return;
+		}
+
+		// The writer thread drains the rings before exiting, logging threads
+		// wait for that before going back to writing directly
+		_async_state = ASYNC_STOPPING;
+		wake_async_thread();
+		_async_thread.join();
+	}
+}
+
+// Asynchronous writer thread, drains the rings of all threads without taking
+// any locks, and sleeps when there is nothing to write
+void PSILog::async_thread_main() {
+	while (true) {
+		uint64_t flush_requested = _flush_requested.load();
+
+		// When stopping, wait until no thread is in the middle of a push.
+		// After that nothing new can appear in the rings, so one more drain
+		// writes everything.
+		bool stopping = _async_state == ASYNC_STOPPING && rings_idle() == true;
+
+		size_t written = drain_rings();
+
+		// Everything pushed before the flush() call has now been written
+		if (flush_requested != _flush_completed.load()) {
+			std::lock_guard<std::mutex> guard(_async_wake_mutex);
+			_flush_completed = flush_requested;
+			_async_flushed.notify_all();
+		}
+
+		if (stopping == true) {
+			break;
+		}
+
+		if (written > 0) {
+			continue;
+		}
+
+		// Let the outputs do their timed work while we are idle
+		{
+			OutputsSnapshot snapshot(*this);
+			for (const auto &outputter : snapshot.get()) {
+				if (outputter->get_breaker().get_tripped() == false) {
+					outputter->tick();
+				}
+			}
+		}
+
+		std::unique_lock<std::mutex> lock(_async_wake_mutex);
+		_async_sleeping = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (rings_empty() == true && _async_state == ASYNC_RUNNING &&
+		    _flush_requested.load() == _flush_completed.load()) {
+			_async_wake.wait_for(lock, std::chrono::milliseconds(ASYNC_IDLE_WAIT_MS));
+		}
+
+		_async_sleeping = false;
+	}
+
+	std::lock_guard<std::mutex> guard(_async_wake_mutex);
+	_async_state = ASYNC_OFF;
+	_async_flushed.notify_all();
+}
+
+// PSILogRing implementation
+PSILogRing::PSILogRing(size_t capacity) {
+	_capacity = 2;
+	while (_capacity < capacity) {
+		_capacity <<= 1;
+	}
+
+	_mask = _capacity - 1;
+	_slots.reset(new Slot[_capacity]);
+
+	// A slot is free for the producer when its sequence equals the push position
+	for (uint64_t i=0; i<_capacity; i++) {
+		_slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+}
+
+// Get the default log entry prefix, return a timestamp for now
+// TODO: provide a way for the user to override this method, to implement custom
+// prefixes easily
+std::string PSILog::get_log_entry_prefix(const std::string &log_entry) const {
+	return get_log_entry_prefix(std::time(nullptr), std::this_thread::get_id());
+}
+
+std::string PSILog::get_log_entry_prefix(std::time_t time, std::thread::id thread_id) const {
+	std::string prefix;
+	append_log_entry_prefix(prefix, time, thread_id);
+
+	return prefix;
+}
+
+// Cached prefix parts of the current thread
+// The time text only changes once a second, and the thread id text never,
+// so they are rendered once and reused for all the entries in between
+struct PSILogPrefixCache {
+	// Second the time text was rendered for
+	std::time_t second = 0;
+	bool second_valid = false;
+	char time_text[16];
+	size_t time_length = 0;
+
+	// Local time offset from UTC, valid for the period starting at offset_start
+	std::time_t offset_start = 0;
+	bool offset_valid = false;
+	long utc_offset = 0;
+
+	// Id texts of the calling thread, and of the other threads, for the writer
+	// thread rendering the prefixes. Threads with a thread index are looked up
+	// by it, in slots shared by the indexes with the same remainder, so that
+	// threads coming and going don't grow the cache. For the others the text
+	// of the last one seen is kept.
+	struct ThreadText {
+		uint32_t thread_index = 0;
+		std::string text;
+	};
+	std::string this_thread_text;
+	std::vector<ThreadText> thread_texts;
+	std::thread::id other_thread_id;
+	std::string other_thread_text;
+};
+
+// Slots for the id texts of other threads, only allocated by the threads rendering them
+static const size_t PREFIX_THREAD_SLOTS = 256;
+
+// Time zone offsets are multiples of 15 minutes, and change on those boundaries too,
+// so the offset is looked up with localtime_r only once per such period
+// This also means changes to the TZ environment take effect at the next period
+static const std::time_t UTC_OFFSET_PERIOD = 15 * 60;
+
+static thread_local PSILogPrefixCache prefix_cache;
+
+// Render "[HH:MM:SS] " for time into the cache
+static void render_prefix_time(PSILogPrefixCache &cache, std::time_t time) {
+	std::time_t period_start = time - ((time % UTC_OFFSET_PERIOD) + UTC_OFFSET_PERIOD) % UTC_OFFSET_PERIOD;
+	if (cache.offset_valid == false || cache.offset_start != period_start) {
+		struct tm tm;
+		localtime_r(&time, &tm);
+		cache.utc_offset = tm.tm_gmtoff;
+		crash_utc_offset.store(cache.utc_offset, std::memory_order_relaxed);
+		cache.offset_start = period_start;
+		cache.offset_valid = true;
+	}
+
+	long seconds_of_day = (long)((time + cache.utc_offset) % 86400);
+	if (seconds_of_day < 0) {
+		seconds_of_day += 86400;
+	}
+
+	int hours = (int)(seconds_of_day / 3600);
+	int minutes = (int)(seconds_of_day / 60 % 60);
+	int seconds = (int)(seconds_of_day % 60);
+
+	char *p = cache.time_text;
+	*p++ = '[';
+	*p++ = '0' + hours / 10;
+	*p++ = '0' + hours % 10;
+	*p++ = ':';
+	*p++ = '0' + minutes / 10;
+	*p++ = '0' + minutes % 10;
+	*p++ = ':';
+	*p++ = '0' + seconds / 10;
+	*p++ = '0' + seconds % 10;
+	*p++ = ']';
+	*p++ = ' ';
+
+	cache.time_length = p - cache.time_text;
+	cache.second = time;
+	cache.second_valid = true;
+}
+
+static std::string thread_id_text(std::thread::id thread_id) {
+	std::ostringstream ss;
+	ss << thread_id;
+
+	return ss.str();
+}
+
+// Append time and thread id to the entry, thread_index is 0 when not known
+static void append_prefix(std::string &out, std::time_t time, std::thread::id thread_id, uint32_t thread_index) {
+	PSILogPrefixCache &cache = prefix_cache;
+
+	if (cache.second_valid == false || cache.second != time) {
+		render_prefix_time(cache, time);
+	}
+	out.append(cache.time_text, cache.time_length);
+
+	out += '[';
+	if (thread_id == std::this_thread::get_id()) {
+		if (cache.this_thread_text.empty() == true) {
+			cache.this_thread_text = thread_id_text(thread_id);
+		}
+		out += cache.this_thread_text;
+	} else if (thread_index != 0) {
+		if (cache.thread_texts.empty() == true) {
+			cache.thread_texts.resize(PREFIX_THREAD_SLOTS);
+		}
+
+		// The slot may still have a thread that has come before us
+		PSILogPrefixCache::ThreadText &slot = cache.thread_texts[thread_index % PREFIX_THREAD_SLOTS];
+		if (slot.thread_index != thread_index) {
+			slot.thread_index = thread_index;
+			slot.text = thread_id_text(thread_id);
+		}
+		out += slot.text;
+	} else {
+		if (cache.other_thread_text.empty() == true || cache.other_thread_id != thread_id) {
+			cache.other_thread_id = thread_id;
+			cache.other_thread_text = thread_id_text(thread_id);
+		}
+		out += cache.other_thread_text;
+	}
+	out += "] ";
+}
+
+void PSILog::append_log_entry_prefix(std::string &out, std::time_t time, std::thread::id thread_id) const {
+	append_prefix(out, time, thread_id, 0);
+}
+
+// PSILogRecord implementation
+void PSILogRecord::append_message(std::string &out) const {
+	if (site != nullptr && render != nullptr) {
+		render(site->get_format(), payload, out);
+		out += '\n';
+	} else {
+		out.append(message, message_length);
+	}
+}
+
+// Records made outside of the logger have no cache, they are rendered on every call
+static thread_local std::string uncached_text;
+
+const std::string &PSILogRecord::get_text(const PSILogLayout &text_layout) const {
+	if (cache == nullptr) {
+		uncached_text.clear();
+		text_layout.render(*this, uncached_text);
+		return uncached_text;
+	}
+
+	for (size_t i = 0; i < cache->count; i++) {
+		if (cache->layouts[i] == &text_layout) {
+			return cache->texts[i];
+		}
+	}
+
+	size_t i = cache->count < PSILogRenderCache::MAX_LAYOUTS ? cache->count++ : PSILogRenderCache::MAX_LAYOUTS - 1;
+	cache->layouts[i] = &text_layout;
+	cache->texts[i].clear();
+	text_layout.render(*this, cache->texts[i]);
+
+	return cache->texts[i];
+}
+
+static const PSILogTextLayout default_layout;
+
+const std::string &PSILogRecord::get_entry() const {
+	return get_text(layout != nullptr ? *layout : default_layout);
+}
+
+// PSILogTextLayout implementation
+void PSILogTextLayout::render(const PSILogRecord &record, std::string &out) const {
+	if (_add_prefix == true) {
+		append_prefix(out, std::chrono::system_clock::to_time_t(record.timestamp),
+			      record.thread_id, record.thread_index);
+	}
+
+	record.append_message(out);
+}
+
+// PSILogJsonLayout implementation
+static const char *json_level_name(int log_level) {
+	switch (log_level) {
+	case PSILog::INFO: return "INFO";
+	case PSILog::WARN: return "WARN";
+	case PSILog::ERR: return "ERR";
+	case PSILog::FREQ: return "FREQ";
+	}
+
+	return "NONE";
+}
+
+// Quote the text as a JSON string, escaping the quotes, backslashes and control characters
+static void append_json_string(std::string &out, const char *text, size_t length) {
+	static const char hex[] = "0123456789abcdef";
+
+	out += '"';
+	for (size_t i = 0; i < length; i++) {
+		unsigned char c = (unsigned char)text[i];
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if (c < 0x20) {
+				out += "\\u00";
+				out += hex[c >> 4];
+				out += hex[c & 0xf];
+			} else {
+				out += (char)c;
+			}
+		}
+	}
+	out += '"';
+}
+
+void PSILogJsonLayout::render(const PSILogRecord &record, std::string &out) const {
+	// Deferred entries are rendered here first, as the text needs escaping
+	static thread_local std::string message;
+	message.clear();
+	record.append_message(message);
+
+	size_t length = message.size();
+	if (length > 0 && message[length - 1] == '\n') {
+		length--;
+	}
+
+	out += "{\"time\":";
+	psilog_append(out, (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		record.timestamp.time_since_epoch()).count());
+	out += ",\"level\":\"";
+	out += json_level_name(record.log_level);
+	out += "\",\"thread\":";
+	psilog_append(out, (unsigned long long)record.thread_index);
+
+	if (record.site != nullptr) {
+		out += ",\"file\":";
+		append_json_string(out, record.site->get_file(), strlen(record.site->get_file()));
+		out += ",\"line\":";
+		psilog_append(out, (long long)record.site->get_line());
+	}
+
+	out += ",\"message\":";
+	append_json_string(out, message.data(), length);
+	out += "}\n";
+}
+
+// PSILogStreamBuf implementation
+// Pool of stream buffers of the current thread, usually only the first one is
+// ever used, more are created when streams are nested
+static thread_local std::vector<std::unique_ptr<PSILogStreamBuf>> stream_buf_pool;
+
+PSILogStreamBuf *PSILogStreamBuf::acquire() {
+	PSILogStreamBuf *buf = nullptr;
+	for (const auto &pooled : stream_buf_pool) {
+		if (pooled->_in_use == false) {
+			buf = pooled.get();
+			break;
+		}
+	}
+
+	if (buf == nullptr) {
+		stream_buf_pool.push_back(make_unique<PSILogStreamBuf>());
+		buf = stream_buf_pool.back().get();
+		buf->reserve(INITIAL_CAPACITY);
+	}
+
+	buf->_in_use = true;
+	buf->setp(buf->_buffer.get(), buf->_buffer.get() + buf->_capacity);
+
+	return buf;
+}
+
+void PSILogStreamBuf::release(PSILogStreamBuf *buf) {
+	buf->_in_use = false;
+}
+
+PSILogStreamBuf::int_type PSILogStreamBuf::overflow(int_type c) {
+	if (traits_type::eq_int_type(c, traits_type::eof()) == true) {
+		return traits_type::not_eof(c);
+	}
+
+	reserve(1);
+	*pptr() = traits_type::to_char_type(c);
+	pbump(1);
+
+	return c;
+}
+
+std::streamsize PSILogStreamBuf::xsputn(const char *s, std::streamsize count) {
+	reserve(count);
+	memcpy(pptr(), s, count);
+	pbump(count);
+
+	return count;
+}
+
+void PSILogStreamBuf::reserve(size_t count) {
+	size_t used = pptr() - pbase();
+	if (_capacity - used >= count) {
+		return;
+	}
+
+	size_t capacity = _capacity > 0 ? _capacity : (size_t)INITIAL_CAPACITY;
+	while (capacity - used < count) {
+		capacity *= 2;
+	}
+
+	std::unique_ptr<char[]> buffer(new char[capacity]);
+	if (used > 0) {
+		memcpy(buffer.get(), _buffer.get(), used);
+	}
+
+	_buffer = move(buffer);
+	_capacity = capacity;
+	setp(_buffer.get(), _buffer.get() + _capacity);
+	pbump(used);
+}
+
+// Message all of our outputters to flush their output
+void PSILog::flush() {
+	// Wait until the writer thread has written everything queued before this call
+	if (_async_state != ASYNC_OFF) {
+		uint64_t request = ++_flush_requested;
+		std::unique_lock<std::mutex> lock(_async_wake_mutex);
+		_async_wake.notify_one();
+		_async_flushed.wait(lock, [this, request] {
+			return _flush_completed >= request || _async_state == ASYNC_OFF;
+		});
+	}
+
+	OutputsSnapshot snapshot(*this);
+	for (const auto &outputter : snapshot.get()) {
+		if (outputter->get_breaker().get_tripped() == false) {
+			outputter->flush();
+		}
+	}
+}
+
+// Add output destination to our chain of outputs
+void PSILog::add_output(std::unique_ptr<PSILogOutput> output) {
+	assert(output != nullptr);
+	std::lock_guard<std::mutex> guard(_outputs_mutex);
+
+	OutputList *list = new OutputList(*_outputs.load());
+	list->outputs.push_back(std::shared_ptr<PSILogOutput>(std::move(output)));
+	replace_outputs(list);
+}
+
+bool PSILog::remove_output(PSILogOutput *output) {
+	std::shared_ptr<PSILogOutput> removed;
+	{
+		std::lock_guard<std::mutex> guard(_outputs_mutex);
+
+		const OutputList *current = _outputs.load();
+		auto it = std::find_if(current->outputs.begin(), current->outputs.end(),
+			[output] (const std::shared_ptr<PSILogOutput> &outputter) { return outputter.get() == output; });
+		if (it == current->outputs.end()) {
+			return false;
+		}
+		removed = *it;
+
+		if (current->outputs.size() == 1) {
+			replace_outputs(&_no_outputs);
+		} else {
+			OutputList *list = new OutputList(*current);
+			list->outputs.erase(list->outputs.begin() + (it - current->outputs.begin()));
+			replace_outputs(list);
+		}
+	}
+
+	// Destroyed here, outside of the lock, as no reader has it anymore
+	removed.reset();
+
+	return true;
+}
+
+size_t PSILog::get_output_count() const {
+	std::lock_guard<std::mutex> guard(_outputs_mutex);
+	return _outputs.load()->outputs.size();
+}
+
+void PSILog::add_default_output() {
+	std::lock_guard<std::mutex> guard(_outputs_mutex);
+
+	// Another thread may have added the first output already
+	if (_outputs.load() != &_no_outputs) {
+		return;
+	}
+
+	OutputList *list = new OutputList();
+	list->outputs.push_back(std::make_shared<PSILogConsoleOutput>());
+	replace_outputs(list);
+}
+
+// Readers that took the old list registered in the counter of the current epoch, or
+// in the previous one, whose readers the previous replace already waited for
+void PSILog::replace_outputs(const OutputList *list) {
+	const OutputList *old = _outputs.exchange(list);
+	uint64_t epoch = _outputs_epoch.fetch_add(1);
+
+	while (_outputs_readers[epoch & 1].count.load() != 0) {
+		std::this_thread::yield();
+	}
+
+	if (old != &_no_outputs) {
+		delete old;
+	}
+}
+
+// Register in the counter of the current epoch, retrying if the epoch moved on
+// while registering, so the replacing thread is sure to wait for us
+PSILog::OutputsSnapshot::OutputsSnapshot(PSILog &log) {
+	while (true) {
+		uint64_t epoch = log._outputs_epoch.load();
+		_readers = &log._outputs_readers[epoch & 1].count;
+		_readers->fetch_add(1);
+
+		if (log._outputs_epoch.load() == epoch) {
+			break;
+		}
+		_readers->fetch_sub(1);
+	}
+
+	_list = log._outputs.load();
+}
+
+PSILog::OutputsSnapshot::~OutputsSnapshot() {
+	_readers->fetch_sub(1);
+}
+
+// PSILogBreaker implementation
+const int PSILogBreaker::DEFAULT_PROBE_INTERVAL_MS;
+
+void PSILogBreaker::set_thresholds(unsigned failures, std::chrono::nanoseconds latency,
+				   std::chrono::milliseconds probe_interval) {
+	_failure_limit = failures;
+	_latency_limit = latency;
+	_probe_interval = probe_interval;
+}
+
+// Of the threads writing when the probe is due, the one moving the probe time forward probes
+PSILogBreaker::Decision PSILogBreaker::allow(std::chrono::steady_clock::time_point now, size_t entries) {
+	if (get_tripped() == false) {
+		return BREAKER_WRITE;
+	}
+
+	int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+	int64_t probe_at = _probe_at.load();
+	if (now_ns >= probe_at &&
+	    _probe_at.compare_exchange_strong(probe_at, now_ns + (int64_t)_probe_interval.count()) == true) {
+		return BREAKER_PROBE;
+	}
+
+	_skipped += entries;
+	_skipped_total += entries;
+
+	return BREAKER_SKIP;
+}
+
+// Writes allowed before the breaker tripped may still finish after it, only probes close it
+PSILogBreaker::Change PSILogBreaker::record(Decision decision, bool success,
+					    std::chrono::steady_clock::duration latency) {
+	if (success == true && (_latency_limit.count() == 0 || latency <= _latency_limit)) {
+		if (_failures.load(std::memory_order_relaxed) != 0) {
+			_failures = 0;
+		}
+
+		if (decision == BREAKER_PROBE && _tripped.exchange(false) == true) {
+			return BREAKER_RECOVERED;
+		}
+
+		return BREAKER_UNCHANGED;
+	}
+
+	if (decision == BREAKER_PROBE || ++_failures != _failure_limit) {
+		return BREAKER_UNCHANGED;
+	}
+
+	int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	_probe_at = now_ns + (int64_t)_probe_interval.count();
+	_skipped = 0;
+	_trips++;
+	_tripped = true;
+
+	return BREAKER_TRIPPED;
+}
+
+// Default console output implementation
+// Write the the log entry to console
+bool PSILogConsoleOutput::write_log_entry(const std::string &log_entry, int log_level) {
+	// Log errors to stderr
+	if (log_level == PSILog::ERR) {
+		std::cerr << log_entry;
+		std::cerr.flush();
+	} else {
+		std::cout << log_entry;
+		std::cout.flush();
+	}
+
+	return true;
+}
+
+void PSILogConsoleOutput::flush() {
+	std::cerr.flush();
+	std::cout.flush();
+}
+
+bool PSILogConsoleOutput::write_log_entries(const PSILogRecord *records, size_t count) {
+	bool errors = false;
+	bool others = false;
+
+	for (size_t i = 0; i < count; i++) {
+		const std::string &entry = get_text(records[i]);
+		if (records[i].log_level == PSILog::ERR) {
+			std::cerr.write(entry.data(), entry.size());
+			errors = true;
+		} else {
+			std::cout.write(entry.data(), entry.size());
+			others = true;
+		}
+	}
+
+	if (errors == true) {
+		std::cerr.flush();
+	}
+	if (others == true) {
+		std::cout.flush();
+	}
+
+	return true;
+}
+
+// Entries are flushed as they are written, so the streams have nothing pending
+void PSILogConsoleOutput::write_emergency(const char *entry, size_t length, int log_level) {
+	write_all(log_level == PSILog::ERR ? STDERR_FILENO : STDOUT_FILENO, entry, length);
+}
+
+// PSILogFlushPolicy implementation
+PSILogFlushPolicy::PSILogFlushPolicy() :
+	_flush_interval(std::chrono::milliseconds((int)DEFAULT_FLUSH_INTERVAL_MS)),
+	_flush_levels(PSILog::ERR),
+	_last_flush(std::chrono::steady_clock::now())
+{}
+
+bool PSILogFlushPolicy::should_flush(size_t buffered_bytes, int log_level) const {
+	if (buffered_bytes >= _flush_bytes || (log_level & _flush_levels) != 0) {
+		return true;
+	}
+
+	return interval_elapsed();
+}
+
+bool PSILogFlushPolicy::interval_elapsed() const {
+	return _flush_interval.count() > 0 &&
+	       std::chrono::steady_clock::now() - _last_flush >= _flush_interval;
+}
+
+void PSILogFlushPolicy::flushed() {
+	_last_flush = std::chrono::steady_clock::now();
+}
+
+// Default file output implementation
+const int PSILogFileOutput::ROTATION_RETRY_MS;
+
+PSILogFileOutput::PSILogFileOutput(const char *output_path) {
+	//fprintf(stderr, "Initialized FileOutput with output_path = %s\n", output_path);
+	_output_path = output_path;
+
+	// Open the file for appending at the end of the log file
+	_fs.open(output_path, std::fstream::out | std::fstream::app);
+	_file_size = _fs.tellp() > 0 ? (size_t)_fs.tellp() : 0;
+}
+
+PSILogFileOutput::~PSILogFileOutput() {
+	{
+		std::lock_guard<std::mutex> guard(_mutex);
+		flush_buffer();
+		_fs.close();
+	}
+
+	// Let the background thread finish with the rotated files
+	if (_rotation_thread.joinable() == true) {
+		{
+			std::lock_guard<std::mutex> guard(_rotation_mutex);
+			_rotation_stopping = true;
+		}
+		_rotation_wake.notify_all();
+		_rotation_thread.join();
+	}
+}
+
+void PSILogFileOutput::flush() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	flush_buffer();
+}
+
+// Flush entries that have waited in the buffer long enough
+void PSILogFileOutput::tick() {
+	std::lock_guard<std::mutex> guard(_mutex);
+
+	if (_buffer.empty() == false && _flush_policy.interval_elapsed() == true) {
+		flush_buffer();
+	}
+
+	check_rotation(0);
+}
+
+// The stream is flushed after every write of the buffer, so the buffer is all
+// there is to write. Appending through a new descriptor avoids the stream.
+void PSILogFileOutput::flush_emergency() {
+	if (_buffer.empty() == false) {
+		write_emergency(_buffer.data(), _buffer.size(), PSILog::ERR);
+		_buffer.clear();
+	}
+}
+
+void PSILogFileOutput::write_emergency(const char *entry, size_t length, int log_level) {
+	int fd = open(_output_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd >= 0) {
+		write_all(fd, entry, length);
+		close(fd);
+	}
+}
+
+// Write the the log entry to our file
+bool PSILogFileOutput::write_log_entry(const std::string &log_entry, int log_level) {
+	// The operations should already be thread safe, but let's just make sure
+	// file operations are guarded behind a mutex
+	std::lock_guard<std::mutex> guard(_mutex);
+
+	return write_entry(log_entry, log_level, std::chrono::system_clock::now());
+}
+
+// The record has the time the entry was logged, for the index
+bool PSILogFileOutput::write_log_record(const PSILogRecord &record) {
+	const std::string &log_entry = get_text(record);
+	std::lock_guard<std::mutex> guard(_mutex);
+
+	return write_entry(log_entry, record.log_level, record.timestamp);
+}
+
+bool PSILogFileOutput::write_entry(const std::string &log_entry, int log_level,
+				   std::chrono::system_clock::time_point timestamp) {
+	append_entry(log_entry, timestamp);
+
+	if (_flush_policy.should_flush(_buffer.size(), log_level) == true) {
+		flush_buffer();
+	}
+
+	return _fs.good();
+}
+
+bool PSILogFileOutput::write_log_entries(const PSILogRecord *records, size_t count) {
+	std::lock_guard<std::mutex> guard(_mutex);
+
+	int log_levels = 0;
+	for (size_t i = 0; i < count; i++) {
+		append_entry(get_text(records[i]), records[i].timestamp);
+		log_levels |= records[i].log_level;
+
+		// Keep the buffer to the flush size when buffering
+		size_t flush_bytes = _flush_policy.get_flush_bytes();
+		if (flush_bytes > 0 && _buffer.size() >= flush_bytes) {
+			flush_buffer();
+		}
+	}
+
+	if (_flush_policy.should_flush(_buffer.size(), log_levels) == true) {
+		flush_buffer();
+	}
+
+	return _fs.good();
+}
+
+// An indexed log has each entry on a line of its own, so the entries can be counted
+// and skipped by their line breaks. Line breaks inside the entry are written as "\n",
+// and an entry without a line break at the end gets one.
+static void append_entry_line(std::string &out, const std::string &log_entry) {
+	size_t end = log_entry.size();
+	if (end > 0 && log_entry[end - 1] == '\n') {
+		end--;
+	}
+
+	size_t start = 0;
+	for (size_t pos = log_entry.find('\n'); pos < end; pos = log_entry.find('\n', start)) {
+		out.append(log_entry, start, pos - start);
+		out += "\\n";
+		start = pos + 1;
+	}
+	out.append(log_entry, start, end - start);
+	out += '\n';
+}
+
+void PSILogFileOutput::append_entry(const std::string &log_entry,
+				    std::chrono::system_clock::time_point timestamp) {
+	check_rotation(log_entry.size());
+
+	if (_index != nullptr) {
+		int64_t timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			timestamp.time_since_epoch()).count();
+		_index->add_entry(timestamp_ns, _sequence, _file_size + _buffer.size());
+		append_entry_line(_buffer, log_entry);
+	} else {
+		_buffer += log_entry;
+	}
+	_sequence++;
+}
+
+void PSILogFileOutput::flush_buffer() {
+	if (_buffer.empty() == false) {
+		_fs.write(_buffer.data(), _buffer.size());
+		_file_size += _buffer.size();
+		_buffer.clear();
+	}
+
+	_fs.flush();
+	_flush_policy.flushed();
+
+	// The index is written after the entries it points to
+	if (_index != nullptr) {
+		_index->flush();
+	}
+}
+
+void PSILogFileOutput::set_flush_bytes(size_t flush_bytes) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_flush_policy.set_flush_bytes(flush_bytes);
+	_buffer.reserve(flush_bytes);
+}
+
+size_t PSILogFileOutput::get_flush_bytes() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _flush_policy.get_flush_bytes();
+}
+
+void PSILogFileOutput::set_flush_interval(std::chrono::milliseconds flush_interval) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_flush_policy.set_flush_interval(flush_interval);
+}
+
+std::chrono::milliseconds PSILogFileOutput::get_flush_interval() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _flush_policy.get_flush_interval();
+}
+
+void PSILogFileOutput::set_flush_levels(int flush_levels) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_flush_policy.set_flush_levels(flush_levels);
+}
+
+int PSILogFileOutput::get_flush_levels() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _flush_policy.get_flush_levels();
+}
+
+// Log rotation
+// Split path into its directory and file name
+static void split_path(const std::string &path, std::string &dir, std::string &name) {
+	size_t slash = path.rfind('/');
+	if (slash == std::string::npos) {
+		dir = ".";
+		name = path;
+	} else {
+		dir = path.substr(0, slash + 1);
+		name = path.substr(slash + 1);
+	}
+}
+
+// Rotated files of path, path.N and compressed path.N.gz, ordered from the oldest
+static std::vector<std::pair<unsigned, std::string>> list_rotated_files(const std::string &path) {
+	std::vector<std::pair<unsigned, std::string>> files;
+	std::string dir, name;
+	split_path(path, dir, name);
+
+	DIR *dp = opendir(dir.c_str());
+	if (dp == nullptr) {
+		return files;
+	}
+
+	std::string prefix = name + ".";
+	while (struct dirent *de = readdir(dp)) {
+		const char *file_name = de->d_name;
+		if (strncmp(file_name, prefix.c_str(), prefix.size()) != 0) {
+			continue;
+		}
+
+		const char *p = file_name + prefix.size();
+		const char *digits = p;
+		unsigned index = 0;
+		while (*p >= '0' && *p <= '9') {
+			index = index * 10 + (*p++ - '0');
+		}
+
+		if (p != digits && (*p == '\0' || strcmp(p, ".gz") == 0)) {
+			std::string file_path = dir == "." ? file_name : dir + file_name;
+			files.push_back(std::make_pair(index, file_path));
+		}
+	}
+	closedir(dp);
+
+	std::sort(files.begin(), files.end());
+
+	return files;
+}
+
+// Compress path to path.gz, removing the original
+static bool compress_file(const std::string &path) {
+#ifdef PSILOG_HAVE_ZLIB
+	FILE *in = fopen(path.c_str(), "rb");
+	if (in == nullptr) {
+		return false;
+	}
+
+	std::string temp_path = path + ".gz.tmp";
+	gzFile out = gzopen(temp_path.c_str(), "wb6");
+	if (out == nullptr) {
+		fclose(in);
+		return false;
+	}
+
+	char buffer[64 * 1024];
+	bool success = true;
+	size_t length;
+	while ((length = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+		if (gzwrite(out, buffer, (unsigned)length) != (int)length) {
+			success = false;
+			break;
+		}
+	}
+
+	fclose(in);
+	if (gzclose(out) != Z_OK) {
+		success = false;
+	}
+
+	if (success == true && rename(temp_path.c_str(), (path + ".gz").c_str()) == 0) {
+		unlink(path.c_str());
+		return true;
+	}
+
+	unlink(temp_path.c_str());
+	return false;
+#else
+	return false;
+#endif
+}
+
+void PSILogFileOutput::check_rotation(size_t incoming_bytes) {
+	bool rotate_now = false;
+
+	// Only rotate files that have something in them
+	size_t size = _file_size + _buffer.size();
+	if (_rotation_size > 0 && size > 0 && size + incoming_bytes > _rotation_size) {
+		rotate_now = true;
+	}
+
+	// The interval rotation stays due until a rotation succeeds, an empty file
+	// waits for the next interval
+	bool interval_due = _rotation_interval.count() > 0 && std::chrono::system_clock::now() >= _next_rotation;
+	if (interval_due == true) {
+		if (size > 0) {
+			rotate_now = true;
+		} else {
+			schedule_next_rotation();
+		}
+	}
+
+	// After a failed rename, wait a while before trying again
+	if (rotate_now == true && std::chrono::steady_clock::now() >= _rotation_retry_at &&
+	    rotate() == true && interval_due == true) {
+		schedule_next_rotation();
+	}
+}
+
+// Rename the current file out of the way and start a new one, the rest is
+// left for the background thread
+bool PSILogFileOutput::rotate() {
+	flush_buffer();
+	_fs.close();
+
+	if (_rotation_index_known == false) {
+		auto rotated = list_rotated_files(_output_path);
+		_rotation_index = rotated.empty() == true ? 0 : rotated.back().first;
+		_rotation_index_known = true;
+	}
+
+	// If the file can't be renamed, we keep appending to it, with its size and index
+	std::string rotated_path = _output_path + "." + std::to_string(_rotation_index + 1);
+	if (rename(_output_path.c_str(), rotated_path.c_str()) != 0) {
+		_fs.open(_output_path.c_str(), std::fstream::out | std::fstream::app);
+		_rotation_retry_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(ROTATION_RETRY_MS);
+		return false;
+	}
+	_rotation_index++;
+
+	// The index goes along with its file
+	if (_index != nullptr) {
+		_index.reset();
+		rename(get_index_path(_output_path).c_str(), get_index_path(rotated_path).c_str());
+	}
+
+	_fs.open(_output_path.c_str(), std::fstream::out | std::fstream::app);
+	_file_size = 0;
+	open_index();
+
+	std::lock_guard<std::mutex> guard(_rotation_mutex);
+	_rotated.push_back(rotated_path);
+	if (_rotation_thread.joinable() == false) {
+		_rotation_thread = std::thread(&PSILogFileOutput::rotation_thread_main, this);
+	}
+	_rotation_wake.notify_all();
+
+	return true;
+}
+
+void PSILogFileOutput::schedule_next_rotation() {
+	if (_rotation_interval.count() == 0) {
+		return;
+	}
+
+	auto now = std::chrono::duration_cast<std::chrono::seconds>(
+		std::chrono::system_clock::now().time_since_epoch());
+	auto next = (now / _rotation_interval + 1) * _rotation_interval;
+	_next_rotation = std::chrono::system_clock::time_point(next);
+}
+
+// Compress the rotated files and apply the retention count
+void PSILogFileOutput::rotation_thread_main() {
+#ifdef __linux__
+	// Lowest priority, setpriority() applies to a single thread on Linux
+	setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+#endif
+
+	std::unique_lock<std::mutex> lock(_rotation_mutex);
+
+	while (true) {
+		if (_rotated.empty() == false) {
+			std::vector<std::string> rotated;
+			rotated.swap(_rotated);
+			bool compress = _rotation_compress;
+			unsigned keep = _rotation_keep;
+			_rotation_busy = true;
+			lock.unlock();
+
+			if (compress == true) {
+				for (const auto &path : rotated) {
+					compress_file(path);
+				}
+			}
+
+			if (keep > 0) {
+				auto files = list_rotated_files(_output_path);
+				for (size_t i = 0; i + keep < files.size(); i++) {
+					unlink(files[i].second.c_str());
+					unlink(get_index_path(_output_path + "." + std::to_string(files[i].first)).c_str());
+				}
+			}
+
+			lock.lock();
+			_rotation_busy = false;
+			continue;
+		}
+
+		_rotation_idle.notify_all();
+		if (_rotation_stopping == true) {
+			break;
+		}
+
+		_rotation_wake.wait(lock);
+	}
+}
+
+void PSILogFileOutput::wait_rotation_idle() {
+	std::unique_lock<std::mutex> lock(_rotation_mutex);
+	while (_rotation_thread.joinable() == true && (_rotated.empty() == false || _rotation_busy == true)) {
+		_rotation_idle.wait(lock);
+	}
+}
+
+std::string PSILogFileOutput::get_index_path(const std::string &path) {
+	return path + ".idx";
+}
+
+// Open the index, continuing the entry numbering of an existing index by
+// counting the entries written after its last point
+void PSILogFileOutput::open_index() {
+	if (_index_interval == 0) {
+		_index.reset();
+		return;
+	}
+
+	_index = make_unique<PSILogIndexWriter>(get_index_path(_output_path), _index_interval);
+
+	PSILogIndexPoint last;
+	if (_index->get_last_point(last) == true) {
+		std::ifstream in(_output_path.c_str(), std::ios::binary);
+		in.seekg(last.offset);
+
+		uint64_t entries = 0;
+		char buffer[64 * 1024];
+		while (in.read(buffer, sizeof(buffer)) || in.gcount() > 0) {
+			entries += std::count(buffer, buffer + in.gcount(), '\n');
+		}
+
+		_sequence = std::max(_sequence, last.sequence + entries);
+	}
+}
+
+void PSILogFileOutput::set_index_interval(uint32_t index_interval) {
+	std::lock_guard<std::mutex> guard(_mutex);
+
+	flush_buffer();
+	_index_interval = index_interval;
+	open_index();
+}
+
+uint32_t PSILogFileOutput::get_index_interval() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _index_interval;
+}
+
+void PSILogFileOutput::set_rotation_size(size_t rotation_size) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_rotation_size = rotation_size;
+}
+
+size_t PSILogFileOutput::get_rotation_size() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _rotation_size;
+}
+
+void PSILogFileOutput::set_rotation_interval(std::chrono::seconds rotation_interval) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_rotation_interval = rotation_interval;
+	schedule_next_rotation();
+}
+
+std::chrono::seconds PSILogFileOutput::get_rotation_interval() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _rotation_interval;
+}
+
+void PSILogFileOutput::set_rotation_keep(unsigned rotation_keep) {
+	std::lock_guard<std::mutex> guard(_rotation_mutex);
+	_rotation_keep = rotation_keep;
+}
+
+unsigned PSILogFileOutput::get_rotation_keep() {
+	std::lock_guard<std::mutex> guard(_rotation_mutex);
+	return _rotation_keep;
+}
+
+void PSILogFileOutput::set_rotation_compress(bool rotation_compress) {
+	std::lock_guard<std::mutex> guard(_rotation_mutex);
+	_rotation_compress = rotation_compress;
+}
+
+bool PSILogFileOutput::get_rotation_compress() {
+	std::lock_guard<std::mutex> guard(_rotation_mutex);
+	return _rotation_compress;
+}
+
+// File descriptor output implementation
+PSILogFdOutput::PSILogFdOutput(const char *output_path) :
+	_fd(open(output_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)),
+	_owns_fd(true)
+{}
+
+PSILogFdOutput::PSILogFdOutput(int fd, bool owns_fd) :
+	_fd(fd),
+	_owns_fd(owns_fd)
+{}
+
+PSILogFdOutput::~PSILogFdOutput() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	flush_pending();
+
+	if (_owns_fd == true && _fd >= 0) {
+		close(_fd);
+	}
+}
+
+void PSILogFdOutput::flush() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	flush_pending();
+}
+
+void PSILogFdOutput::tick() {
+	std::lock_guard<std::mutex> guard(_mutex);
+
+	if (_pending_count > 0 && _flush_policy.interval_elapsed() == true) {
+		flush_pending();
+	}
+}
+
+// One write per entry, the iovec array of flush_pending() could need to grow
+void PSILogFdOutput::flush_emergency() {
+	for (size_t i = 0; i < _pending_count; i++) {
+		write_emergency(_pending[i].data(), _pending[i].size(), PSILog::ERR);
+	}
+
+	_pending_count = 0;
+	_pending_bytes = 0;
+}
+
+void PSILogFdOutput::write_emergency(const char *entry, size_t length, int log_level) {
+	if (_fd >= 0) {
+		write_all(_fd, entry, length);
+	}
+}
+
+// Queue the entry, and write the queue out when the flush policy says so
+bool PSILogFdOutput::write_log_entry(const std::string &log_entry, int log_level) {
+	std::lock_guard<std::mutex> guard(_mutex);
+
+	if (_fd < 0) {
+		return false;
+	}
+
+	if (_pending_count == _pending.size()) {
+		_pending.emplace_back();
+	}
+	_pending[_pending_count++].assign(log_entry);
+	_pending_bytes += log_entry.size();
+
+	if (_flush_policy.should_flush(_pending_bytes, log_level) == true) {
+		return flush_pending();
+	}
+
+	return true;
+}
+
+// Gather the pending entries into writev() calls of whole entries, at most PIPE_BUF
+// bytes each, so each call is appended to the file in one piece
+bool PSILogFdOutput::flush_pending() {
+	bool success = true;
+	size_t i = 0;
+
+	while (i < _pending_count) {
+		_iov.clear();
+		size_t batch_bytes = 0;
+
+		do {
+			const std::string &entry = _pending[i];
+			struct iovec iov;
+			iov.iov_base = (void *)entry.data();
+			iov.iov_len = entry.size();
+			_iov.push_back(iov);
+			batch_bytes += entry.size();
+			i++;
+		} while (i < _pending_count && _iov.size() < IOV_MAX &&
+			 batch_bytes + _pending[i].size() <= PIPE_BUF);
+
+		// The rest of the entries are dropped, the same error would most likely
+		// keep them from being written on the next flush too
+		int written = write_fully(_iov.data(), (int)_iov.size());
+		if (written < (int)_iov.size()) {
+			_dropped.fetch_add(_pending_count - (i - _iov.size()) - written, std::memory_order_relaxed);
+			success = false;
+			break;
+		}
+	}
+
+	_pending_count = 0;
+	_pending_bytes = 0;
+	_flush_policy.flushed();
+
+	return success;
+}
+
+int PSILogFdOutput::write_fully(struct iovec *iov, int count) {
+	int entries = 0;
+
+	while (count > 0) {
+		ssize_t written = writev(_fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return entries;
+		}
+
+		// Skip what got written, and continue from the middle of a partially written entry
+		while (count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+			entries++;
+		}
+
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return entries;
+}
+
+void PSILogFdOutput::set_flush_bytes(size_t flush_bytes) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_flush_policy.set_flush_bytes(flush_bytes);
+}
+
+size_t PSILogFdOutput::get_flush_bytes() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _flush_policy.get_flush_bytes();
+}
+
+void PSILogFdOutput::set_flush_interval(std::chrono::milliseconds flush_interval) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_flush_policy.set_flush_interval(flush_interval);
+}
+
+std::chrono::milliseconds PSILogFdOutput::get_flush_interval() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _flush_policy.get_flush_interval();
+}
+
+void PSILogFdOutput::set_flush_levels(int flush_levels) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_flush_policy.set_flush_levels(flush_levels);
+}
+
+int PSILogFdOutput::get_flush_levels() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _flush_policy.get_flush_levels();
+}
+
+// Memory mapped segment output implementation
+const int PSILogMmapOutput::SEGMENT_RETRY_MS;
+const size_t PSILogMmapOutput::Segment::USED_UNSET;
+
+PSILogMmapOutput::PSILogMmapOutput(const char *output_path, size_t segment_size) :
+	_output_path(output_path),
+	_segment_size(segment_size)
+{
+	// Continue after the segments already on the disk
+	unsigned index = 0;
+	while (access(get_segment_path(index).c_str(), F_OK) == 0) {
+		index++;
+	}
+
+	// When mapping fails, the background thread keeps trying the same index
+	_current = map_segment(index);
+	_next_index = _current != nullptr ? index + 1 : index;
+	_segment_thread = std::thread(&PSILogMmapOutput::segment_thread_main, this);
+}
+
+PSILogMmapOutput::~PSILogMmapOutput() {
+	{
+		std::lock_guard<std::mutex> guard(_segment_mutex);
+		_stopping = true;
+	}
+	_segment_wanted.notify_all();
+	_segment_thread.join();
+
+	// A full segment stays current while the next one can't be mapped
+	Segment *current = _current.load();
+	if (current != nullptr) {
+		finish_segment(current);
+	}
+
+	// The segment mapped in advance was never written to
+	if (_next != nullptr) {
+		finish_segment(_next);
+		unlink(get_segment_path(_next->index).c_str());
+	}
+}
+
+std::string PSILogMmapOutput::get_segment_path(unsigned index) const {
+	char suffix[16];
+	snprintf(suffix, sizeof(suffix), ".%06u", index);
+
+	return _output_path + suffix;
+}
+
+bool PSILogMmapOutput::write_log_entry(const std::string &log_entry, int log_level) {
+	size_t length = log_entry.size();
+	if (length == 0) {
+		return true;
+	}
+
+	if (length > _segment_size) {
+		return false;
+	}
+
+	while (true) {
+		// Without a segment, when creating the first one failed, install the next one
+		Segment *segment = _current.load(std::memory_order_acquire);
+		if (segment == nullptr) {
+			if (next_segment(nullptr) == false) {
+				return false;
+			}
+			continue;
+		}
+
+		size_t offset = segment->reserved.fetch_add(length);
+		if (offset + length <= _segment_size) {
+			memcpy(segment->data + offset, log_entry.data(), length);
+			segment->committed.fetch_add(length, std::memory_order_release);
+			return true;
+		}
+
+		// The entry crossing the end of the segment marks where it ends. It and the
+		// ones after it switch to the next segment and try again, or are dropped
+		// while the next segment can't be mapped.
+		if (offset <= _segment_size) {
+			segment->used.store(offset, std::memory_order_release);
+		}
+
+		if (next_segment(segment) == false) {
+			return false;
+		}
+	}
+}
+
+void PSILogMmapOutput::flush() {
+	Segment *segment = _current.load(std::memory_order_acquire);
+	if (segment != nullptr) {
+		msync(segment->data, _segment_size, MS_ASYNC);
+	}
+}
+
+PSILogMmapOutput::Segment *PSILogMmapOutput::map_segment(unsigned index) {
+	int fd = open(get_segment_path(index).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	// Allocate the blocks up front, not all file systems support fallocate though
+	if (fallocate(fd, 0, 0, _segment_size) != 0 && ftruncate(fd, _segment_size) != 0) {
+		close(fd);
+		return nullptr;
+	}
+
+	void *data = mmap(nullptr, _segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return nullptr;
+	}
+
+	auto segment = make_unique<Segment>();
+	segment->index = index;
+	segment->fd = fd;
+	segment->data = (char *)data;
+
+	std::lock_guard<std::mutex> guard(_segment_mutex);
+	_segments.push_back(move(segment));
+
+	return _segments.back().get();
+}
+
+void PSILogMmapOutput::finish_segment(Segment *segment) {
+	// A segment that never filled up holds all of its reservations. Of a full one,
+	// the writer that crossed its end marks where it ends, which it may not have
+	// done yet when a writer after it already switched to the next segment.
+	size_t used = segment->reserved.load();
+	if (used > _segment_size) {
+		while ((used = segment->used.load(std::memory_order_acquire)) == Segment::USED_UNSET) {
+			std::this_thread::yield();
+		}
+	}
+
+	// Wait for the writers that got room in the segment to finish copying
+	while (segment->committed.load(std::memory_order_acquire) < used) {
+		std::this_thread::yield();
+	}
+
+	munmap(segment->data, _segment_size);
+	segment->data = nullptr;
+
+	if (ftruncate(segment->fd, used) != 0) {
+		// Nothing to do about it, the segment just keeps its zero padding
+	}
+	close(segment->fd);
+	segment->fd = -1;
+}
+
+// The full segment stays current while mapping the next one fails, so it can be
+// switched away from once the background thread manages to map one
+bool PSILogMmapOutput::next_segment(Segment *full) {
+	std::unique_lock<std::mutex> lock(_segment_mutex);
+
+	// Usually the next segment is already waiting
+	_segment_ready.wait(lock, [this, full] {
+		return _current.load() != full || _next != nullptr || _next_failed == true;
+	});
+
+	// Another writer switched already
+	if (_current.load() != full) {
+		return true;
+	}
+
+	if (_next == nullptr) {
+		return false;
+	}
+
+	if (full != nullptr) {
+		_finishing.push_back(full);
+	}
+	_current.store(_next, std::memory_order_release);
+	_next = nullptr;
+
+	lock.unlock();
+	_segment_wanted.notify_all();
+
+	return true;
+}
+
+// Map the next segment in advance, and finish the full ones
+void PSILogMmapOutput::segment_thread_main() {
+	std::unique_lock<std::mutex> lock(_segment_mutex);
+
+	while (true) {
+		if (_finishing.empty() == false) {
+			std::vector<Segment *> finishing;
+			finishing.swap(_finishing);
+
+			lock.unlock();
+			for (Segment *segment : finishing) {
+				finish_segment(segment);
+			}
+			lock.lock();
+			continue;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (_next == nullptr && (_next_failed == false || now >= _retry_at) && _stopping == false) {
+			unsigned index = _next_index;
+
+			lock.unlock();
+			Segment *next = map_segment(index);
+			lock.lock();
+
+			// Try the same segment again a bit later
+			_next = next;
+			_next_failed = next == nullptr;
+			if (next != nullptr) {
+				_next_index = index + 1;
+			} else {
+				_retry_at = now + std::chrono::milliseconds(SEGMENT_RETRY_MS);
+			}
+			_segment_ready.notify_all();
+			continue;
+		}
+
+		if (_stopping == true) {
+			break;
+		}
+
+		if (_next_failed == true) {
+			_segment_wanted.wait_until(lock, _retry_at);
+		} else {
+			_segment_wanted.wait(lock);
+		}
+	}
 }
@@ -5,12 +5,26 @@
 //
 // Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
 
+#pragma once
+
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <fstream>
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "PSILogFormat.h"
+#include "PSILogIndex.h"
 
 using std::unique_ptr;
 using std::make_unique;
@@ -18,7 +32,341 @@ using std::move;
 
 class PSILogOutput;
 class PSILogConsoleOutput;
+class PSILogLayout;
 class PSILogStream;
+class PSILogNullStream;
+
+// Log levels compiled in, as a PSILog::LogLevel mask. Calls through the compile
+// time entry points, PSILOG(), PSILOG_DEFERRED(), stream<Level>() and the format
+// string methods, with levels not in the mask compile to nothing.
+// Set with the PSILOG_MIN_LEVEL CMake option, by default release builds leave out FREQ.
+#ifndef PSILOG_COMPILED_LEVELS
+#define PSILOG_COMPILED_LEVELS 15
+#endif
+
+constexpr bool psilog_level_compiled(int log_level) {
+	return (PSILOG_COMPILED_LEVELS & log_level) != 0;
+}
+
+// Thread local string buffer, reused across log calls so that formatting doesn't allocate
+struct PSILogThreadBuffer {
+	std::string buffer;
+	bool in_use = false;
+};
+
+// Takes the thread local buffer into use for the lifetime of the lease
+// If the buffer is already in use further up the call stack, like when a user
+// type << operator logs something itself, a temporary string is used instead
+class PSILogBufferLease {
+public:
+	explicit PSILogBufferLease(PSILogThreadBuffer &thread_buffer) :
+		_thread_buffer(thread_buffer.in_use == true ? nullptr : &thread_buffer)
+	{
+		if (_thread_buffer != nullptr) {
+			_thread_buffer->in_use = true;
+			_thread_buffer->buffer.clear();
+		}
+	}
+
+	~PSILogBufferLease() {
+		if (_thread_buffer != nullptr) {
+			_thread_buffer->in_use = false;
+		}
+	}
+
+	PSILogBufferLease(const PSILogBufferLease &) = delete;
+	PSILogBufferLease &operator =(const PSILogBufferLease &) = delete;
+
+	std::string &get() { return _thread_buffer != nullptr ? _thread_buffer->buffer : _fallback; }
+
+private:
+	PSILogThreadBuffer *_thread_buffer;
+	std::string _fallback;
+};
+
+// Immutable log entry shared between the outputs keeping entries around after writing
+typedef std::shared_ptr<const std::string> PSILogSharedEntry;
+
+// Small number of the calling thread, threads are numbered from 1 in the order they first ask
+uint32_t psilog_thread_index();
+
+// Texts a record has been rendered into, one for each layout, so that outputs sharing
+// a layout share the text too. The logger reuses the caches from record to record,
+// and the strings keep their capacity, so rendering doesn't allocate once warmed up.
+struct PSILogRenderCache {
+	static const size_t MAX_LAYOUTS = 4;
+
+	const PSILogLayout *layouts[MAX_LAYOUTS];
+	std::string texts[MAX_LAYOUTS];
+	size_t count = 0;
+
+	// Set while a record is using the cache
+	bool in_use = false;
+};
+
+// Structured form of a log entry, given to the outputs, which render it into text
+// only if they need to, see PSILogLayout. Nothing is rendered before that, so outputs
+// storing entries in some other form, like PSILogBinaryOutput, never pay for the text.
+struct PSILogRecord {
+	int log_level = 0;
+	std::chrono::system_clock::time_point timestamp;
+	std::thread::id thread_id;
+
+	// See psilog_thread_index()
+	uint32_t thread_index = 0;
+
+	// The text of the entry as logged, not set for deferred entries
+	const char *message = nullptr;
+	size_t message_length = 0;
+
+	// Call site, renderer and the binary argument payload of deferred entries
+	const PSILogCallSite *site = nullptr;
+	PSILogRenderFunc render = nullptr;
+	const char *payload = nullptr;
+	size_t payload_length = 0;
+
+	// Layout of the logger, and the cache of the texts rendered so far, set by the logger
+	const PSILogLayout *layout = nullptr;
+	PSILogRenderCache *cache = nullptr;
+
+	// Append the text of the entry to out, rendering deferred entries
+	void append_message(std::string &out) const;
+
+	// The entry rendered in layout, rendered on the first call for the layout and
+	// cached in the record. With more layouts than the cache holds, the last one is
+	// rendered again on every call, and the text is valid until the next call.
+	const std::string &get_text(const PSILogLayout &layout) const;
+
+	// The entry rendered in the layout of the logger
+	const std::string &get_entry() const;
+};
+
+// Renders records into text
+// Outputs render entries in the layout of the logger, unless given one of their own,
+// see PSILogOutput::set_layout()
+class PSILogLayout {
+public:
+	PSILogLayout() = default;
+	virtual ~PSILogLayout() = default;
+
+	// Append the text of the record to out
+	virtual void render(const PSILogRecord &record, std::string &out) const = 0;
+};
+
+// The layout of PSILog, "[HH:MM:SS] [thread id] " followed by the entry as logged,
+// the prefix can be left out
+class PSILogTextLayout : public PSILogLayout {
+public:
+	explicit PSILogTextLayout(bool add_prefix = true) : _add_prefix(add_prefix) {}
+
+	void render(const PSILogRecord &record, std::string &out) const override;
+
+	bool get_add_prefix() const { return _add_prefix; }
+	void set_add_prefix(bool add_prefix) { _add_prefix = add_prefix; }
+
+private:
+	bool _add_prefix;
+};
+
+// One JSON object per line, with the time in nanoseconds since the epoch, the level,
+// the thread index, the call site of deferred entries, and the entry without its
+// trailing newline, eg.
+// {"time":1523610000000000000,"level":"INFO","thread":1,"message":"Phaser 3 ready"}
+// {"time":1523610000000000000,"level":"WARN","thread":2,"file":"main.cpp","line":42,"message":"Low power"}
+class PSILogJsonLayout : public PSILogLayout {
+public:
+	PSILogJsonLayout() = default;
+
+	void render(const PSILogRecord &record, std::string &out) const override;
+};
+
+// Log entry waiting in the asynchronous queue for the writer thread
+struct PSILogAsyncEntry {
+	// The entry as logged, or the binary argument payload of a deferred entry
+	std::string entry;
+	int log_level = 0;
+
+	// Set for deferred entries, which are rendered by the writer thread
+	const PSILogCallSite *site = nullptr;
+	PSILogRenderFunc render = nullptr;
+
+	// The prefix is rendered by the writer thread, using the time and thread
+	// the entry was logged on
+	std::chrono::system_clock::time_point timestamp;
+	std::thread::id thread_id;
+	uint32_t thread_index = 0;
+};
+
+// Assumed cache line size, used for keeping the producer and consumer
+// sides of the rings from sharing cache lines
+static const size_t PSILOG_CACHE_LINE_SIZE = 64;
+
+// Lock-free single producer ring buffer of log entries
+// Each logging thread gets its own ring in asynchronous mode, and the writer
+// thread drains all of the rings. Every slot carries a sequence number telling
+// whether it's free for the producer or ready for a consumer, so neither side
+// ever waits on a lock. Consumers claim entries with a CAS on _tail, which
+// lets the producer also discard the oldest entry when the ring is full.
+class PSILogRing {
+public:
+	// Capacity is rounded up to the next power of two
+	explicit PSILogRing(size_t capacity);
+	~PSILogRing() = default;
+
+	PSILogRing(const PSILogRing &) = delete;
+	PSILogRing &operator =(const PSILogRing &) = delete;
+
+	// Producer side, fill is called with the free slot entry to write the
+	// new entry into. Returns false if the ring is full.
+	template <typename Fill>
+	bool try_push(Fill fill) {
+		uint64_t head = _head.load(std::memory_order_relaxed);
+		Slot &slot = _slots[head & _mask];
+
+		// Not yet released by a consumer, we are full
+		if (slot.sequence.load(std::memory_order_acquire) != head) {
+			return false;
+		}
+
+		fill(slot.entry);
+		slot.sequence.store(head + 1, std::memory_order_release);
+		_head.store(head + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// Is the ring full only because a consumer is still busy with the oldest
+	// entry it has already taken out. Called by the producer.
+	bool get_head_slot_busy() const {
+		return _head.load(std::memory_order_relaxed) - _tail.load(std::memory_order_acquire) < _capacity;
+	}
+
+	// Consumer side, takes the oldest entry out of the ring and calls func for it.
+	// The slot is released back to the producer after func returns.
+	// Returns false if the ring is empty.
+	template <typename Func>
+	bool consume_one(Func func) {
+		uint64_t pos = _tail.load(std::memory_order_relaxed);
+
+		while (true) {
+			Slot &slot = _slots[pos & _mask];
+			uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+			int64_t diff = (int64_t)(sequence - (pos + 1));
+
+			if (diff == 0) {
+				// Entry ready, claim it unless another consumer got there first
+				if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) == true) {
+					func(slot.entry);
+					slot.sequence.store(pos + _capacity, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = _tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool empty() const {
+		return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+	}
+
+	// Is the next slot still waiting for a consumer to release it. Called by the producer.
+	bool full() const {
+		uint64_t head = _head.load(std::memory_order_relaxed);
+		return _slots[head & _mask].sequence.load(std::memory_order_acquire) != head;
+	}
+
+	size_t get_capacity() const { return _capacity; }
+
+	// Count of entries dropped by the overflow policy since the last take_dropped()
+	void add_dropped() { _dropped.fetch_add(1, std::memory_order_relaxed); }
+	uint64_t take_dropped() { return _dropped.exchange(0, std::memory_order_relaxed); }
+
+	// Set by the producer while it is pushing, so that stopping the
+	// asynchronous mode can wait for pushes in progress
+	bool get_producer_active() const { return _producer_active.load(); }
+	void set_producer_active(bool active) { _producer_active.store(active); }
+
+	// Set when the owning logger is destroyed, so that the thread local
+	// references to this ring can be pruned
+	bool get_closed() const { return _closed.load(std::memory_order_acquire); }
+	void set_closed(bool closed) { _closed.store(closed, std::memory_order_release); }
+
+	// Id text of the producer thread, set when the ring is registered, for the
+	// crash handler which can't format thread ids itself
+	const char *get_thread_text() const { return _thread_text; }
+	size_t get_thread_text_length() const { return _thread_text_length; }
+	void set_thread_text(const std::string &text) {
+		_thread_text_length = std::min(text.size(), sizeof(_thread_text));
+		memcpy(_thread_text, text.data(), _thread_text_length);
+	}
+
+private:
+	struct Slot {
+		std::atomic<uint64_t> sequence;
+		PSILogAsyncEntry entry;
+	};
+
+	std::unique_ptr<Slot[]> _slots;
+	uint64_t _capacity = 0;
+	uint64_t _mask = 0;
+	std::atomic<bool> _closed { false };
+	char _thread_text[32];
+	size_t _thread_text_length = 0;
+
+	// Producer cache line
+	alignas(PSILOG_CACHE_LINE_SIZE) std::atomic<uint64_t> _head { 0 };
+	std::atomic<uint64_t> _dropped { 0 };
+	std::atomic<bool> _producer_active { false };
+
+	// Consumer cache line
+	alignas(PSILOG_CACHE_LINE_SIZE) std::atomic<uint64_t> _tail { 0 };
+};
+
+// Ring of the latest entries a thread logged below the filter, see PSILog::set_backtrace()
+// Only the owning thread touches it. The slots keep their string capacity, so keeping
+// entries doesn't allocate once the ring has gone around.
+class PSILogBacktrace {
+public:
+	PSILogBacktrace() = default;
+	~PSILogBacktrace() = default;
+
+	// Slot for a new entry, replacing the oldest one when the ring holds capacity entries
+	PSILogAsyncEntry &push(size_t capacity) {
+		if (_entries.size() != capacity) {
+			_entries.resize(capacity);
+			_next = 0;
+			_count = 0;
+		}
+
+		PSILogAsyncEntry &entry = _entries[_next];
+		_next = (_next + 1) % capacity;
+		_count = _count < capacity ? _count + 1 : capacity;
+
+		return entry;
+	}
+
+	// Call write for every entry, oldest first, emptying the ring
+	template <typename Write>
+	void drain(Write write) {
+		size_t first = (_next + _entries.size() - _count) % std::max<size_t>(_entries.size(), 1);
+		size_t count = _count;
+		_count = 0;
+
+		for (size_t i = 0; i < count; i++) {
+			write(_entries[(first + i) % _entries.size()]);
+		}
+	}
+
+	size_t size() const { return _count; }
+
+private:
+	std::vector<PSILogAsyncEntry> _entries;
+	size_t _next = 0;
+	size_t _count = 0;
+};
 
 // Our main logger class
 class PSILog {
@@ -34,36 +382,189 @@ public:
 		ALL	= (2 << 3) - 1
         };
 
-	PSILog() = default;
-	~PSILog() = default;
+	// What to do when a thread's asynchronous ring is full
+	enum OverflowPolicy {
+		// Wait for the writer thread to make room
+		OVERFLOW_BLOCK,
+		// Drop the entry being logged
+		OVERFLOW_DROP_NEWEST,
+		// Drop the oldest entry in the ring to make room
+		OVERFLOW_DROP_OLDEST
+	};
+
+	// Default maximum amount of entries waiting in each thread's asynchronous ring
+	static const size_t DEFAULT_ASYNC_QUEUE_SIZE = 1024;
+
+	PSILog();
+	~PSILog();
 
 	// Functors for returning a log stream, enabling multithreading safe logging
 	PSILogStream operator ()();
 	PSILogStream operator ()(int log_level);
 
+	// Log stream for a compile time level, eg. log.stream<PSILog::FREQ>() << "Entry";
+	// For levels not compiled in returns a stream that does nothing, and compiles to nothing
+	template <int Level>
+	typename std::conditional<psilog_level_compiled(Level), PSILogStream, PSILogNullStream>::type stream() {
+		return typename std::conditional<psilog_level_compiled(Level), PSILogStream, PSILogNullStream>::type(*this, Level);
+	}
+
 	// The main logging method
 	void log(const std::string &entry, int log_level);
+	void log(const char *entry, size_t length, int log_level);
+
+	// Format string logging, eg.
+	// log.info(PSILOG_FMT("Phaser {} ready in {} ms"), id, delay);
+	// The format string is parsed at compile time, and the amount and types of
+	// the arguments are checked against it, failing the build on mismatches.
+	// The text is formatted directly into a reused buffer, without going
+	// through std::ostream. Each call logs one line, the newline is added automatically.
+	template <int Level, typename Format, typename... Args>
+	void log_format(Format format, const Args &... args) {
+		log_format(std::integral_constant<bool, psilog_level_compiled(Level)>(), Level, format, args...);
+	}
+
+	template <typename Format, typename... Args>
+	void info(Format format, const Args &... args) { log_format<INFO>(format, args...); }
+
+	template <typename Format, typename... Args>
+	void warn(Format format, const Args &... args) { log_format<WARN>(format, args...); }
+
+	template <typename Format, typename... Args>
+	void error(Format format, const Args &... args) { log_format<ERR>(format, args...); }
+
+	template <typename Format, typename... Args>
+	void freq(Format format, const Args &... args) { log_format<FREQ>(format, args...); }
+
+	// Deferred logging, use through the PSILOG_DEFERRED() macro
+	// The calling thread only copies the raw bytes of the arguments, in
+	// asynchronous mode the text is rendered by the writer thread.
+	// Each call logs one line, the newline is added automatically.
+	template <typename... Args>
+	void log_deferred(const PSILogCallSite &site, int log_level, const Args &... args) {
+		if (is_logged(log_level) == false) {
+			return;
+		}
+
+		PSILogBufferLease lease(get_deferred_buffer());
+		std::string &payload = lease.get();
+		payload.resize(psilog_payload_size(args...));
+		psilog_encode_payload(&payload[0], args...);
+
+		log_deferred_payload(site, &PSILogDeferredRenderer<typename std::decay<Args>::type...>::render,
+				     payload, log_level);
+	}
+
+	// Log an already encoded deferred payload
+	void log_deferred_payload(const PSILogCallSite &site, PSILogRenderFunc render,
+				  const std::string &payload, int log_level);
 
 	// Return the log message prefix header
 	std::string get_log_entry_prefix(const std::string &log_entry) const;
 
+	// Return the log message prefix header for an entry logged at time by thread_id
+	std::string get_log_entry_prefix(std::time_t time, std::thread::id thread_id) const;
+
+	// Append the log message prefix header for an entry logged at time by thread_id to out
+	void append_log_entry_prefix(std::string &out, std::time_t time, std::thread::id thread_id) const;
+
 	// Add new logger to our output chain
 	// We have multiple output destinations which implement the actual writing of the messages
 	// This enables easy extending of log destinations by the user
+	//
+	// Outputs can be added and removed at any time, also while other threads are logging.
+	// Logging threads read an immutable snapshot of the chain without taking locks, and
+	// adding or removing replaces the snapshot, waiting until no thread reads the old one.
+	// So an output must not add or remove outputs of its own logger while writing.
 	void add_output(unique_ptr<PSILogOutput> output);
 
+	// Remove the output from our chain, and destroy it once no thread is writing to it.
+	// Asynchronous entries still queued are not written to it. Returns false if the
+	// output is not ours.
+	bool remove_output(PSILogOutput *output);
+
+	// Amount of outputs in our chain
+	size_t get_output_count() const;
+
 	// Flush all output now to the destination outputs
+	// In asynchronous mode waits first until the writer thread has written
+	// everything queued so far
 	void flush();
 
+	// Enable or disable asynchronous logging
+	// When enabled, the calling thread only formats the entry and pushes it to
+	// its own ring buffer, a background writer thread drains the rings of all
+	// threads and does the actual writing to our outputs.
+	// Disabling drains the rings and stops the writer thread.
+	void set_async(bool async);
+	bool get_async() const { return _async_state == ASYNC_RUNNING; }
+
+	// Maximum amount of entries in each thread's asynchronous ring, when the
+	// ring is full the overflow policy decides what happens.
+	// Applies to rings created after the call.
+	size_t get_async_queue_size() const { return _async_queue_size; }
+	void set_async_queue_size(size_t queue_size) { _async_queue_size = queue_size; }
+
+	// Overflow policy of the asynchronous rings, OVERFLOW_BLOCK by default.
+	// Dropped entries are counted, and the writer thread reports them with a
+	// "N messages dropped" warning entry through our outputs.
+	int get_async_overflow() const { return _async_overflow; }
+	void set_async_overflow(int overflow) { _async_overflow = overflow; }
+
+	// Total amount of entries dropped by the overflow policy and reported so far
+	uint64_t get_async_dropped() const { return _async_dropped; }
+
+	// Amount of thread rings registered, one for each thread that has logged
+	// asynchronously. The writer thread frees the rings of exited threads once drained.
+	size_t get_async_ring_count() const { return _async_ring_count; }
+
+	// Write out the entries still queued or buffered when the process gets a fatal
+	// signal, SIGSEGV, SIGBUS, SIGFPE, SIGILL or SIGABRT. The handler drains the
+	// asynchronous rings and the buffers of the outputs with async-signal-safe writes,
+	// see PSILogOutput::flush_emergency(), adds an entry telling which signal it was,
+	// and raises the signal again with the previous handlers restored.
+	// Only one logger has the handler at a time, installing replaces the previous one.
+	// The entries are rendered with the text layout into a buffer allocated here, with
+	// the UTC offset looked up last time instead of localtime_r(), and without allocating.
+	// Deferred entries are rendered from their raw arguments, floating point ones with
+	// up to 6 decimals instead of the %g of the writer thread.
+	// This is best effort, the crash may have left the logger in a state it can't be
+	// written from, and writes in progress on other threads can interleave.
+	void install_crash_handler();
+	void uninstall_crash_handler();
+
+	// Drain everything to the outputs from the crash handler of signal,
+	// adding the entry about the crash
+	void write_emergency(int signal);
+
+	// Keep the latest entries levels filtered out in a ring of each thread, holding up to
+	// size entries. When the thread logs an ERR entry, the entries kept are written
+	// before it, with the time they were logged, so errors come with their context.
+	// Deferred entries are kept unformatted, and only rendered if they are written.
+	// Size 0 disables the backtrace, which is the default.
+	void set_backtrace(size_t size, int levels = LogLevel::ALL);
+	size_t get_backtrace_size() const { return _backtrace_size; }
+	int get_backtrace_levels() const { return _backtrace_levels; }
+
 	// Pure accessors written here for easier implementation
 	int get_level() const { return _level; }
 	void set_level(int level) { _level = level; }
 
 	int get_filter() const { return _filter; }
-	void set_filter(int filter) { _filter = filter; }
+	void set_filter(int filter) { _filter = filter; update_logged(); }
 
-	bool get_add_prefix() const { return _add_prefix; }
-	void set_add_prefix(bool add_prefix) { _add_prefix = add_prefix; }
+	// Does the filter let entries of this level through
+	bool is_enabled(int log_level) const { return (_filter & log_level) != 0; }
+
+	// Are entries of this level written or kept in the backtrace, the entry
+	// points skip formatting entries of other levels
+	bool is_logged(int log_level) const { return (_logged & log_level) != 0; }
+
+	bool get_add_prefix() const { return _layout.get_add_prefix(); }
+	void set_add_prefix(bool add_prefix) { _layout.set_add_prefix(add_prefix); }
+
+	// The layout entries are rendered in, for the outputs without a layout of their own
+	const PSILogLayout &get_layout() const { return _layout; }
 
 private:
 	// The current log level we are logging messages with
@@ -73,12 +574,255 @@ private:
 	// log level. Binary arithmetic mask.
 	int _filter = LogLevel::INFO;
 
-	// Do we add the log message prefix to our entries ?
-	bool _add_prefix = true;
+	// The crash handler renders the entries into this, allocated when the handler
+	// is installed, as it can't allocate. Longer entries are cut.
+	static const size_t EMERGENCY_ENTRY_SIZE = 64 * 1024;
+	std::unique_ptr<char[]> _emergency_text;
+
+	// Backtrace of filtered out entries, see set_backtrace()
+	size_t _backtrace_size = 0;
+	int _backtrace_levels = LogLevel::ALL;
+
+	// Levels either written or kept in the backtrace
+	int _logged = LogLevel::INFO;
+
+	void update_logged() {
+		_logged = _filter | (_backtrace_size != 0 ? _backtrace_levels : 0);
+	}
 
-	// Our log message outputters chain
+	// Our entries are rendered with the log message prefix, unless disabled
+	PSILogTextLayout _layout;
+
+	// Our log message outputters chain, an immutable snapshot replaced as a whole
 	// We dispatch the actual log messages to these in sequential order
-	std::vector<unique_ptr<PSILogOutput>> _outputs;
+	struct OutputList {
+		std::vector<std::shared_ptr<PSILogOutput>> outputs;
+	};
+	std::atomic<const OutputList *> _outputs;
+
+	// The list while we have no outputs, never freed
+	const OutputList _no_outputs;
+
+	// Serializes replacing the output list
+	mutable std::mutex _outputs_mutex;
+
+	// Readers register in the counter of the current epoch. Replacing the list moves
+	// to the next epoch, and waits for the readers of the previous one to finish
+	// before freeing the old list. Each counter on its own cache line, as every log
+	// call touches one.
+	struct alignas(PSILOG_CACHE_LINE_SIZE) OutputReaders {
+		std::atomic<uint64_t> count { 0 };
+	};
+	std::atomic<uint64_t> _outputs_epoch { 0 };
+	OutputReaders _outputs_readers[2];
+
+	// Holds the current output list for reading, the list stays valid until destroyed
+	class OutputsSnapshot {
+	public:
+		explicit OutputsSnapshot(PSILog &log);
+		~OutputsSnapshot();
+
+		OutputsSnapshot(const OutputsSnapshot &) = delete;
+		OutputsSnapshot &operator =(const OutputsSnapshot &) = delete;
+
+		const std::vector<std::shared_ptr<PSILogOutput>> &get() const { return _list->outputs; }
+
+	private:
+		std::atomic<uint64_t> *_readers;
+		const OutputList *_list;
+	};
+
+	// Install the list in place of the current one, freeing the current one once it's
+	// not read anymore. The outputs mutex must be held.
+	void replace_outputs(const OutputList *list);
+
+	// Add the console output if we have no outputs
+	void add_default_output();
+
+	// Write the record to all of our outputs
+	void write_to_outputs(const PSILogRecord &record);
+
+	// Write a batch of records to all of our outputs
+	void write_batch_to_outputs(const PSILogRecord *records, size_t count);
+
+	// Write the record to the outputs keeping their entries, sharing the text between them
+	void write_to_retaining_outputs(const std::vector<std::shared_ptr<PSILogOutput>> &outputs,
+					const PSILogRecord &record);
+
+	// Write entries to the output at index through its circuit breaker,
+	// write does the writing and returns whether it succeeded
+	template <typename Write>
+	void write_through_breaker(const std::vector<std::shared_ptr<PSILogOutput>> &outputs,
+				   size_t index, size_t entries, Write write);
+
+	// Log the change in the health of the output at index through the healthy outputs
+	void write_breaker_change(const std::vector<std::shared_ptr<PSILogOutput>> &outputs,
+				  size_t index, int change);
+
+	// Format and write an entry logged at timestamp, or hand it to the writer thread
+	void write_entry(const char *entry, size_t length, int log_level,
+			 std::chrono::system_clock::time_point timestamp);
+	void write_deferred(const PSILogCallSite &site, PSILogRenderFunc render,
+			    const std::string &payload, int log_level,
+			    std::chrono::system_clock::time_point timestamp);
+
+	// Backtrace ring of the calling thread, separate from its asynchronous ring
+	PSILogBacktrace &get_thread_backtrace();
+
+	// Write the entries kept in the calling thread's backtrace
+	void write_backtrace();
+
+	// Should the entry go to the backtrace instead of the outputs
+	bool is_backtraced(int log_level) const {
+		return _backtrace_size != 0 && is_enabled(log_level) == false && (_backtrace_levels & log_level) != 0;
+	}
+
+	// Push an entry to the calling thread's ring, fill writes the entry to the ring slot
+	template <typename Fill>
+	bool push_async(Fill fill);
+
+	// Record of an entry taken from a ring or a backtrace
+	PSILogRecord get_async_record(const PSILogAsyncEntry &async_entry) const;
+
+	// Format string logging for compiled in levels
+	template <typename Format, typename... Args>
+	void log_format(std::true_type, int log_level, Format format, const Args &... args) {
+		if (is_logged(log_level) == false) {
+			return;
+		}
+
+		PSILogBufferLease lease(get_format_buffer());
+		std::string &entry = lease.get();
+		psilog_format(entry, format, args...);
+		entry += '\n';
+
+		log(entry, log_level);
+	}
+
+	// Levels not compiled in, only the format string is checked
+	template <typename Format, typename... Args>
+	void log_format(std::false_type, int log_level, Format format, const Args &... args) {
+		psilog_check_format<Format, Args...>();
+	}
+
+	// Thread local buffers for encoding deferred arguments and formatting format
+	// string entries
+	static PSILogThreadBuffer &get_deferred_buffer();
+	static PSILogThreadBuffer &get_format_buffer();
+
+	// Ring of the calling thread, created and registered on first use
+	PSILogRing *get_thread_ring();
+
+	// Consume every ring once, writing the entries to our outputs.
+	// Also frees the rings of threads that have exited. Called only from the
+	// writer thread. Returns the amount of entries written.
+	size_t drain_rings();
+
+	// Are all of the rings empty, and is no thread in the middle of a push
+	bool rings_empty() const;
+	bool rings_idle() const;
+
+	// Wake the writer thread if it's sleeping
+	void wake_async_thread();
+
+	// The asynchronous writer thread main loop
+	void async_thread_main();
+
+	enum AsyncState {
+		ASYNC_OFF,
+		ASYNC_RUNNING,
+		ASYNC_STOPPING
+	};
+
+	// Registered thread rings, a lock-free list. Logging threads only push
+	// to the head, the writer thread is the only one walking and unlinking.
+	struct RingNode {
+		std::shared_ptr<PSILogRing> ring;
+		RingNode *next;
+	};
+
+	// Unique id for matching the thread local ring references to this logger,
+	// addresses can be reused by loggers created later
+	const uint64_t _id;
+
+	// Expires when we are destroyed, so threads can prune their backtraces for us
+	const std::shared_ptr<bool> _alive = std::make_shared<bool>(true);
+
+	// Asynchronous logging state
+	std::atomic<int> _async_state { ASYNC_OFF };
+	size_t _async_queue_size = DEFAULT_ASYNC_QUEUE_SIZE;
+	int _async_overflow = OVERFLOW_BLOCK;
+	std::atomic<uint64_t> _async_dropped { 0 };
+	std::atomic<RingNode *> _rings { nullptr };
+	std::atomic<size_t> _async_ring_count { 0 };
+
+	// Set by the writer thread while it frees a drained ring, the crash handler
+	// waits for it to clear before walking the rings
+	std::atomic<bool> _rings_freeing { false };
+	std::thread _async_thread;
+
+	// Guards starting and stopping of the writer thread
+	std::mutex _async_mutex;
+
+	// Sleeping and waking of the writer thread, and flush() requests
+	std::atomic<bool> _async_sleeping { false };
+	std::atomic<uint64_t> _flush_requested { 0 };
+	std::atomic<uint64_t> _flush_completed { 0 };
+	std::mutex _async_wake_mutex;
+	std::condition_variable _async_wake;
+	std::condition_variable _async_flushed;
+
+	// Logging threads waiting for room in their full ring, and the writer
+	// thread signaling them after taking entries out
+	std::atomic<int> _async_blocked { 0 };
+	std::condition_variable _async_not_full;
+};
+
+// Deferred logging of a format with arguments, eg.
+// PSILOG_DEFERRED(log, PSILog::INFO, "Phaser {} ready in {} ms", id, delay);
+// The format must be a string literal, the call site is registered the first time
+// it's executed. Supports arithmetic types, enums and strings as arguments.
+// The format is checked against the arguments at compile time like with PSILOG_FMT(),
+// and takes the same placeholders.
+#define PSILOG_DEFERRED(logger, log_level, format, ...) \
+	do { \
+		if (psilog_level_compiled(log_level) == true) { \
+			auto psilog_format = PSILOG_FMT(format); \
+			(void)sizeof(psilog_check_format_of(psilog_format, ##__VA_ARGS__)); \
+			static const PSILogCallSite psilog_call_site(format, __FILE__, __LINE__, \
+				decltype(psilog_arg_signature_of(__VA_ARGS__))::get()); \
+			(logger).log_deferred(psilog_call_site, (log_level), ##__VA_ARGS__); \
+		} \
+	} while (0)
+
+// Stream buffer writing into a growable character buffer
+// The buffers come from a thread local pool, so they are reused across log calls
+// and only grow, doubling in size, until they fit the longest entry.
+class PSILogStreamBuf : public std::streambuf {
+public:
+	static const size_t INITIAL_CAPACITY = 256;
+
+	PSILogStreamBuf() = default;
+	~PSILogStreamBuf() = default;
+
+	// Take a buffer from the calling thread's pool, and give it back
+	static PSILogStreamBuf *acquire();
+	static void release(PSILogStreamBuf *buf);
+
+	const char *data() const { return pbase(); }
+	size_t size() const { return pptr() - pbase(); }
+
+protected:
+	int_type overflow(int_type c) override;
+	std::streamsize xsputn(const char *s, std::streamsize count) override;
+
+private:
+	// Make room for at least count more characters
+	void reserve(size_t count);
+
+	std::unique_ptr<char[]> _buffer;
+	size_t _capacity = 0;
+	bool _in_use = false;
 };
 
 // Stream class for thread safety
@@ -89,29 +833,180 @@ private:
 // And when in the calling thread the object is destroyed, it actually logs the log messages
 // This enables thread safe log message construction, without multiple threads intefering
 // with each other
-class PSILogStream : public std::ostringstream {
+//
+// The filter is checked when the stream is created, and for filtered out levels,
+// unless they are kept in the backtrace, every << is a no-op, so no formatting work is done for entries that are never written.
+// The formatting itself goes to our internal std::ostream, which user type << operators get.
+// It writes to a reused thread local PSILogStreamBuf, so logging doesn't allocate.
+class PSILogStream {
 public:
 	// Store reference to the current log level and logger object
 	PSILogStream(PSILog &log, int log_level) :
-		_log(log), _log_level(log_level)
+		_log(log),
+		_log_level(log_level),
+		_enabled(log.is_logged(log_level)),
+		_buf(_enabled == true ? PSILogStreamBuf::acquire() : nullptr),
+		_os(_buf)
 	{}
 
 	// Copy constructor
 	PSILogStream(const PSILogStream &ls) :
-		_log(ls._log),
-		_log_level(ls._log_level)
+		PSILogStream(ls._log, ls._log_level)
 	{}
 
 	~PSILogStream() {
-		// Filter log messages with the binary arithmetic mask
-		if (_log.get_filter() & _log_level) {
-			_log.log(str(), _log_level);
+		if (_enabled == true) {
+			_log.log(_buf->data(), _buf->size(), _log_level);
+			PSILogStreamBuf::release(_buf);
+		}
+	}
+
+	// Only format when the entry will be written
+	template <typename T>
+	PSILogStream &operator <<(const T &value) {
+		if (_enabled == true) {
+			_os << value;
 		}
+
+		return *this;
+	}
+
+	// Manipulators like std::endl and std::hex
+	PSILogStream &operator <<(std::ostream &(*manipulator)(std::ostream &)) {
+		if (_enabled == true) {
+			manipulator(_os);
+		}
+
+		return *this;
+	}
+
+	PSILogStream &operator <<(std::ios &(*manipulator)(std::ios &)) {
+		if (_enabled == true) {
+			manipulator(_os);
+		}
+
+		return *this;
+	}
+
+	PSILogStream &operator <<(std::ios_base &(*manipulator)(std::ios_base &)) {
+		if (_enabled == true) {
+			manipulator(_os);
+		}
+
+		return *this;
+	}
+
+	bool get_enabled() const { return _enabled; }
+
+	// The stream the entry is formatted into, for code that needs a std::ostream
+	std::ostream &get_stream() { return _os; }
+
+	// The entry formatted so far
+	std::string str() const {
+		return _enabled == true ? std::string(_buf->data(), _buf->size()) : std::string();
 	}
 
 private:
 	PSILog &_log;
 	int _log_level;
+	bool _enabled;
+	PSILogStreamBuf *_buf;
+	std::ostream _os;
+};
+
+// Stream for levels not compiled in, everything is a no-op
+class PSILogNullStream {
+public:
+	PSILogNullStream(PSILog &log, int log_level) {}
+
+	template <typename T>
+	PSILogNullStream &operator <<(const T &value) { return *this; }
+
+	PSILogNullStream &operator <<(std::ostream &(*manipulator)(std::ostream &)) { return *this; }
+	PSILogNullStream &operator <<(std::ios &(*manipulator)(std::ios &)) { return *this; }
+	PSILogNullStream &operator <<(std::ios_base &(*manipulator)(std::ios_base &)) { return *this; }
+
+	bool get_enabled() const { return false; }
+};
+
+// Helper for PSILOG(), turns the stream expression into void for the conditional operator
+struct PSILogVoidify {
+	void operator &(const PSILogStream &) {}
+};
+
+// Stream logging that skips evaluating the arguments for filtered out levels, eg.
+// PSILOG(log, PSILog::FREQ) << "Scan result " << expensive_scan() << std::endl;
+// When FREQ is filtered out, this costs a single check of the filter, and when
+// FREQ is not compiled in, the whole statement compiles to nothing.
+#define PSILOG(logger, log_level) \
+	(psilog_level_compiled(log_level) == false || (logger).is_logged(log_level) == false) ? \
+		(void)0 : PSILogVoidify() & (logger)(log_level)
+
+// Circuit breaker of an output, tracking the health of the writes to it
+// The logger trips the breaker after a number of failed or slow writes in a row, and
+// skips the output while it's tripped, so a broken or stalled destination doesn't hold
+// up the other outputs. Every probe interval one write goes through as a probe, and
+// the first probe succeeding in time closes the breaker again. A batch from the
+// asynchronous writer thread counts as one write.
+// Disabled by default, the writes are not timed then.
+class PSILogBreaker {
+public:
+	static const int DEFAULT_PROBE_INTERVAL_MS = 1000;
+
+	// What allow() lets the write do
+	enum Decision {
+		BREAKER_SKIP,
+		BREAKER_WRITE,
+		BREAKER_PROBE
+	};
+
+	// State change caused by the result of a write
+	enum Change {
+		BREAKER_UNCHANGED,
+		BREAKER_TRIPPED,
+		BREAKER_RECOVERED
+	};
+
+	// Trip after failures failed or slow writes in a row, a write is slow when it takes
+	// longer than latency, 0 for no limit. Failures 0 disables the breaker.
+	// Set before the output is written to.
+	void set_thresholds(unsigned failures, std::chrono::nanoseconds latency = std::chrono::nanoseconds(0),
+			    std::chrono::milliseconds probe_interval = std::chrono::milliseconds(DEFAULT_PROBE_INTERVAL_MS));
+
+	bool get_enabled() const { return _failure_limit != 0; }
+	unsigned get_failure_limit() const { return _failure_limit; }
+	std::chrono::nanoseconds get_latency_limit() const { return _latency_limit; }
+	std::chrono::nanoseconds get_probe_interval() const { return _probe_interval; }
+
+	bool get_tripped() const { return _tripped.load(std::memory_order_relaxed); }
+
+	// Decide if a write of entries at now goes ahead, the skipped entries are counted
+	Decision allow(std::chrono::steady_clock::time_point now, size_t entries);
+
+	// Record the result of a write allow() let through, which took latency
+	Change record(Decision decision, bool success, std::chrono::steady_clock::duration latency);
+
+	// Entries skipped since the breaker last tripped, taken when reporting the recovery
+	uint64_t take_skipped() { return _skipped.exchange(0); }
+
+	// Times tripped, and entries skipped in total
+	uint64_t get_trips() const { return _trips; }
+	uint64_t get_skipped() const { return _skipped_total; }
+
+private:
+	unsigned _failure_limit = 0;
+	std::chrono::nanoseconds _latency_limit { 0 };
+	std::chrono::nanoseconds _probe_interval { std::chrono::milliseconds(DEFAULT_PROBE_INTERVAL_MS) };
+
+	std::atomic<bool> _tripped { false };
+	std::atomic<unsigned> _failures { 0 };
+
+	// Steady clock time of the next probe in ns, claimed by the thread doing the probe
+	std::atomic<int64_t> _probe_at { 0 };
+
+	std::atomic<uint64_t> _skipped { 0 };
+	std::atomic<uint64_t> _skipped_total { 0 };
+	std::atomic<uint64_t> _trips { 0 };
 };
 
 // The logger outputs to PSILogOutput objects
@@ -122,14 +1017,83 @@ private:
 class PSILogOutput {
 public:
 	PSILogOutput() = default;
-	~PSILogOutput() = default;
+	virtual ~PSILogOutput() = default;
 
 	// This will write the current log entry to the destination output, ensuring that
 	// the output is flushed also
+	// The entry is rendered once for each layout, and the same string is passed to
+	// every output with that layout
 	virtual bool write_log_entry(const std::string &log_entry, int log_level) = 0;
 
+	// Outputs that keep entries after write_log_entry() returns, like ones with their
+	// own writer queue, return true here and get the entries through write_shared_log_entry()
+	// The shared entry is created once for all such outputs, so they don't each need a copy
+	virtual bool get_retains_entries() const { return false; }
+
+	virtual bool write_shared_log_entry(const PSILogSharedEntry &log_entry, int log_level) {
+		return write_log_entry(*log_entry, log_level);
+	}
+
+	// The logger writes every entry through this, by default the record is rendered in
+	// our layout and written with write_log_entry(). Outputs storing the structured
+	// record instead of the text override this, and the text is never rendered.
+	virtual bool write_log_record(const PSILogRecord &record) {
+		return write_log_entry(get_text(record), record.log_level);
+	}
+
+	// Write several records at once, the asynchronous writer thread passes the entries it
+	// drained from a ring in one batch. Outputs that can write the batch with fewer
+	// locks, system calls or flushes override this, by default each record is written
+	// through write_log_record(). Returns false if any of the entries failed.
+	virtual bool write_log_entries(const PSILogRecord *records, size_t count) {
+		bool success = true;
+		for (size_t i = 0; i < count; i++) {
+			if (write_log_record(records[i]) == false) {
+				success = false;
+			}
+		}
+
+		return success;
+	}
+
+	// Render our entries in layout instead of the layout of the logger, outputs with
+	// the same layout object share the rendered text
+	void set_layout(std::shared_ptr<const PSILogLayout> layout) { _layout = move(layout); }
+	const PSILogLayout *get_layout() const { return _layout.get(); }
+
+	// The record rendered in our layout
+	const std::string &get_text(const PSILogRecord &record) const {
+		return _layout != nullptr ? record.get_text(*_layout) : record.get_entry();
+	}
+
 	// Provide a way to implement flushing the output manually
 	virtual void flush() = 0;
+
+	// Called periodically by the asynchronous writer thread when it's idle,
+	// for outputs doing timed work like flushing buffered entries
+	virtual void tick() {}
+
+	// Called from the crash handler, see PSILog::install_crash_handler()
+	// Only async-signal-safe functions can be used, and no locks taken, as the crashed
+	// thread may be holding them. flush_emergency() writes out the entries the output has
+	// buffered, write_emergency() writes an entry straight to the destination.
+	// By default nothing is done, which suits outputs without buffering of their own.
+	virtual void flush_emergency() {}
+	virtual void write_emergency(const char *entry, size_t length, int log_level) {}
+
+	// Circuit breaker of the writes to us, see PSILogBreaker. While tripped, the
+	// logger doesn't write, flush or tick us.
+	PSILogBreaker &get_breaker() { return _breaker; }
+	const PSILogBreaker &get_breaker() const { return _breaker; }
+
+	// Name in the entries about our health, our place in the output chain if not set
+	const std::string &get_name() const { return _name; }
+	void set_name(const std::string &name) { _name = name; }
+
+private:
+	std::shared_ptr<const PSILogLayout> _layout;
+	PSILogBreaker _breaker;
+	std::string _name;
 };
 
 // Default implementation of outputting log messages to the console
@@ -139,20 +1103,316 @@ public:
 	~PSILogConsoleOutput() = default;
 
 	bool write_log_entry(const std::string &log_entry, int log_level) override;
+
+	// Flushes each stream once per batch
+	bool write_log_entries(const PSILogRecord *records, size_t count) override;
+
 	void flush() override;
+	void write_emergency(const char *entry, size_t length, int log_level) override;
+};
+
+// Decides when buffering outputs write their buffered entries out
+// By default every entry is flushed right away. With a flush byte threshold set,
+// entries are buffered until any of these happens: the buffered bytes reach the
+// threshold, the flush interval has passed since the last flush, an entry of one
+// of the flush levels arrives, or the output is flushed.
+// The interval is checked on writes, and by tick() when logging asynchronously.
+class PSILogFlushPolicy {
+public:
+	static const int DEFAULT_FLUSH_INTERVAL_MS = 1000;
+
+	PSILogFlushPolicy();
+
+	// Should the buffer be flushed after an entry of log_level was added to it
+	bool should_flush(size_t buffered_bytes, int log_level) const;
+
+	// Has the flush interval passed since the last flush
+	bool interval_elapsed() const;
+
+	// Called after flushing, restarts the interval
+	void flushed();
+
+	// Buffered bytes triggering a flush, 0 flushes every entry
+	void set_flush_bytes(size_t flush_bytes) { _flush_bytes = flush_bytes; }
+	size_t get_flush_bytes() const { return _flush_bytes; }
+
+	// Longest time entries are kept buffered, 0 disables the timer
+	void set_flush_interval(std::chrono::milliseconds flush_interval) { _flush_interval = flush_interval; }
+	std::chrono::milliseconds get_flush_interval() const { return _flush_interval; }
+
+	// Log levels flushed right away, PSILog::ERR by default
+	void set_flush_levels(int flush_levels) { _flush_levels = flush_levels; }
+	int get_flush_levels() const { return _flush_levels; }
+
+private:
+	size_t _flush_bytes = 0;
+	std::chrono::milliseconds _flush_interval;
+	int _flush_levels;
+	std::chrono::steady_clock::time_point _last_flush;
 };
 
 // Default implementation of outputting to a file
+// Entries are buffered according to the flush policy, see PSILogFlushPolicy
+//
+// The file can be rotated by size and by time. The current file is renamed to
+// output_path.N, with N one higher than the last rotated file, and a new file is
+// opened in its place. Only the rename and open happen on the writing thread,
+// a background thread running at a low priority compresses the rotated files,
+// when built with zlib, and removes the oldest ones beyond the retention count.
+//
+// With an index interval set, a sparse index of the file is written alongside it,
+// to output_path.idx, see PSILogIndex.h. Entries are numbered in the order they are
+// written, the numbering continues across rotations, and when the output is opened
+// again on an indexed file. Rotated files keep their index, as output_path.N.idx.
 class PSILogFileOutput : public PSILogOutput {
 public:
+	// How long to wait before trying again to rotate a file that couldn't be renamed
+	static const int ROTATION_RETRY_MS = 100;
+
 	PSILogFileOutput(const char *output_path);
 	~PSILogFileOutput();
 
 	bool write_log_entry(const std::string &log_entry, int log_level) override;
+	bool write_log_record(const PSILogRecord &record) override;
+
+	// Buffers the whole batch under one lock, writing and flushing it at once,
+	// as the flush policy would for its last entry
+	bool write_log_entries(const PSILogRecord *records, size_t count) override;
+
 	void flush() override;
+	void tick() override;
+
+	// Appends to the file through a descriptor of its own
+	void flush_emergency() override;
+	void write_emergency(const char *entry, size_t length, int log_level) override;
+
+	void set_flush_bytes(size_t flush_bytes);
+	size_t get_flush_bytes();
+	void set_flush_interval(std::chrono::milliseconds flush_interval);
+	std::chrono::milliseconds get_flush_interval();
+	void set_flush_levels(int flush_levels);
+	int get_flush_levels();
+
+	// Rotate when the file grows to rotation_size bytes, 0 disables
+	// If renaming the file fails, it keeps growing, and the rotation is
+	// tried again after ROTATION_RETRY_MS
+	void set_rotation_size(size_t rotation_size);
+	size_t get_rotation_size();
+
+	// Rotate at multiples of the interval since the epoch, so an interval of
+	// an hour rotates on the hour, 0 disables
+	void set_rotation_interval(std::chrono::seconds rotation_interval);
+	std::chrono::seconds get_rotation_interval();
+
+	// Number of rotated files kept, 0 keeps all of them
+	void set_rotation_keep(unsigned rotation_keep);
+	unsigned get_rotation_keep();
+
+	// Compress the rotated files with gzip, only when built with zlib
+	void set_rotation_compress(bool rotation_compress);
+	bool get_rotation_compress();
+
+	// Wait until the background thread is done with the rotated files
+	void wait_rotation_idle();
+
+	// Add an index point every index_interval bytes, 0 disables the index
+	// With the index, each entry is written on one line, see PSILogIndex.h
+	void set_index_interval(uint32_t index_interval);
+	uint32_t get_index_interval();
+
+	// Path of the index of the log file at path
+	static std::string get_index_path(const std::string &path);
 
 private:
-	const char *_output_path = "";
+	// Buffer the entry logged at timestamp, the mutex must be held
+	bool write_entry(const std::string &log_entry, int log_level,
+			 std::chrono::system_clock::time_point timestamp);
+
+	// Add the entry to the buffer, rotating and indexing, the mutex must be held
+	void append_entry(const std::string &log_entry, std::chrono::system_clock::time_point timestamp);
+
+	// Write the buffered entries to the file, the mutex must be held
+	void flush_buffer();
+
+	// Open the index of the current file, the mutex must be held
+	void open_index();
+
+	// Rotate if the file is full or the interval has passed, the mutex must be held
+	void check_rotation(size_t incoming_bytes);
+	// False if the file couldn't be renamed, and is still appended to
+	bool rotate();
+	void schedule_next_rotation();
+
+	void rotation_thread_main();
+
+	std::string _output_path;
 	std::fstream _fs;
 	std::mutex _mutex;
+
+	std::string _buffer;
+	PSILogFlushPolicy _flush_policy;
+
+	size_t _file_size = 0;
+	size_t _rotation_size = 0;
+	std::chrono::seconds _rotation_interval { 0 };
+	std::chrono::system_clock::time_point _next_rotation;
+	unsigned _rotation_keep = 0;
+	bool _rotation_compress = false;
+	unsigned _rotation_index = 0;
+	bool _rotation_index_known = false;
+	std::chrono::steady_clock::time_point _rotation_retry_at;
+
+	uint32_t _index_interval = 0;
+	unique_ptr<PSILogIndexWriter> _index;
+	uint64_t _sequence = 0;
+
+	// Rotated files waiting for the background thread
+	std::mutex _rotation_mutex;
+	std::condition_variable _rotation_wake;
+	std::condition_variable _rotation_idle;
+	std::vector<std::string> _rotated;
+	bool _rotation_busy = false;
+	bool _rotation_stopping = false;
+	std::thread _rotation_thread;
+};
+
+// Output writing straight to a file descriptor, without the iostream layers
+// Files are opened with O_APPEND, so several processes can share a log file.
+// Buffered entries, see PSILogFlushPolicy, are written with writev() in batches of
+// whole entries of at most PIPE_BUF bytes, which the kernel appends atomically, so
+// entries of different processes don't interleave. Longer entries are written alone.
+class PSILogFdOutput : public PSILogOutput {
+public:
+	// Open output_path for appending, creating it if needed
+	PSILogFdOutput(const char *output_path);
+
+	// Write to an already open file descriptor, closing it at the end if owns_fd is true
+	PSILogFdOutput(int fd, bool owns_fd);
+
+	~PSILogFdOutput();
+
+	bool write_log_entry(const std::string &log_entry, int log_level) override;
+	void flush() override;
+	void tick() override;
+	void flush_emergency() override;
+	void write_emergency(const char *entry, size_t length, int log_level) override;
+
+	int get_fd() const { return _fd; }
+
+	// Entries lost as writing them failed, a failed write drops the entries queued after it
+	uint64_t get_dropped() const { return _dropped; }
+
+	void set_flush_bytes(size_t flush_bytes);
+	size_t get_flush_bytes();
+	void set_flush_interval(std::chrono::milliseconds flush_interval);
+	std::chrono::milliseconds get_flush_interval();
+	void set_flush_levels(int flush_levels);
+	int get_flush_levels();
+
+private:
+	// Write the pending entries out, the mutex must be held
+	bool flush_pending();
+
+	// Write the whole iovec array, continuing after partial writes
+	// Returns the number of entries written completely, count unless writing failed
+	int write_fully(struct iovec *iov, int count);
+
+	int _fd = -1;
+	bool _owns_fd = false;
+	std::mutex _mutex;
+	std::atomic<uint64_t> _dropped { 0 };
+
+	// Pending entries, the strings are kept for reuse between flushes
+	std::vector<std::string> _pending;
+	size_t _pending_count = 0;
+	size_t _pending_bytes = 0;
+	std::vector<struct iovec> _iov;
+
+	PSILogFlushPolicy _flush_policy;
+};
+
+// Output copying entries straight into memory mapped log segment files
+// Segments are preallocated files of a fixed size, named output_path.000000,
+// output_path.000001 and so on. Writers reserve room for their entry by atomically
+// moving the segment's offset forward, and copy the entry into the mapping, so
+// writing takes no locks and makes no system calls. The writer whose entry doesn't
+// fit switches to the next segment, which a background thread has already mapped,
+// and the background thread then finishes the old segment and maps the next one.
+// Finished segments are truncated to their content, the current one stays at the
+// full size with zeros at the end until it's finished.
+// When the next segment can't be mapped, the entries that don't fit in the current
+// one are dropped, and the background thread keeps trying to map it.
+class PSILogMmapOutput : public PSILogOutput {
+public:
+	static const size_t DEFAULT_SEGMENT_SIZE = 16 * 1024 * 1024;
+
+	// How long to wait before trying again to map a segment that failed
+	static const int SEGMENT_RETRY_MS = 100;
+
+	// Segment numbering continues after the existing segments of output_path
+	PSILogMmapOutput(const char *output_path, size_t segment_size = DEFAULT_SEGMENT_SIZE);
+	~PSILogMmapOutput();
+
+	// Entries longer than the segment size are not written
+	bool write_log_entry(const std::string &log_entry, int log_level) override;
+
+	// Schedule writing the mapped pages of the current segment to the disk
+	void flush() override;
+
+	size_t get_segment_size() const { return _segment_size; }
+
+	// Path of the segment file with index
+	std::string get_segment_path(unsigned index) const;
+
+private:
+	struct Segment {
+		unsigned index = 0;
+		int fd = -1;
+		char *data = nullptr;
+
+		// Bytes reserved by writers, can go past the segment size
+		std::atomic<size_t> reserved { 0 };
+
+		// Bytes copied into the mapping
+		std::atomic<size_t> committed { 0 };
+
+		// Bytes the segment ended up holding, unset until the writer crossing its end
+		// marks it. Writers after that one may switch away from the segment first.
+		std::atomic<size_t> used { USED_UNSET };
+
+		static const size_t USED_UNSET = SIZE_MAX;
+	};
+
+	// Create and map the segment file with index, returns nullptr on failure
+	Segment *map_segment(unsigned index);
+
+	// Unmap the segment once all of its writers are done, truncating the file to its content
+	void finish_segment(Segment *segment);
+
+	// Switch from the full segment to the next one, false if there is no next one
+	// as mapping it failed, and the entry should be dropped
+	bool next_segment(Segment *full);
+
+	void segment_thread_main();
+
+	std::string _output_path;
+	size_t _segment_size;
+
+	std::atomic<Segment *> _current { nullptr };
+
+	// Segments are kept until the output is destroyed, as writers may still look at
+	// the offsets of the segments switched away from
+	std::vector<unique_ptr<Segment>> _segments;
+
+	// Guards switching segments and the background thread state below
+	std::mutex _segment_mutex;
+	std::condition_variable _segment_ready;
+	std::condition_variable _segment_wanted;
+	Segment *_next = nullptr;
+	bool _next_failed = false;
+	std::chrono::steady_clock::time_point _retry_at;
+	unsigned _next_index = 0;
+	std::vector<Segment *> _finishing;
+	bool _stopping = false;
+	std::thread _segment_thread;
 };
@@ -0,0 +1,508 @@
+// PSILogBinaryOutput.cpp
+//
+// Log output storing the entries as compact binary records, and the decoder
+// turning the binary logs back into text
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef PSILOG_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "PSILogBinaryOutput.h"
+
+// Table driven CRC-32, the table is built on the first call. The zlib one computes
+// the same checksum several times faster, so it's used when available
+uint32_t psilog_crc32(const char *data, size_t length, uint32_t crc) {
+#ifdef PSILOG_HAVE_ZLIB
+	while (length > 0) {
+		uInt chunk = length > UINT_MAX ? UINT_MAX : (uInt)length;
+		crc = (uint32_t)crc32(crc, (const Bytef *)data, chunk);
+		data += chunk;
+		length -= chunk;
+	}
+
+	return crc;
+#else
+	static const struct Table {
+		uint32_t values[256];
+
+		Table() {
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t value = i;
+				for (int bit = 0; bit < 8; bit++) {
+					value = (value & 1) != 0 ? 0xedb88320 ^ (value >> 1) : value >> 1;
+				}
+				values[i] = value;
+			}
+		}
+	} table;
+
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++) {
+		crc = table.values[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+	}
+
+	return ~crc;
+#endif
+}
+
+// Append the raw bytes of value
+template <typename T>
+static void put(std::string &out, T value) {
+	out.append((const char *)&value, sizeof(T));
+}
+
+// Read value from the raw bytes at p, if there is room left before end
+template <typename T>
+static bool get(const char *&p, const char *end, T &value) {
+	if ((size_t)(end - p) < sizeof(T)) {
+		return false;
+	}
+
+	memcpy(&value, p, sizeof(T));
+	p += sizeof(T);
+
+	return true;
+}
+
+static bool get_text(const char *&p, const char *end, size_t length, std::string &text) {
+	if ((size_t)(end - p) < length) {
+		return false;
+	}
+
+	text.assign(p, length);
+	p += length;
+
+	return true;
+}
+
+static bool write_fully(int fd, const char *data, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (written <= 0) {
+			return false;
+		}
+
+		data += written;
+		length -= written;
+	}
+
+	return true;
+}
+
+PSILogBinaryOutput::PSILogBinaryOutput(const char *output_path, size_t block_size) :
+	_block_size(block_size)
+{
+	_flush_policy.set_flush_bytes(block_size);
+	_block.reserve(block_size + PSILOG_BINARY_BLOCK_HEADER_SIZE);
+
+	_fd = open(output_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (_fd < 0) {
+		return;
+	}
+
+	// New files start with the header, appending continues after the existing blocks
+	struct stat st;
+	if (fstat(_fd, &st) == 0 && st.st_size == 0) {
+		std::string header(PSILOG_BINARY_MAGIC, sizeof(PSILOG_BINARY_MAGIC));
+		put(header, PSILOG_BINARY_VERSION);
+		put(header, PSILOG_BINARY_HEADER_SIZE);
+		put(header, (uint32_t)0);
+		write_fully(_fd, header.data(), header.size());
+	}
+}
+
+PSILogBinaryOutput::~PSILogBinaryOutput() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	write_block();
+
+	if (_fd >= 0) {
+		close(_fd);
+	}
+}
+
+bool PSILogBinaryOutput::write_log_entry(const std::string &log_entry, int log_level) {
+	PSILogRecord record;
+	record.log_level = log_level;
+	record.timestamp = std::chrono::system_clock::now();
+	record.thread_id = std::this_thread::get_id();
+	record.thread_index = psilog_thread_index();
+	record.message = log_entry.data();
+	record.message_length = log_entry.size();
+
+	std::lock_guard<std::mutex> guard(_mutex);
+	return append_record(record);
+}
+
+bool PSILogBinaryOutput::write_log_record(const PSILogRecord &record) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return append_record(record);
+}
+
+void PSILogBinaryOutput::flush() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	write_block();
+}
+
+void PSILogBinaryOutput::tick() {
+	std::lock_guard<std::mutex> guard(_mutex);
+
+	if (_block_records > 0 && _flush_policy.interval_elapsed() == true) {
+		write_block();
+	}
+}
+
+bool PSILogBinaryOutput::append_record(const PSILogRecord &record) {
+	if (_fd < 0) {
+		return false;
+	}
+
+	// Keep the block within the length the decoder accepts
+	const char *payload = record.site != nullptr ? record.payload : record.message;
+	size_t payload_length = record.site != nullptr ? record.payload_length : record.message_length;
+	if (payload_length > PSILOG_BINARY_MAX_BLOCK_LENGTH - MAX_RECORD_OVERHEAD) {
+		return false;
+	}
+	if (_block_records > 0 &&
+	    _block.size() - PSILOG_BINARY_BLOCK_HEADER_SIZE + payload_length + MAX_RECORD_OVERHEAD > PSILOG_BINARY_MAX_BLOCK_LENGTH &&
+	    write_block() == false) {
+		return false;
+	}
+
+	// Room for the block header, filled in when the block is written
+	if (_block.empty() == true) {
+		_block.resize(PSILOG_BINARY_BLOCK_HEADER_SIZE);
+	}
+
+	uint16_t thread_index = get_thread_index(record.thread_id);
+
+	// Define the call site before its first entry
+	uint32_t site_id = 0;
+	if (record.site != nullptr) {
+		site_id = record.site->get_id();
+		if (site_id >= _defined_sites.size()) {
+			_defined_sites.resize(site_id + 1, false);
+		}
+
+		if (_defined_sites[site_id] == false) {
+			const char *format = record.site->get_format();
+			const char *file = record.site->get_file();
+			const char *signature = record.site->get_signature();
+			uint16_t format_length = (uint16_t)std::min(strlen(format), (size_t)UINT16_MAX);
+			uint16_t file_length = (uint16_t)std::min(strlen(file), (size_t)UINT16_MAX);
+			uint16_t signature_length = (uint16_t)std::min(strlen(signature), (size_t)UINT16_MAX);
+
+			put(_block, (uint8_t)PSILOG_RECORD_CALL_SITE);
+			put(_block, site_id);
+			put(_block, (uint32_t)record.site->get_line());
+			put(_block, format_length);
+			put(_block, file_length);
+			put(_block, signature_length);
+			_block.append(format, format_length);
+			_block.append(file, file_length);
+			_block.append(signature, signature_length);
+			_block_records++;
+			_defined_sites[site_id] = true;
+		}
+	}
+
+	int64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		record.timestamp.time_since_epoch()).count();
+
+	put(_block, (uint8_t)PSILOG_RECORD_ENTRY);
+	put(_block, (uint8_t)record.log_level);
+	put(_block, thread_index);
+	put(_block, site_id);
+	put(_block, timestamp);
+	put(_block, (uint32_t)payload_length);
+	_block.append(payload, payload_length);
+	_block_records++;
+
+	if (_flush_policy.should_flush(_block.size() - PSILOG_BINARY_BLOCK_HEADER_SIZE, record.log_level) == true) {
+		return write_block();
+	}
+
+	return true;
+}
+
+uint16_t PSILogBinaryOutput::get_thread_index(std::thread::id thread_id) {
+	auto it = _threads.find(thread_id);
+	if (it != _threads.end()) {
+		return it->second;
+	}
+
+	// Once the indexes run out, they are given out again from 0, defining
+	// each thread again as it logs, the decoder replaces the old definitions
+	if (_threads.size() > UINT16_MAX) {
+		_threads.clear();
+	}
+
+	uint16_t index = (uint16_t)_threads.size();
+	_threads[thread_id] = index;
+
+	std::ostringstream ss;
+	ss << thread_id;
+	std::string text = ss.str();
+
+	put(_block, (uint8_t)PSILOG_RECORD_THREAD);
+	put(_block, index);
+	put(_block, (uint16_t)text.size());
+	_block += text;
+	_block_records++;
+
+	return index;
+}
+
+bool PSILogBinaryOutput::write_block() {
+	_flush_policy.flushed();
+
+	if (_block_records == 0 || _fd < 0) {
+		return _fd >= 0;
+	}
+
+	const char *records = _block.data() + PSILOG_BINARY_BLOCK_HEADER_SIZE;
+	uint32_t length = (uint32_t)(_block.size() - PSILOG_BINARY_BLOCK_HEADER_SIZE);
+
+	std::string header;
+	put(header, PSILOG_BINARY_BLOCK_MAGIC);
+	put(header, length);
+	put(header, _block_records);
+	put(header, psilog_crc32(records, length));
+	_block.replace(0, PSILOG_BINARY_BLOCK_HEADER_SIZE, header);
+
+	bool success = write_fully(_fd, _block.data(), _block.size());
+
+	_block.clear();
+	_block_records = 0;
+
+	return success;
+}
+
+// Same as write_block(), but filling in the header in place
+void PSILogBinaryOutput::flush_emergency() {
+	if (_block_records == 0 || _fd < 0 || _block.size() < PSILOG_BINARY_BLOCK_HEADER_SIZE) {
+		return;
+	}
+
+	char *block = &_block[0];
+	uint32_t length = (uint32_t)(_block.size() - PSILOG_BINARY_BLOCK_HEADER_SIZE);
+	uint32_t header[4] = { PSILOG_BINARY_BLOCK_MAGIC, length, _block_records,
+			       psilog_crc32(block + PSILOG_BINARY_BLOCK_HEADER_SIZE, length) };
+	memcpy(block, header, sizeof(header));
+
+	write_fully(_fd, block, _block.size());
+	_block.clear();
+	_block_records = 0;
+}
+
+void PSILogBinaryOutput::set_flush_interval(std::chrono::milliseconds flush_interval) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_flush_policy.set_flush_interval(flush_interval);
+}
+
+std::chrono::milliseconds PSILogBinaryOutput::get_flush_interval() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _flush_policy.get_flush_interval();
+}
+
+void PSILogBinaryOutput::set_flush_levels(int flush_levels) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_flush_policy.set_flush_levels(flush_levels);
+}
+
+int PSILogBinaryOutput::get_flush_levels() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _flush_policy.get_flush_levels();
+}
+
+const size_t PSILogBinaryOutput::MAX_RECORD_OVERHEAD;
+
+// PSILogBinaryDecoder implementation
+const size_t PSILogBinaryDecoder::READ_SIZE;
+
+bool PSILogBinaryDecoder::fill(std::istream &in, size_t size) {
+	if (_buffer.size() - _buffer_pos >= size) {
+		return true;
+	}
+
+	// Drop what has been decoded before reading more
+	_buffer.erase(0, _buffer_pos);
+	_buffer_pos = 0;
+
+	while (_buffer.size() < size && in.good() == true) {
+		size_t used = _buffer.size();
+		_buffer.resize(used + std::max(size - used, READ_SIZE));
+		in.read(&_buffer[used], _buffer.size() - used);
+		_buffer.resize(used + (size_t)in.gcount());
+	}
+
+	return _buffer.size() >= size;
+}
+
+// The blocks are read from in one at a time, so only the largest block is held in memory
+bool PSILogBinaryDecoder::decode(std::istream &in, std::ostream &out) {
+	_buffer.clear();
+	_buffer_pos = 0;
+
+	uint16_t version = 0;
+	uint16_t header_size = 0;
+	if (fill(in, PSILOG_BINARY_HEADER_SIZE) == false ||
+	    memcmp(_buffer.data(), PSILOG_BINARY_MAGIC, sizeof(PSILOG_BINARY_MAGIC)) != 0) {
+		_error = "not a binary log";
+		return false;
+	}
+
+	const char *p = _buffer.data() + sizeof(PSILOG_BINARY_MAGIC);
+	const char *end = _buffer.data() + _buffer.size();
+	get(p, end, version);
+	get(p, end, header_size);
+	if (version > PSILOG_BINARY_VERSION || header_size < PSILOG_BINARY_HEADER_SIZE) {
+		_error = "unsupported binary log version " + std::to_string(version);
+		return false;
+	}
+	fill(in, header_size);
+	_buffer_pos = std::min((size_t)header_size, _buffer.size());
+
+	while (fill(in, 1) == true) {
+		uint32_t magic = 0, length = 0, count = 0, crc = 0;
+		bool valid = fill(in, PSILOG_BINARY_BLOCK_HEADER_SIZE);
+		if (valid == true) {
+			p = _buffer.data() + _buffer_pos;
+			end = _buffer.data() + _buffer.size();
+			get(p, end, magic);
+			get(p, end, length);
+			get(p, end, count);
+			get(p, end, crc);
+			valid = magic == PSILOG_BINARY_BLOCK_MAGIC && length <= PSILOG_BINARY_MAX_BLOCK_LENGTH &&
+				fill(in, PSILOG_BINARY_BLOCK_HEADER_SIZE + (size_t)length);
+		}
+
+		if (valid == true) {
+			const char *records = _buffer.data() + _buffer_pos + PSILOG_BINARY_BLOCK_HEADER_SIZE;
+			if (psilog_crc32(records, length) == crc && decode_block(records, length, out) == true) {
+				_buffer_pos += PSILOG_BINARY_BLOCK_HEADER_SIZE + length;
+				continue;
+			}
+		}
+
+		// Look for the next block after a corrupt one
+		_corrupt_blocks++;
+		_buffer_pos++;
+		while (fill(in, sizeof(uint32_t)) == true &&
+		       memcmp(_buffer.data() + _buffer_pos, &PSILOG_BINARY_BLOCK_MAGIC, sizeof(uint32_t)) != 0) {
+			_buffer_pos++;
+		}
+		if (_buffer.size() - _buffer_pos < sizeof(uint32_t)) {
+			break;
+		}
+	}
+
+	_buffer.clear();
+	_buffer.shrink_to_fit();
+
+	if (_corrupt_blocks > 0) {
+		_error = std::to_string(_corrupt_blocks) + " corrupt blocks skipped";
+		return false;
+	}
+
+	return true;
+}
+
+bool PSILogBinaryDecoder::decode_block(const char *data, size_t length, std::ostream &out) {
+	const char *p = data;
+	const char *end = data + length;
+
+	while (p < end) {
+		uint8_t type = 0;
+		get(p, end, type);
+
+		if (type == PSILOG_RECORD_THREAD) {
+			uint16_t index = 0, text_length = 0;
+			if (get(p, end, index) == false || get(p, end, text_length) == false ||
+			    get_text(p, end, text_length, _threads[index]) == false) {
+				return false;
+			}
+		} else if (type == PSILOG_RECORD_CALL_SITE) {
+			uint32_t id = 0, line = 0;
+			uint16_t format_length = 0, file_length = 0, signature_length = 0;
+			std::string signature;
+			CallSite site;
+			if (get(p, end, id) == false || get(p, end, line) == false ||
+			    get(p, end, format_length) == false || get(p, end, file_length) == false ||
+			    get(p, end, signature_length) == false ||
+			    get_text(p, end, format_length, site.format) == false ||
+			    get_text(p, end, file_length, site.file) == false ||
+			    get_text(p, end, signature_length, signature) == false) {
+				return false;
+			}
+
+			site.line = line;
+			for (char code : signature) {
+				site.decoders.push_back(psilog_decoder_for_code(code));
+			}
+			site.signature = move(signature);
+			_sites[id] = move(site);
+		} else if (type == PSILOG_RECORD_ENTRY) {
+			uint8_t level = 0;
+			uint16_t thread_index = 0;
+			uint32_t site_id = 0, payload_length = 0;
+			int64_t timestamp = 0;
+			if (get(p, end, level) == false || get(p, end, thread_index) == false ||
+			    get(p, end, site_id) == false || get(p, end, timestamp) == false ||
+			    get(p, end, payload_length) == false || (size_t)(end - p) < payload_length) {
+				return false;
+			}
+
+			_text.clear();
+			if (_add_prefix == true) {
+				// Same prefix as PSILog::get_log_entry_prefix()
+				std::time_t time = (std::time_t)(timestamp / 1000000000);
+				if (timestamp < 0 && timestamp % 1000000000 != 0) {
+					time--;
+				}
+
+				struct tm tm;
+				char time_text[16];
+				localtime_r(&time, &tm);
+				size_t time_length = strftime(time_text, sizeof(time_text), "[%H:%M:%S] ", &tm);
+				_text.append(time_text, time_length);
+				_text += "[" + _threads[thread_index] + "] ";
+			}
+
+			auto site = _sites.find(site_id);
+			if (site_id == 0 || site == _sites.end()) {
+				_text.append(p, payload_length);
+			} else {
+				// Arguments of unknown types, or not fitting in the payload, can't be
+				// decoded, leave their placeholders as is
+				const std::vector<PSILogDecodeFunc> &decoders = site->second.decoders;
+				size_t decoder_count = psilog_payload_arg_count(site->second.signature.c_str(), p, payload_length);
+
+				psilog_render_format(site->second.format.c_str(), p, decoders.data(), decoder_count, _text);
+				_text += '\n';
+			}
+
+			p += payload_length;
+			out << _text;
+			_entry_count++;
+		} else {
+			return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,164 @@
+// PSILogBinaryOutput.h
+//
+// Log output storing the entries as compact binary records, and the decoder
+// turning the binary logs back into text
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <iostream>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <stdint.h>
+
+#include "PSILog.h"
+
+// Binary log file format, all numbers are in the native byte order, little endian
+// on the supported platforms.
+//
+// The file starts with a header:
+//   char[8] magic "PSILOGB\0", u16 format version, u16 header size, u32 flags
+//
+// The records are stored in blocks, each covered by a checksum:
+//   u32 block magic, u32 length of the records, u32 record count, u32 CRC-32 of the records
+//
+// Records start with their type:
+//   Entry:     u8 type 1, u8 level, u16 thread index, u32 call site id, i64 timestamp in ns
+//              since the epoch, u32 payload length, payload
+//   Call site: u8 type 2, u32 call site id, u32 line, u16 format length, u16 file length,
+//              u16 signature length, format, file, signature
+//   Thread:    u8 type 3, u16 thread index, u16 id text length, id text
+//
+// Deferred entries carry their call site id, defined by a call site record before its first use,
+// and their binary argument payload, decoded using the type signature of the call site.
+// Other entries have call site id 0, and the text of the entry without the prefix as the payload.
+// Threads are numbered in the order they first log, with a thread record defining each one.
+// After 65536 threads the numbering starts again from 0, and a thread record for a number
+// already defined replaces the earlier definition.
+static const char PSILOG_BINARY_MAGIC[8] = { 'P', 'S', 'I', 'L', 'O', 'G', 'B', '\0' };
+static const uint16_t PSILOG_BINARY_VERSION = 1;
+static const uint16_t PSILOG_BINARY_HEADER_SIZE = 16;
+static const uint32_t PSILOG_BINARY_BLOCK_MAGIC = 0x314b4c42;
+static const size_t PSILOG_BINARY_BLOCK_HEADER_SIZE = 16;
+
+// Longer blocks are corrupt, so a damaged length isn't trusted before the checksum
+static const uint32_t PSILOG_BINARY_MAX_BLOCK_LENGTH = 64 * 1024 * 1024;
+
+enum PSILogBinaryRecordType {
+	PSILOG_RECORD_ENTRY = 1,
+	PSILOG_RECORD_CALL_SITE = 2,
+	PSILOG_RECORD_THREAD = 3
+};
+
+// CRC-32 (IEEE) of the data, continuing from crc
+uint32_t psilog_crc32(const char *data, size_t length, uint32_t crc = 0);
+
+// Records are collected into blocks of about block_size bytes, written when the block
+// is full, or when the flush policy says so, see PSILogFlushPolicy. By default blocks
+// are also written after the flush interval, and on ERR entries. Entries too long for
+// a block of PSILOG_BINARY_MAX_BLOCK_LENGTH are dropped.
+class PSILogBinaryOutput : public PSILogOutput {
+public:
+	static const size_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+
+	PSILogBinaryOutput(const char *output_path, size_t block_size = DEFAULT_BLOCK_SIZE);
+	~PSILogBinaryOutput();
+
+	// Entries written without a record are stored as text, with the current time and thread
+	bool write_log_entry(const std::string &log_entry, int log_level) override;
+	// Stores the fields of the record, the text is never rendered
+	bool write_log_record(const PSILogRecord &record) override;
+
+	void flush() override;
+	void tick() override;
+
+	// Writes out the current block, entries written in an emergency are not stored,
+	// as defining their thread would need allocating
+	void flush_emergency() override;
+
+	void set_flush_interval(std::chrono::milliseconds flush_interval);
+	std::chrono::milliseconds get_flush_interval();
+	void set_flush_levels(int flush_levels);
+	int get_flush_levels();
+
+private:
+	// Most bytes the thread and call site definitions and the header of an entry take
+	static const size_t MAX_RECORD_OVERHEAD = 4 * 65536;
+
+	// Add the record to the current block, the mutex must be held
+	bool append_record(const PSILogRecord &record);
+
+	// Index of the thread, defining it in the file on first use
+	uint16_t get_thread_index(std::thread::id thread_id);
+
+	// Write the current block to the file, the mutex must be held
+	bool write_block();
+
+	int _fd = -1;
+	std::mutex _mutex;
+
+	size_t _block_size;
+	std::string _block;
+	uint32_t _block_records = 0;
+
+	std::unordered_map<std::thread::id, uint16_t> _threads;
+	std::vector<bool> _defined_sites;
+
+	PSILogFlushPolicy _flush_policy;
+};
+
+// Turns binary logs back into the text the text outputs write, with the same prefix
+// as PSILog::get_log_entry_prefix(), when enabled
+class PSILogBinaryDecoder {
+public:
+	PSILogBinaryDecoder() = default;
+	~PSILogBinaryDecoder() = default;
+
+	// Decode the binary log from in, writing the text to out
+	// Returns false if in is not a binary log, or if some blocks were corrupt
+	bool decode(std::istream &in, std::ostream &out);
+
+	void set_add_prefix(bool add_prefix) { _add_prefix = add_prefix; }
+	bool get_add_prefix() const { return _add_prefix; }
+
+	size_t get_entry_count() const { return _entry_count; }
+	size_t get_corrupt_blocks() const { return _corrupt_blocks; }
+	const std::string &get_error() const { return _error; }
+
+private:
+	// Bytes read from the input at a time
+	static const size_t READ_SIZE = 64 * 1024;
+
+	struct CallSite {
+		std::string format;
+		std::string file;
+		uint32_t line = 0;
+		std::string signature;
+		std::vector<PSILogDecodeFunc> decoders;
+	};
+
+	// Read from in until at least size bytes after the decoding position are buffered,
+	// returns false if the input ends before that
+	bool fill(std::istream &in, size_t size);
+
+	// Decode the records of one block, returns false if they don't parse
+	bool decode_block(const char *data, size_t length, std::ostream &out);
+
+	bool _add_prefix = true;
+	size_t _entry_count = 0;
+	size_t _corrupt_blocks = 0;
+	std::string _error;
+
+	std::unordered_map<uint32_t, CallSite> _sites;
+	std::unordered_map<uint16_t, std::string> _threads;
+	std::string _text;
+
+	// Input read so far, and the decoding position in it
+	std::string _buffer;
+	size_t _buffer_pos = 0;
+};
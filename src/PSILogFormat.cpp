@@ -0,0 +1,196 @@
+// PSILogFormat.cpp
+//
+// Argument formatting for the format string logging interface, where format strings are
+// parsed and checked at compile time, and argument encoding for deferred logging, where
+// the logging thread only copies the raw argument bytes, and the text is rendered later
+// by the asynchronous writer thread
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#include <atomic>
+#include <algorithm>
+#include <stdio.h>
+
+#include "PSILogFormat.h"
+
+// Source of unique call site ids, 0 is reserved for entries without a call site
+static std::atomic<uint32_t> next_call_site_id { 1 };
+
+PSILogCallSite::PSILogCallSite(const char *format, const char *file, int line, const char *signature) :
+	_format(format),
+	_file(file),
+	_line(line),
+	_signature(signature),
+	_id(next_call_site_id++)
+{}
+
+PSILogDecodeFunc psilog_decoder_for_code(char code) {
+	switch (code) {
+	case 'b': return &PSILogArgCodec<bool>::decode;
+	case 'c': return &PSILogArgCodec<char>::decode;
+	case 's': return &PSILogArgCodec<int16_t>::decode;
+	case 'i': return &PSILogArgCodec<int32_t>::decode;
+	case 'l': return &PSILogArgCodec<int64_t>::decode;
+	case 'S': return &PSILogArgCodec<uint16_t>::decode;
+	case 'I': return &PSILogArgCodec<uint32_t>::decode;
+	case 'L': return &PSILogArgCodec<uint64_t>::decode;
+	case 'f': return &PSILogArgCodec<float>::decode;
+	case 'd': return &PSILogArgCodec<double>::decode;
+	case 'D': return &PSILogArgCodec<long double>::decode;
+	case 'z': return &PSILogArgCodec<std::string>::decode;
+	default: return nullptr;
+	}
+}
+
+size_t psilog_payload_arg_count(const char *signature, const char *payload, size_t length) {
+	size_t count = 0;
+	size_t offset = 0;
+
+	for (; signature[count] != '\0'; count++) {
+		size_t size = 0;
+		switch (signature[count]) {
+		case 'b': size = sizeof(bool); break;
+		case 'c': size = sizeof(char); break;
+		case 's': case 'S': size = sizeof(int16_t); break;
+		case 'i': case 'I': size = sizeof(int32_t); break;
+		case 'l': case 'L': size = sizeof(int64_t); break;
+		case 'f': size = sizeof(float); break;
+		case 'd': size = sizeof(double); break;
+		case 'D': size = sizeof(long double); break;
+		case 'z': {
+			uint32_t string_length;
+			if (length - offset < sizeof(string_length)) {
+				return count;
+			}
+			memcpy(&string_length, payload + offset, sizeof(string_length));
+			size = sizeof(string_length) + (size_t)string_length;
+			break;
+		}
+		default:
+			return count;
+		}
+
+		if (length - offset < size) {
+			break;
+		}
+		offset += size;
+	}
+
+	return count;
+}
+
+void psilog_append(std::string &out, bool value) {
+	out += value ? '1' : '0';
+}
+
+void psilog_append(std::string &out, char value) {
+	out += value;
+}
+
+void psilog_append(std::string &out, signed char value) {
+	out += (char)value;
+}
+
+void psilog_append(std::string &out, unsigned char value) {
+	out += (char)value;
+}
+
+// Integers are converted by hand, going through printf is slow for the most common case
+void psilog_append(std::string &out, unsigned long long value) {
+	char buf[24];
+	char *end = buf + sizeof(buf);
+	char *p = end;
+
+	do {
+		*--p = '0' + (char)(value % 10);
+		value /= 10;
+	} while (value != 0);
+
+	out.append(p, end - p);
+}
+
+void psilog_append(std::string &out, long long value) {
+	if (value < 0) {
+		out += '-';
+		psilog_append(out, 0ULL - (unsigned long long)value);
+	} else {
+		psilog_append(out, (unsigned long long)value);
+	}
+}
+
+void psilog_append_hex(std::string &out, unsigned long long value) {
+	static const char digits[] = "0123456789abcdef";
+	char buf[16];
+	char *end = buf + sizeof(buf);
+	char *p = end;
+
+	do {
+		*--p = digits[value & 0xf];
+		value >>= 4;
+	} while (value != 0);
+
+	out.append(p, end - p);
+}
+
+// %g matches the default floating point output of std::ostream
+void psilog_append(std::string &out, double value) {
+	char buf[64];
+	int length = snprintf(buf, sizeof(buf), "%g", value);
+	out.append(buf, length);
+}
+
+void psilog_append(std::string &out, long double value) {
+	char buf[64];
+	int length = snprintf(buf, sizeof(buf), "%Lg", value);
+	out.append(buf, length);
+}
+
+void psilog_append_fixed(std::string &out, double value, int precision) {
+	char buf[512];
+	int length = snprintf(buf, sizeof(buf), "%.*f", precision, value);
+	out.append(buf, std::min((size_t)length, sizeof(buf) - 1));
+}
+
+void psilog_append(std::string &out, const char *value) {
+	if (value != nullptr) {
+		out += value;
+	}
+}
+
+void psilog_append(std::string &out, const std::string &value) {
+	out += value;
+}
+
+// Walk the format, copying the text between the placeholders as is
+// Placeholders without a matching argument, or that don't parse, are copied as is too
+void psilog_render_format(const char *format, const char *payload,
+			  const PSILogDecodeFunc *decoders, size_t decoder_count, std::string &out) {
+	size_t arg = 0;
+	const char *p = format;
+	PSILogFormatSegment segment;
+
+	while (*p != '\0') {
+		if ((p[0] == '{' && p[1] == '{') || (p[0] == '}' && p[1] == '}')) {
+			out += p[0];
+			p += 2;
+			continue;
+		}
+
+		if (p[0] == '{' && arg < decoder_count) {
+			size_t end = 1;
+			while (p[end] != '\0' && p[end] != '}') {
+				end++;
+			}
+
+			segment.precision = 6;
+			segment.spec = p[end] == '}' ? psilog_parse_format_spec(p, 1, end, segment.precision) : PSILOG_SPEC_INVALID;
+			if (segment.spec != PSILOG_SPEC_INVALID) {
+				decoders[arg++](payload, segment, out);
+				p += end + 1;
+				continue;
+			}
+		}
+
+		out += *p++;
+	}
+}
@@ -0,0 +1,586 @@
+// PSILogFormat.h
+//
+// Argument formatting for the format string logging interface, where format strings are
+// parsed and checked at compile time, and argument encoding for deferred logging, where
+// the logging thread only copies the raw argument bytes, and the text is rendered later
+// by the asynchronous writer thread
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <sstream>
+#include <type_traits>
+
+// Renders the binary argument payload of a deferred entry into text using the format,
+// appending to out
+typedef void (*PSILogRenderFunc)(const char *format, const char *payload, std::string &out);
+
+// Placeholder of a format string, see PSILOG_FMT() below
+struct PSILogFormatSegment;
+
+// Decodes one argument from the payload, appending its text formatted by the placeholder to out
+typedef void (*PSILogDecodeFunc)(const char *&payload, const PSILogFormatSegment &segment, std::string &out);
+
+// Format one argument according to its placeholder
+template <typename T>
+void psilog_format_value(std::string &out, const PSILogFormatSegment &segment, const T &value);
+
+// Static description of a deferred logging call site
+// One of these is created for every PSILOG_DEFERRED() call site the first
+// time it's executed, and gets a unique id
+// The signature has one type code per argument, see PSILogArgCodec::code,
+// so that the payload can be decoded without the program, like from binary logs
+class PSILogCallSite {
+public:
+	PSILogCallSite(const char *format, const char *file, int line, const char *signature = "");
+	~PSILogCallSite() = default;
+
+	PSILogCallSite(const PSILogCallSite &) = delete;
+	PSILogCallSite &operator =(const PSILogCallSite &) = delete;
+
+	const char *get_format() const { return _format; }
+	const char *get_file() const { return _file; }
+	int get_line() const { return _line; }
+	const char *get_signature() const { return _signature; }
+	uint32_t get_id() const { return _id; }
+
+private:
+	const char *_format;
+	const char *_file;
+	int _line;
+	const char *_signature;
+	uint32_t _id;
+};
+
+// Append the text form of the values, matching what std::ostream << would output
+void psilog_append(std::string &out, bool value);
+void psilog_append(std::string &out, char value);
+void psilog_append(std::string &out, signed char value);
+void psilog_append(std::string &out, unsigned char value);
+void psilog_append(std::string &out, long long value);
+void psilog_append(std::string &out, unsigned long long value);
+void psilog_append(std::string &out, double value);
+void psilog_append(std::string &out, long double value);
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+psilog_append(std::string &out, T value) {
+	psilog_append(out, (long long)value);
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value>::type
+psilog_append(std::string &out, T value) {
+	psilog_append(out, (unsigned long long)value);
+}
+
+inline void psilog_append(std::string &out, float value) {
+	psilog_append(out, (double)value);
+}
+
+// Render the format, replacing each placeholder with the next decoded argument,
+// the same placeholders as PSILOG_FMT() takes. {{ and }} are written as { and }.
+void psilog_render_format(const char *format, const char *payload,
+			  const PSILogDecodeFunc *decoders, size_t decoder_count, std::string &out);
+
+// Type codes of the encoded arguments, the decoder of a code appends the same text
+// as the decoder of the type it was encoded from
+// b bool, c characters, s i l signed and S I L unsigned 16, 32 and 64 bit integers,
+// f float, d double, D long double and z strings
+template <typename T>
+constexpr char psilog_arithmetic_code() {
+	return std::is_same<T, bool>::value ? 'b' :
+	       sizeof(T) == 1 && std::is_integral<T>::value ? 'c' :
+	       std::is_floating_point<T>::value ? (sizeof(T) == sizeof(float) ? 'f' : sizeof(T) == sizeof(double) ? 'd' : 'D') :
+	       std::is_signed<T>::value ? (sizeof(T) == 2 ? 's' : sizeof(T) == 4 ? 'i' : 'l') :
+	       (sizeof(T) == 2 ? 'S' : sizeof(T) == 4 ? 'I' : 'L');
+}
+
+// Decoder of the arguments with type code, nullptr for unknown codes
+PSILogDecodeFunc psilog_decoder_for_code(char code);
+
+// Amount of the leading arguments of the signature that can be decoded from a payload
+// of length bytes, stopping at an unknown type code or an argument running past the end
+size_t psilog_payload_arg_count(const char *signature, const char *payload, size_t length);
+
+// Binary encoding of deferred logging arguments
+// Arithmetic types are copied as raw bytes, strings as their length followed by the characters
+template <typename T, typename Enable = void>
+struct PSILogArgCodec {
+	static_assert(sizeof(T) == 0, "Type not supported by deferred logging, use arithmetic types, enums or strings");
+};
+
+template <typename T>
+struct PSILogArgCodec<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+	static constexpr char code = psilog_arithmetic_code<T>();
+
+	static size_t size(T) { return sizeof(T); }
+
+	static void encode(char *&dest, T value) {
+		memcpy(dest, &value, sizeof(T));
+		dest += sizeof(T);
+	}
+
+	static void decode(const char *&src, const PSILogFormatSegment &segment, std::string &out) {
+		T value;
+		memcpy(&value, src, sizeof(T));
+		src += sizeof(T);
+		psilog_format_value(out, segment, value);
+	}
+};
+
+template <typename T>
+struct PSILogArgCodec<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+	typedef typename std::underlying_type<T>::type Underlying;
+
+	static constexpr char code = PSILogArgCodec<Underlying>::code;
+
+	static size_t size(T) { return sizeof(Underlying); }
+
+	static void encode(char *&dest, T value) {
+		PSILogArgCodec<Underlying>::encode(dest, (Underlying)value);
+	}
+
+	static void decode(const char *&src, const PSILogFormatSegment &segment, std::string &out) {
+		PSILogArgCodec<Underlying>::decode(src, segment, out);
+	}
+};
+
+// Strings are stored as a 32 bit length and the characters
+struct PSILogStringCodec {
+	static size_t size(const char *value, size_t length) {
+		return sizeof(uint32_t) + length;
+	}
+
+	static void encode(char *&dest, const char *value, size_t length) {
+		uint32_t length32 = (uint32_t)length;
+		memcpy(dest, &length32, sizeof(length32));
+		memcpy(dest + sizeof(length32), value, length);
+		dest += sizeof(length32) + length;
+	}
+
+	static void decode(const char *&src, const PSILogFormatSegment &segment, std::string &out) {
+		uint32_t length;
+		memcpy(&length, src, sizeof(length));
+		out.append(src + sizeof(length), length);
+		src += sizeof(length) + length;
+	}
+};
+
+template <>
+struct PSILogArgCodec<const char *> {
+	static constexpr char code = 'z';
+
+	static size_t size(const char *value) {
+		return PSILogStringCodec::size(value, value != nullptr ? strlen(value) : 0);
+	}
+
+	static void encode(char *&dest, const char *value) {
+		PSILogStringCodec::encode(dest, value, value != nullptr ? strlen(value) : 0);
+	}
+
+	static void decode(const char *&src, const PSILogFormatSegment &segment, std::string &out) {
+		PSILogStringCodec::decode(src, segment, out);
+	}
+};
+
+template <>
+struct PSILogArgCodec<char *> : PSILogArgCodec<const char *> {};
+
+template <>
+struct PSILogArgCodec<std::string> {
+	static constexpr char code = 'z';
+
+	static size_t size(const std::string &value) {
+		return PSILogStringCodec::size(value.data(), value.size());
+	}
+
+	static void encode(char *&dest, const std::string &value) {
+		PSILogStringCodec::encode(dest, value.data(), value.size());
+	}
+
+	static void decode(const char *&src, const PSILogFormatSegment &segment, std::string &out) {
+		PSILogStringCodec::decode(src, segment, out);
+	}
+};
+
+// Renderer instantiated for each combination of deferred argument types
+// The writer thread only gets the function pointer, which knows how to decode the payload
+template <typename... Args>
+struct PSILogDeferredRenderer {
+	static void render(const char *format, const char *payload, std::string &out) {
+		static const PSILogDecodeFunc decoders[] = { &PSILogArgCodec<Args>::decode..., nullptr };
+		psilog_render_format(format, payload, decoders, sizeof...(Args), out);
+	}
+};
+
+// Type code signature of the arguments, for PSILogCallSite
+template <typename... Args>
+struct PSILogArgSignature {
+	static const char *get() {
+		static const char signature[] = { PSILogArgCodec<Args>::code..., '\0' };
+		return signature;
+	}
+};
+
+// Only used in decltype(), to get the signature type of the arguments of a call
+template <typename... Args>
+PSILogArgSignature<typename std::decay<Args>::type...> psilog_arg_signature_of(const Args &...);
+
+// Encode all of the arguments into a payload
+template <typename... Args>
+size_t psilog_payload_size(const Args &... args) {
+	size_t size = 0;
+	int expand[] = { 0, (size += PSILogArgCodec<typename std::decay<Args>::type>::size(args), 0)... };
+	(void)expand;
+
+	return size;
+}
+
+template <typename... Args>
+void psilog_encode_payload(char *dest, const Args &... args) {
+	int expand[] = { 0, (PSILogArgCodec<typename std::decay<Args>::type>::encode(dest, args), 0)... };
+	(void)expand;
+	(void)dest;
+}
+
+// Compile time format strings
+//
+// PSILOG_FMT("Phaser {} ready in {} ms") wraps the string literal in a type, so that
+// it can be parsed in constant expressions. Placeholders are
+//	{}	any supported argument, formatted like std::ostream << would
+//	{:d}	integer in decimal
+//	{:x}	integer in hexadecimal
+//	{:f}	floating point in fixed notation, {:.3f} with 3 decimals
+//	{:s}	string
+// {{ and }} are written as { and }.
+#define PSILOG_FMT(format) \
+	[] { \
+		struct PSILogFormatStringType : PSILogFormatString { \
+			static constexpr const char *data() { return format; } \
+		}; \
+		return PSILogFormatStringType(); \
+	}()
+
+// Base of the types PSILOG_FMT() creates
+struct PSILogFormatString {};
+
+// Placeholder specifiers
+enum PSILogFormatSpec {
+	PSILOG_SPEC_NONE,
+	PSILOG_SPEC_ANY,
+	PSILOG_SPEC_DEC,
+	PSILOG_SPEC_HEX,
+	PSILOG_SPEC_FIXED,
+	PSILOG_SPEC_STRING,
+	PSILOG_SPEC_INVALID
+};
+
+// Argument types, as far as the specifiers are concerned
+enum PSILogArgKind {
+	PSILOG_ARG_INTEGER,
+	PSILOG_ARG_FLOAT,
+	PSILOG_ARG_STRING,
+	PSILOG_ARG_OTHER
+};
+
+template <typename T>
+struct PSILogArgKindOf {
+	typedef typename std::decay<T>::type Type;
+
+	static constexpr int value =
+		(std::is_integral<Type>::value || std::is_enum<Type>::value) ? PSILOG_ARG_INTEGER :
+		std::is_floating_point<Type>::value ? PSILOG_ARG_FLOAT :
+		(std::is_same<Type, const char *>::value || std::is_same<Type, char *>::value ||
+		 std::is_same<Type, std::string>::value) ? PSILOG_ARG_STRING :
+		PSILOG_ARG_OTHER;
+};
+
+// A piece of text in the format string, optionally followed by a placeholder
+struct PSILogFormatSegment {
+	size_t offset = 0;
+	size_t length = 0;
+	int spec = PSILOG_SPEC_NONE;
+	int precision = 6;
+};
+
+// Format string parsed into segments
+template <size_t N>
+struct PSILogParsedFormat {
+	PSILogFormatSegment segments[N] {};
+	size_t segment_count = 0;
+	size_t arg_count = 0;
+	size_t text_length = 0;
+	bool valid = true;
+};
+
+// Upper bound for the amount of segments, each brace can end a segment
+constexpr size_t psilog_format_max_segments(const char *format) {
+	size_t count = 1;
+	for (size_t i=0; format[i] != '\0'; i++) {
+		if (format[i] == '{' || format[i] == '}') {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+// Parse the placeholder contents between the braces
+constexpr int psilog_parse_format_spec(const char *format, size_t begin, size_t end, int &precision) {
+	if (begin == end) {
+		return PSILOG_SPEC_ANY;
+	}
+
+	if (format[begin] != ':' || end - begin < 2) {
+		return PSILOG_SPEC_INVALID;
+	}
+
+	// {:.Nf}
+	if (format[begin + 1] == '.' && format[end - 1] == 'f' && end - begin > 3) {
+		precision = 0;
+		for (size_t i=begin + 2; i<end - 1; i++) {
+			if (format[i] < '0' || format[i] > '9') {
+				return PSILOG_SPEC_INVALID;
+			}
+			precision = precision * 10 + (format[i] - '0');
+		}
+
+		return PSILOG_SPEC_FIXED;
+	}
+
+	if (end - begin != 2) {
+		return PSILOG_SPEC_INVALID;
+	}
+
+	switch (format[begin + 1]) {
+		case 'd': return PSILOG_SPEC_DEC;
+		case 'x': return PSILOG_SPEC_HEX;
+		case 'f': return PSILOG_SPEC_FIXED;
+		case 's': return PSILOG_SPEC_STRING;
+		default: return PSILOG_SPEC_INVALID;
+	}
+}
+
+template <size_t N>
+constexpr void psilog_add_format_segment(PSILogParsedFormat<N> &parsed, size_t offset, size_t length,
+					 int spec, int precision) {
+	PSILogFormatSegment &segment = parsed.segments[parsed.segment_count++];
+	segment.offset = offset;
+	segment.length = length;
+	segment.spec = spec;
+	segment.precision = precision;
+	parsed.text_length += length;
+
+	if (spec != PSILOG_SPEC_NONE) {
+		parsed.arg_count++;
+	}
+}
+
+template <size_t N>
+constexpr PSILogParsedFormat<N> psilog_parse_format(const char *format) {
+	PSILogParsedFormat<N> parsed {};
+	size_t start = 0;
+	size_t i = 0;
+
+	while (format[i] != '\0') {
+		char c = format[i];
+
+		if ((c == '{' && format[i + 1] == '{') || (c == '}' && format[i + 1] == '}')) {
+			// Escaped brace, the segment ends with the first one and the second is skipped
+			psilog_add_format_segment(parsed, start, i + 1 - start, PSILOG_SPEC_NONE, 0);
+			i += 2;
+			start = i;
+		} else if (c == '{') {
+			size_t end = i + 1;
+			while (format[end] != '\0' && format[end] != '}') {
+				end++;
+			}
+
+			int precision = 6;
+			int spec = format[end] == '}' ? psilog_parse_format_spec(format, i + 1, end, precision) : PSILOG_SPEC_INVALID;
+			if (spec == PSILOG_SPEC_INVALID) {
+				parsed.valid = false;
+				return parsed;
+			}
+
+			psilog_add_format_segment(parsed, start, i - start, spec, precision);
+			i = end + 1;
+			start = i;
+		} else if (c == '}') {
+			// Unmatched closing brace
+			parsed.valid = false;
+			return parsed;
+		} else {
+			i++;
+		}
+	}
+
+	if (i > start) {
+		psilog_add_format_segment(parsed, start, i - start, PSILOG_SPEC_NONE, 0);
+	}
+
+	return parsed;
+}
+
+// Check that the argument kinds are accepted by the placeholders, in order
+constexpr bool psilog_format_spec_accepts(int spec, int kind) {
+	return spec == PSILOG_SPEC_ANY ||
+	       ((spec == PSILOG_SPEC_DEC || spec == PSILOG_SPEC_HEX) && kind == PSILOG_ARG_INTEGER) ||
+	       (spec == PSILOG_SPEC_FIXED && kind == PSILOG_ARG_FLOAT) ||
+	       (spec == PSILOG_SPEC_STRING && kind == PSILOG_ARG_STRING);
+}
+
+template <size_t N, size_t M>
+constexpr bool psilog_format_args_match(const PSILogParsedFormat<N> &parsed, const int (&kinds)[M]) {
+	size_t arg = 0;
+	for (size_t i=0; i<parsed.segment_count; i++) {
+		const PSILogFormatSegment &segment = parsed.segments[i];
+		if (segment.spec != PSILOG_SPEC_NONE) {
+			if (arg >= M || psilog_format_spec_accepts(segment.spec, kinds[arg]) == false) {
+				return false;
+			}
+			arg++;
+		}
+	}
+
+	return true;
+}
+
+// The parsed segments of a PSILOG_FMT() format string, computed at compile time
+template <typename Format>
+struct PSILogCompiledFormat {
+	static constexpr size_t max_segments = psilog_format_max_segments(Format::data());
+	static constexpr PSILogParsedFormat<max_segments> parsed = psilog_parse_format<max_segments>(Format::data());
+};
+
+template <typename Format>
+constexpr PSILogParsedFormat<PSILogCompiledFormat<Format>::max_segments> PSILogCompiledFormat<Format>::parsed;
+
+// Room reserved in the output for each argument, on top of the static text
+static const size_t PSILOG_FORMAT_ARG_RESERVE = 16;
+
+void psilog_append(std::string &out, const char *value);
+void psilog_append(std::string &out, const std::string &value);
+void psilog_append_hex(std::string &out, unsigned long long value);
+void psilog_append_fixed(std::string &out, double value, int precision);
+
+// Format one argument according to its placeholder, dispatched on the argument kind
+template <typename T>
+void psilog_format_arg(std::string &out, const PSILogFormatSegment &segment, const T &value,
+		       std::integral_constant<int, PSILOG_ARG_INTEGER>) {
+	if (segment.spec == PSILOG_SPEC_HEX) {
+		unsigned long long bits = (unsigned long long)value;
+		if (sizeof(T) < sizeof(bits)) {
+			bits &= (1ULL << (8 * sizeof(T))) - 1;
+		}
+		psilog_append_hex(out, bits);
+	} else if (segment.spec == PSILOG_SPEC_DEC || std::is_enum<T>::value) {
+		psilog_append(out, (long long)value);
+	} else {
+		psilog_append(out, value);
+	}
+}
+
+template <typename T>
+void psilog_format_arg(std::string &out, const PSILogFormatSegment &segment, const T &value,
+		       std::integral_constant<int, PSILOG_ARG_FLOAT>) {
+	if (segment.spec == PSILOG_SPEC_FIXED) {
+		psilog_append_fixed(out, (double)value, segment.precision);
+	} else {
+		psilog_append(out, value);
+	}
+}
+
+template <typename T>
+void psilog_format_arg(std::string &out, const PSILogFormatSegment &segment, const T &value,
+		       std::integral_constant<int, PSILOG_ARG_STRING>) {
+	psilog_append(out, value);
+}
+
+// User types go through their std::ostream << operator
+template <typename T>
+void psilog_format_arg(std::string &out, const PSILogFormatSegment &segment, const T &value,
+		       std::integral_constant<int, PSILOG_ARG_OTHER>) {
+	std::ostringstream ss;
+	ss << value;
+	out += ss.str();
+}
+
+// Write the text segments in order, formatting an argument after each placeholder
+template <size_t N>
+void psilog_format_segments(std::string &out, const char *format, const PSILogParsedFormat<N> &parsed,
+			    size_t segment) {
+	for (; segment < parsed.segment_count; segment++) {
+		out.append(format + parsed.segments[segment].offset, parsed.segments[segment].length);
+	}
+}
+
+template <size_t N, typename T, typename... Rest>
+void psilog_format_segments(std::string &out, const char *format, const PSILogParsedFormat<N> &parsed,
+			    size_t segment, const T &value, const Rest &... rest) {
+	while (true) {
+		const PSILogFormatSegment &current = parsed.segments[segment++];
+		out.append(format + current.offset, current.length);
+
+		if (current.spec != PSILOG_SPEC_NONE) {
+			psilog_format_arg(out, current, value,
+					  std::integral_constant<int, PSILogArgKindOf<T>::value>());
+			break;
+		}
+	}
+
+	psilog_format_segments(out, format, parsed, segment, rest...);
+}
+
+template <typename T>
+void psilog_format_value(std::string &out, const PSILogFormatSegment &segment, const T &value) {
+	psilog_format_arg(out, segment, value, std::integral_constant<int, PSILogArgKindOf<T>::value>());
+}
+
+// Check of a PSILOG_FMT() format string against the argument types, done when the type is used
+// Invalid format strings, wrong amount of arguments and arguments not matching
+// their placeholders fail the build
+template <typename Format, typename... Args>
+struct PSILogFormatCheck {
+	static_assert(std::is_base_of<PSILogFormatString, Format>::value,
+		      "Format strings must be given with PSILOG_FMT(\"...\")");
+
+	typedef PSILogCompiledFormat<Format> Compiled;
+	static constexpr int kinds[] = { PSILogArgKindOf<Args>::value..., PSILOG_ARG_OTHER };
+
+	static_assert(Compiled::parsed.valid, "Invalid format string");
+	static_assert(Compiled::parsed.arg_count == sizeof...(Args),
+		      "Amount of arguments does not match the format string");
+	static_assert(psilog_format_args_match(Compiled::parsed, kinds),
+		      "Argument type does not match its placeholder in the format string");
+
+	typedef char type;
+};
+
+template <typename Format, typename... Args>
+constexpr int PSILogFormatCheck<Format, Args...>::kinds[];
+
+template <typename Format, typename... Args>
+void psilog_check_format() {
+	(void)sizeof(typename PSILogFormatCheck<Format, Args...>::type);
+}
+
+// Only used in sizeof(), to check a format string without evaluating the arguments
+template <typename Format, typename... Args>
+typename PSILogFormatCheck<Format, typename std::decay<Args>::type...>::type
+psilog_check_format_of(Format, const Args &...);
+
+// Format the arguments into out using a PSILOG_FMT() format string
+template <typename Format, typename... Args>
+void psilog_format(std::string &out, Format, const Args &... args) {
+	psilog_check_format<Format, Args...>();
+
+	typedef PSILogCompiledFormat<Format> Compiled;
+	out.reserve(out.size() + Compiled::parsed.text_length + sizeof...(Args) * PSILOG_FORMAT_ARG_RESERVE);
+	psilog_format_segments(out, Format::data(), Compiled::parsed, 0, args...);
+}
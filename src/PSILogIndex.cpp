@@ -0,0 +1,157 @@
+// PSILogIndex.cpp
+//
+// Sparse sidecar index of log files, mapping entry timestamps and sequence
+// numbers to byte offsets in the log file
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <unistd.h>
+
+#include "PSILogIndex.h"
+
+template <typename T>
+static void put(std::string &out, T value) {
+	out.append((const char *)&value, sizeof(T));
+}
+
+PSILogIndexWriter::PSILogIndexWriter(const std::string &index_path, uint32_t interval) :
+	_interval(interval)
+{
+	// Continue from the last complete point of an existing index
+	PSILogIndexReader reader;
+	if (reader.read(index_path) == true) {
+		if (reader.get_points().empty() == false) {
+			_last = reader.get_points().back();
+			_has_points = true;
+		}
+
+		std::ifstream in(index_path.c_str(), std::ios::binary | std::ios::ate);
+		size_t size = (size_t)in.tellg();
+		size_t complete = PSILOG_INDEX_HEADER_SIZE + reader.get_points().size() * sizeof(int64_t) * 3;
+		in.close();
+
+		// Drop a point cut short by a crash
+		if (size > complete && truncate(index_path.c_str(), complete) != 0) {
+			// The partial point stays, and the points after it are misaligned
+			_fs.setstate(std::ios::failbit);
+			return;
+		}
+
+		_fs.open(index_path.c_str(), std::fstream::out | std::fstream::app | std::fstream::binary);
+		return;
+	}
+
+	_fs.open(index_path.c_str(), std::fstream::out | std::fstream::trunc | std::fstream::binary);
+
+	std::string header(PSILOG_INDEX_MAGIC, sizeof(PSILOG_INDEX_MAGIC));
+	put(header, PSILOG_INDEX_VERSION);
+	put(header, PSILOG_INDEX_HEADER_SIZE);
+	put(header, _interval);
+	_fs.write(header.data(), header.size());
+	_fs.flush();
+}
+
+PSILogIndexWriter::~PSILogIndexWriter() {
+	flush();
+}
+
+void PSILogIndexWriter::add_entry(int64_t timestamp, uint64_t sequence, uint64_t offset) {
+	if (_has_points == true && offset < _last.offset + _interval) {
+		return;
+	}
+
+	_last.timestamp = timestamp;
+	_last.sequence = sequence;
+	_last.offset = offset;
+	_has_points = true;
+
+	put(_pending, timestamp);
+	put(_pending, sequence);
+	put(_pending, offset);
+}
+
+void PSILogIndexWriter::flush() {
+	if (_pending.empty() == false) {
+		_fs.write(_pending.data(), _pending.size());
+		_pending.clear();
+	}
+
+	_fs.flush();
+}
+
+bool PSILogIndexWriter::get_last_point(PSILogIndexPoint &point) const {
+	point = _last;
+	return _has_points;
+}
+
+bool PSILogIndexReader::read(const std::string &index_path) {
+	std::ifstream in(index_path.c_str(), std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+	_points.clear();
+	if (data.size() < PSILOG_INDEX_HEADER_SIZE ||
+	    memcmp(data.data(), PSILOG_INDEX_MAGIC, sizeof(PSILOG_INDEX_MAGIC)) != 0) {
+		return false;
+	}
+
+	uint16_t version, header_size;
+	memcpy(&version, data.data() + 8, sizeof(version));
+	memcpy(&header_size, data.data() + 10, sizeof(header_size));
+	memcpy(&_interval, data.data() + 12, sizeof(_interval));
+	if (version > PSILOG_INDEX_VERSION || header_size < PSILOG_INDEX_HEADER_SIZE || header_size > data.size()) {
+		return false;
+	}
+
+	const size_t point_size = sizeof(int64_t) * 3;
+	for (size_t p = header_size; p + point_size <= data.size(); p += point_size) {
+		PSILogIndexPoint point;
+		memcpy(&point.timestamp, data.data() + p, sizeof(point.timestamp));
+		memcpy(&point.sequence, data.data() + p + 8, sizeof(point.sequence));
+		memcpy(&point.offset, data.data() + p + 16, sizeof(point.offset));
+		_points.push_back(point);
+	}
+
+	return true;
+}
+
+// Entries from several threads can be slightly out of order in time, so the
+// search starts from the last point before the time, not at it
+PSILogIndexPoint PSILogIndexReader::find_time(int64_t timestamp) const {
+	auto it = std::lower_bound(_points.begin(), _points.end(), timestamp,
+		[] (const PSILogIndexPoint &point, int64_t time) { return point.timestamp < time; });
+
+	if (it == _points.begin()) {
+		return PSILogIndexPoint();
+	}
+
+	return *(it - 1);
+}
+
+// The first point is at the first entry of the file, the entries before it are in
+// the rotated files
+bool PSILogIndexReader::find_sequence(uint64_t sequence, PSILogIndexPoint &point) const {
+	auto it = std::upper_bound(_points.begin(), _points.end(), sequence,
+		[] (uint64_t seq, const PSILogIndexPoint &point) { return seq < point.sequence; });
+
+	if (it == _points.begin()) {
+		return false;
+	}
+
+	point = *(it - 1);
+	return true;
+}
+
+uint64_t PSILogIndexReader::find_time_end(int64_t timestamp) const {
+	auto it = std::upper_bound(_points.begin(), _points.end(), timestamp,
+		[] (int64_t time, const PSILogIndexPoint &point) { return time < point.timestamp; });
+
+	// The point after the first one past the time, to allow for entries slightly out of order
+	if (it == _points.end() || it + 1 == _points.end()) {
+		return UINT64_MAX;
+	}
+
+	return (it + 1)->offset;
+}
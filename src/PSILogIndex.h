@@ -0,0 +1,90 @@
+// PSILogIndex.h
+//
+// Sparse sidecar index of log files, mapping entry timestamps and sequence
+// numbers to byte offsets in the log file
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdint.h>
+
+// Index file format, numbers in the native byte order
+//
+// Header: char[8] magic "PSILOGI\0", u16 format version, u16 header size, u32 index interval in bytes
+// Points: i64 timestamp in ns since the epoch, u64 sequence number, u64 byte offset
+//
+// A point is added for the first entry starting at least the index interval after the
+// previous point, so finding an entry by time or sequence number needs reading at most
+// about one interval of the log. Points are appended as the log is written, a point
+// cut short by a crash is ignored.
+//
+// An indexed log has one entry on each line, line breaks inside an entry are written
+// as "\n", so entries are found from a point by counting the line breaks.
+static const char PSILOG_INDEX_MAGIC[8] = { 'P', 'S', 'I', 'L', 'O', 'G', 'I', '\0' };
+static const uint16_t PSILOG_INDEX_VERSION = 1;
+static const uint16_t PSILOG_INDEX_HEADER_SIZE = 16;
+
+struct PSILogIndexPoint {
+	int64_t timestamp = 0;
+	uint64_t sequence = 0;
+	uint64_t offset = 0;
+};
+
+// Appends points to the index file of a log file
+class PSILogIndexWriter {
+public:
+	// Open the index for appending, writing the header to a new index
+	PSILogIndexWriter(const std::string &index_path, uint32_t interval);
+	~PSILogIndexWriter();
+
+	// Add a point if the entry starting at offset is far enough from the previous point
+	void add_entry(int64_t timestamp, uint64_t sequence, uint64_t offset);
+
+	// Write the added points to the file
+	void flush();
+
+	// The last point of the index, false if the index has no points
+	bool get_last_point(PSILogIndexPoint &point) const;
+
+	bool good() const { return _fs.good(); }
+
+private:
+	std::fstream _fs;
+	uint32_t _interval;
+	bool _has_points = false;
+	PSILogIndexPoint _last;
+	std::string _pending;
+};
+
+// Reads the index of a log file, and finds the byte ranges of time and sequence ranges
+class PSILogIndexReader {
+public:
+	PSILogIndexReader() = default;
+	~PSILogIndexReader() = default;
+
+	// Read the index file, false if it's not an index
+	bool read(const std::string &index_path);
+
+	const std::vector<PSILogIndexPoint> &get_points() const { return _points; }
+	uint32_t get_interval() const { return _interval; }
+
+	// Offset to start reading from to find the entries logged at or after timestamp,
+	// and sequence number of the entry there
+	PSILogIndexPoint find_time(int64_t timestamp) const;
+
+	// Point to start reading from to find the entry with the sequence number, false
+	// if the entry is before the first point, so not in this log file
+	bool find_sequence(uint64_t sequence, PSILogIndexPoint &point) const;
+
+	// Offset where the entries logged after timestamp have certainly started,
+	// UINT64_MAX if that's after the last point
+	uint64_t find_time_end(int64_t timestamp) const;
+
+private:
+	uint32_t _interval = 0;
+	std::vector<PSILogIndexPoint> _points;
+};
@@ -0,0 +1,249 @@
+// PSILogRingOutput.cpp
+//
+// Flight recorder log output keeping the latest entries in a memory mapped ring
+// file, and the reader recovering the entries from the file after a crash
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#include <cstring>
+#include <cstddef>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "PSILogRingOutput.h"
+#include "PSILogBinaryOutput.h"
+
+struct PSILogRingFileHeader {
+	char magic[8];
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t flags;
+	uint64_t capacity;
+	uint64_t position;
+};
+
+struct PSILogRingRecordHeader {
+	uint32_t magic;
+	uint32_t length;
+	uint64_t position;
+	int64_t timestamp;
+	uint8_t level;
+	uint8_t reserved[3];
+	uint32_t crc;
+};
+
+static_assert(sizeof(PSILogRingRecordHeader) == PSILOG_RING_RECORD_HEADER_SIZE, "Ring record header size");
+
+static size_t record_size(size_t length) {
+	return (PSILOG_RING_RECORD_HEADER_SIZE + length + 7) & ~(size_t)7;
+}
+
+static uint32_t record_crc(PSILogRingRecordHeader header, const char *text) {
+	header.crc = 0;
+	uint32_t crc = psilog_crc32((const char *)&header, sizeof(header));
+	return psilog_crc32(text, header.length, crc);
+}
+
+PSILogRingOutput::PSILogRingOutput(const char *output_path, size_t capacity) {
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	_capacity = capacity == 0 ? page_size : (capacity + page_size - 1) / page_size * page_size;
+
+	_fd = open(output_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (_fd < 0) {
+		return;
+	}
+
+	// Continue an existing ring of the same capacity, start over otherwise
+	PSILogRingFileHeader existing;
+	bool resume = pread(_fd, &existing, sizeof(existing), 0) == sizeof(existing) &&
+		memcmp(existing.magic, PSILOG_RING_MAGIC, sizeof(PSILOG_RING_MAGIC)) == 0 &&
+		existing.version == PSILOG_RING_VERSION &&
+		existing.header_size == PSILOG_RING_HEADER_SIZE &&
+		existing.capacity == _capacity;
+
+	_mapping_size = PSILOG_RING_HEADER_SIZE + _capacity;
+	if ((resume == false && ftruncate(_fd, 0) != 0) || ftruncate(_fd, _mapping_size) != 0) {
+		close(_fd);
+		_fd = -1;
+		return;
+	}
+
+	void *data = mmap(nullptr, _mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	if (data == MAP_FAILED) {
+		close(_fd);
+		_fd = -1;
+		return;
+	}
+
+	_header = (char *)data;
+	_ring = _header + PSILOG_RING_HEADER_SIZE;
+	_position = (uint64_t *)(_header + offsetof(PSILogRingFileHeader, position));
+
+	if (resume == false) {
+		PSILogRingFileHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, PSILOG_RING_MAGIC, sizeof(PSILOG_RING_MAGIC));
+		header.version = PSILOG_RING_VERSION;
+		header.header_size = PSILOG_RING_HEADER_SIZE;
+		header.capacity = _capacity;
+		memcpy(_header, &header, sizeof(header));
+	}
+}
+
+PSILogRingOutput::~PSILogRingOutput() {
+	if (_header != nullptr) {
+		munmap(_header, _mapping_size);
+	}
+
+	if (_fd >= 0) {
+		close(_fd);
+	}
+}
+
+bool PSILogRingOutput::write_log_entry(const std::string &log_entry, int log_level) {
+	int64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+
+	return write_record(log_entry.data(), log_entry.size(), log_level, timestamp);
+}
+
+bool PSILogRingOutput::write_log_record(const PSILogRecord &record) {
+	const std::string &log_entry = get_text(record);
+	int64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		record.timestamp.time_since_epoch()).count();
+
+	return write_record(log_entry.data(), log_entry.size(), record.log_level, timestamp);
+}
+
+void PSILogRingOutput::write_emergency(const char *entry, size_t length, int log_level) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	write_record(entry, length, log_level, (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec);
+}
+
+bool PSILogRingOutput::write_record(const char *entry, size_t length, int log_level, int64_t timestamp) {
+	if (_header == nullptr) {
+		return false;
+	}
+
+	size_t size = record_size(length);
+	if (size > _capacity) {
+		return false;
+	}
+
+	// The position lives in the mapping, so it's in the file along with the records
+	uint64_t position = __atomic_fetch_add(_position, (uint64_t)size, __ATOMIC_RELAXED);
+
+	PSILogRingRecordHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = PSILOG_RING_RECORD_MAGIC;
+	header.length = (uint32_t)length;
+	header.position = position;
+	header.timestamp = timestamp;
+	header.level = (uint8_t)log_level;
+	header.crc = record_crc(header, entry);
+
+	copy_to_ring(position + sizeof(header), entry, length);
+	copy_to_ring(position, &header, sizeof(header));
+
+	return true;
+}
+
+void PSILogRingOutput::copy_to_ring(uint64_t position, const void *data, size_t length) {
+	size_t offset = (size_t)(position % _capacity);
+	size_t first = std::min(length, _capacity - offset);
+
+	memcpy(_ring + offset, data, first);
+	memcpy(_ring, (const char *)data + first, length - first);
+}
+
+void PSILogRingOutput::flush() {
+	if (_header != nullptr) {
+		msync(_header, _mapping_size, MS_ASYNC);
+	}
+}
+
+bool PSILogRingReader::read(const std::string &path) {
+	_entries.clear();
+	_corrupt_regions = 0;
+	_error.clear();
+
+	std::ifstream in(path.c_str(), std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+	PSILogRingFileHeader header;
+	if (data.size() < sizeof(header)) {
+		_error = "not a ring file";
+		return false;
+	}
+
+	memcpy(&header, data.data(), sizeof(header));
+	if (memcmp(header.magic, PSILOG_RING_MAGIC, sizeof(PSILOG_RING_MAGIC)) != 0) {
+		_error = "not a ring file";
+		return false;
+	}
+
+	if (header.version > PSILOG_RING_VERSION || header.header_size < sizeof(header) || header.capacity == 0 ||
+	    data.size() < header.header_size + header.capacity) {
+		_error = "unsupported or truncated ring file";
+		return false;
+	}
+
+	const char *ring = data.data() + header.header_size;
+	uint64_t capacity = header.capacity;
+	auto copy_from_ring = [ring, capacity] (uint64_t position, void *out, size_t length) {
+		size_t offset = (size_t)(position % capacity);
+		size_t first = std::min(length, (size_t)capacity - offset);
+
+		memcpy(out, ring + offset, first);
+		memcpy((char *)out + first, ring, length - first);
+	};
+
+	// The ring holds the latest capacity bytes, the first record there has usually
+	// been partly overwritten, which doesn't count as corruption
+	uint64_t end = header.position;
+	uint64_t position = end > capacity ? (end - capacity + 7) & ~(uint64_t)7 : 0;
+	bool at_start = end > capacity;
+	bool corrupt = false;
+
+	while (position + PSILOG_RING_RECORD_HEADER_SIZE <= end) {
+		PSILogRingRecordHeader record;
+		copy_from_ring(position, &record, sizeof(record));
+
+		bool valid = record.magic == PSILOG_RING_RECORD_MAGIC && record.position == position &&
+			record_size(record.length) <= capacity && position + record_size(record.length) <= end;
+
+		Entry entry;
+		if (valid == true) {
+			entry.text.resize(record.length);
+			copy_from_ring(position + sizeof(record), &entry.text[0], record.length);
+			valid = record_crc(record, entry.text.data()) == record.crc;
+		}
+
+		// Look for the next intact record
+		if (valid == false) {
+			if (at_start == false && corrupt == false) {
+				_corrupt_regions++;
+			}
+			corrupt = true;
+			position += 8;
+			continue;
+		}
+
+		entry.position = position;
+		entry.timestamp = record.timestamp;
+		entry.log_level = record.level;
+		_entries.push_back(move(entry));
+
+		position += record_size(record.length);
+		at_start = false;
+		corrupt = false;
+	}
+
+	return true;
+}
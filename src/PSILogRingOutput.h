@@ -0,0 +1,110 @@
+// PSILogRingOutput.h
+//
+// Flight recorder log output keeping the latest entries in a memory mapped ring
+// file, and the reader recovering the entries from the file after a crash
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "PSILog.h"
+
+// Ring file format, all numbers in the native byte order
+//
+// The file starts with a header page:
+//   char[8] magic "PSILOGR\0", u16 format version, u16 header size, u32 flags,
+//   u64 ring capacity in bytes, u64 write position
+// followed by the ring of capacity bytes.
+//
+// The write position counts all the bytes ever written to the ring, the byte at position
+// p is stored at p % capacity in the ring. Records start at positions aligned to 8 bytes,
+// and wrap around the end of the ring:
+//   u32 record magic, u32 entry length, u64 position of the record, i64 timestamp in ns
+//   since the epoch, u8 level, u8[3] reserved, u32 CRC-32 of the record with the CRC as 0,
+//   entry text
+//
+// A record cut short by a crash, or partly overwritten by a later one, fails its CRC.
+static const char PSILOG_RING_MAGIC[8] = { 'P', 'S', 'I', 'L', 'O', 'G', 'R', '\0' };
+static const uint16_t PSILOG_RING_VERSION = 1;
+static const uint16_t PSILOG_RING_HEADER_SIZE = 4096;
+static const uint32_t PSILOG_RING_RECORD_MAGIC = 0x31434552;
+static const size_t PSILOG_RING_RECORD_HEADER_SIZE = 32;
+
+// Writers reserve room for their record by atomically moving the write position
+// in the mapped header forward, and copy the record into the mapping. Writing takes no
+// locks and makes no system calls, and as the pages belong to the page cache, the
+// records are in the file even if the process is killed right after writing them.
+// Only the latest capacity bytes of records are kept.
+//
+// An existing ring file of the same capacity is continued, so the entries of the
+// previous run remain until they are overwritten.
+class PSILogRingOutput : public PSILogOutput {
+public:
+	static const size_t DEFAULT_CAPACITY = 8 * 1024 * 1024;
+
+	// The capacity is rounded up to whole pages
+	PSILogRingOutput(const char *output_path, size_t capacity = DEFAULT_CAPACITY);
+	~PSILogRingOutput();
+
+	// Entries with the current time, records longer than the capacity are not written
+	bool write_log_entry(const std::string &log_entry, int log_level) override;
+	bool write_log_record(const PSILogRecord &record) override;
+
+	// Writing is async-signal-safe as it is, the ring is written from the crash handler too
+	void write_emergency(const char *entry, size_t length, int log_level) override;
+
+	// Schedule writing the mapped pages to the disk, needed only to survive
+	// the whole system going down
+	void flush() override;
+
+	size_t get_capacity() const { return _capacity; }
+
+	// False if the ring file couldn't be created
+	bool good() const { return _header != nullptr; }
+
+private:
+	bool write_record(const char *entry, size_t length, int log_level, int64_t timestamp);
+
+	// Copy the bytes to the ring at position, wrapping around its end
+	void copy_to_ring(uint64_t position, const void *data, size_t length);
+
+	int _fd = -1;
+	size_t _capacity;
+	size_t _mapping_size = 0;
+	char *_header = nullptr;
+	char *_ring = nullptr;
+	uint64_t *_position = nullptr;
+};
+
+// Recovers the entries of a ring file in the order they were written
+class PSILogRingReader {
+public:
+	struct Entry {
+		uint64_t position = 0;
+		int64_t timestamp = 0;
+		int log_level = 0;
+		std::string text;
+	};
+
+	PSILogRingReader() = default;
+	~PSILogRingReader() = default;
+
+	// Read the ring file, false if it's not a ring file
+	bool read(const std::string &path);
+
+	const std::vector<Entry> &get_entries() const { return _entries; }
+
+	// Stretches of the ring with no intact records, from crashed or overwritten writes
+	size_t get_corrupt_regions() const { return _corrupt_regions; }
+
+	const std::string &get_error() const { return _error; }
+
+private:
+	std::vector<Entry> _entries;
+	size_t _corrupt_regions = 0;
+	std::string _error;
+};
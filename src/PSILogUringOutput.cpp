@@ -0,0 +1,424 @@
+// PSILogUringOutput.cpp
+//
+// Log output submitting the file writes through io_uring, using the raw system calls
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "PSILogUringOutput.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int ring_fd, unsigned opcode, const void *arg, unsigned nr_args) {
+	return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+PSILogUringOutput::PSILogUringOutput(const char *output_path, size_t buffer_size, unsigned buffer_count) :
+	_buffer_size(std::max(buffer_size, (size_t)1)),
+	_buffers(std::max(buffer_count, 2u))
+{
+	_flush_policy.set_flush_bytes(_buffer_size);
+
+	// The writes go to explicit offsets, so they can complete in any order
+	_fd = open(output_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (_fd < 0) {
+		_failed = true;
+		return;
+	}
+
+	struct stat st;
+	if (fstat(_fd, &st) == 0) {
+		_offset = st.st_size;
+	}
+
+	for (auto &buffer : _buffers) {
+		buffer.data.reset(new char[_buffer_size]);
+	}
+	_current = 0;
+
+	if (setup_ring() == false) {
+		teardown_ring();
+	}
+}
+
+PSILogUringOutput::~PSILogUringOutput() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	drain();
+	teardown_ring();
+
+	if (_fd >= 0) {
+		close(_fd);
+	}
+}
+
+bool PSILogUringOutput::setup_ring() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	_ring_fd = io_uring_setup((unsigned)_buffers.size(), &params);
+	if (_ring_fd < 0) {
+		return false;
+	}
+
+	// Map the submission and completion rings, with newer kernels they share a mapping
+	_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap == true) {
+		_sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+	}
+
+	_sq_ring = mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			_ring_fd, IORING_OFF_SQ_RING);
+	if (_sq_ring == MAP_FAILED) {
+		_sq_ring = nullptr;
+		return false;
+	}
+
+	if (single_mmap == true) {
+		_cq_ring = _sq_ring;
+	} else {
+		_cq_ring = mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				_ring_fd, IORING_OFF_CQ_RING);
+		if (_cq_ring == MAP_FAILED) {
+			_cq_ring = nullptr;
+			return false;
+		}
+	}
+
+	_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  _ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		return false;
+	}
+	_sqes = (struct io_uring_sqe *)sqes;
+
+	char *sq = (char *)_sq_ring;
+	_sq_head = (unsigned *)(sq + params.sq_off.head);
+	_sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	_sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	_sq_array = (unsigned *)(sq + params.sq_off.array);
+
+	char *cq = (char *)_cq_ring;
+	_cq_head = (unsigned *)(cq + params.cq_off.head);
+	_cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	_cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	_cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	// Register the buffers, so the kernel doesn't need to map them for every write
+	std::vector<struct iovec> iovs(_buffers.size());
+	for (size_t i = 0; i < _buffers.size(); i++) {
+		iovs[i].iov_base = _buffers[i].data.get();
+		iovs[i].iov_len = _buffer_size;
+	}
+
+	return io_uring_register(_ring_fd, IORING_REGISTER_BUFFERS, iovs.data(), (unsigned)iovs.size()) == 0;
+}
+
+void PSILogUringOutput::teardown_ring() {
+	if (_sqes != nullptr) {
+		munmap(_sqes, _sqes_size);
+		_sqes = nullptr;
+	}
+
+	if (_cq_ring != nullptr && _cq_ring != _sq_ring) {
+		munmap(_cq_ring, _cq_ring_size);
+	}
+	_cq_ring = nullptr;
+
+	if (_sq_ring != nullptr) {
+		munmap(_sq_ring, _sq_ring_size);
+		_sq_ring = nullptr;
+	}
+
+	if (_ring_fd >= 0) {
+		close(_ring_fd);
+		_ring_fd = -1;
+	}
+}
+
+// Copy the entry into the current buffer, submitting the buffers that fill up
+bool PSILogUringOutput::write_log_entry(const std::string &log_entry, int log_level) {
+	std::lock_guard<std::mutex> guard(_mutex);
+
+	if (_failed == true) {
+		return false;
+	}
+
+	const char *p = log_entry.data();
+	size_t left = log_entry.size();
+
+	while (left > 0) {
+		Buffer &buffer = _buffers[_current];
+		size_t length = std::min(left, _buffer_size - buffer.length);
+		memcpy(buffer.data.get() + buffer.length, p, length);
+		buffer.length += length;
+		p += length;
+		left -= length;
+
+		if (buffer.length == _buffer_size && submit_current() == false) {
+			return false;
+		}
+	}
+
+	if (_buffers[_current].length > 0 &&
+	    _flush_policy.should_flush(_buffers[_current].length, log_level) == true) {
+		submit_current();
+	}
+
+	return _failed == false;
+}
+
+void PSILogUringOutput::flush() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	drain();
+}
+
+// Rewriting the data of a write in flight at its offset is harmless, whichever
+// finishes last writes the same bytes
+void PSILogUringOutput::flush_emergency() {
+	for (size_t i = 0; i < _buffers.size(); i++) {
+		Buffer &buffer = _buffers[i];
+		if (buffer.in_flight == true) {
+			pwrite_fully(buffer.data.get() + buffer.written, buffer.length - buffer.written,
+				     buffer.offset + buffer.written);
+		}
+	}
+
+	if (_current >= 0 && _buffers[_current].length > 0) {
+		Buffer &buffer = _buffers[_current];
+		pwrite_fully(buffer.data.get(), buffer.length, _offset);
+		_offset += buffer.length;
+		buffer.length = 0;
+	}
+}
+
+void PSILogUringOutput::write_emergency(const char *entry, size_t length, int log_level) {
+	if (_fd >= 0 && pwrite_fully(entry, length, _offset) == true) {
+		_offset += length;
+	}
+}
+
+bool PSILogUringOutput::pwrite_fully(const char *data, size_t length, uint64_t offset) {
+	while (length > 0) {
+		ssize_t written = pwrite(_fd, data, length, offset);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (written <= 0) {
+			return false;
+		}
+		data += written;
+		length -= written;
+		offset += written;
+	}
+
+	return true;
+}
+
+// Submit the partially filled buffer after the flush interval, and the
+// writes queued so far, and recycle the completed buffers
+void PSILogUringOutput::tick() {
+	std::lock_guard<std::mutex> guard(_mutex);
+
+	if (_failed == true) {
+		return;
+	}
+
+	if (_buffers[_current].length > 0 && _flush_policy.interval_elapsed() == true) {
+		submit_current();
+	}
+
+	if (_ring_fd >= 0) {
+		enter(0);
+		reap();
+	}
+}
+
+bool PSILogUringOutput::submit_current() {
+	Buffer &buffer = _buffers[_current];
+	buffer.offset = _offset;
+	buffer.written = 0;
+	_offset += buffer.length;
+	_flush_policy.flushed();
+
+	if (_ring_fd >= 0) {
+		buffer.in_flight = true;
+		_in_flight++;
+		queue_write((unsigned)_current);
+
+		// Hand the write to the kernel right away, without waiting for it, so an
+		// entry the flush policy flushed doesn't wait for the next buffer swap
+		enter(0);
+	} else {
+		// Fallback without io_uring
+		if (pwrite_fully(buffer.data.get(), buffer.length, buffer.offset) == false) {
+			_failed = true;
+		}
+		buffer.length = 0;
+	}
+
+	_current = acquire_buffer();
+	return _current >= 0;
+}
+
+void PSILogUringOutput::queue_write(unsigned index) {
+	Buffer &buffer = _buffers[index];
+
+	// There is always room, as there are never more writes queued than buffers
+	unsigned tail = *_sq_tail;
+	unsigned slot = tail & *_sq_mask;
+	struct io_uring_sqe *sqe = &_sqes[slot];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = _fd;
+	sqe->addr = (uint64_t)(uintptr_t)(buffer.data.get() + buffer.written);
+	sqe->len = (uint32_t)(buffer.length - buffer.written);
+	sqe->off = buffer.offset + buffer.written;
+	sqe->buf_index = (uint16_t)index;
+	sqe->user_data = index;
+
+	_sq_array[slot] = slot;
+	__atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	_queued++;
+}
+
+bool PSILogUringOutput::enter(unsigned min_complete) {
+	while (_queued > 0 || min_complete > 0) {
+		unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+		int submitted = io_uring_enter(_ring_fd, _queued, min_complete, flags);
+		if (submitted < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				// Make room by handling completions, and try again
+				reap();
+				continue;
+			}
+
+			_failed = true;
+			return false;
+		}
+
+		_queued -= std::min((unsigned)submitted, _queued);
+		if (min_complete > 0) {
+			break;
+		}
+	}
+
+	return true;
+}
+
+void PSILogUringOutput::reap() {
+	unsigned head = *_cq_head;
+	unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+		Buffer &buffer = _buffers[cqe->user_data];
+		int result = cqe->res;
+		head++;
+
+		if (result == -EINTR || result == -EAGAIN) {
+			queue_write((unsigned)cqe->user_data);
+			continue;
+		}
+
+		if (result <= 0) {
+			// The entries in the buffer are lost
+			_failed = true;
+		} else {
+			buffer.written += result;
+			if (buffer.written < buffer.length) {
+				queue_write((unsigned)cqe->user_data);
+				continue;
+			}
+		}
+
+		buffer.length = 0;
+		buffer.in_flight = false;
+		_in_flight--;
+	}
+
+	__atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+}
+
+int PSILogUringOutput::acquire_buffer() {
+	while (true) {
+		for (size_t i = 0; i < _buffers.size(); i++) {
+			if (_buffers[i].in_flight == false) {
+				return (int)i;
+			}
+		}
+
+		// All buffers are being written, wait for one of them
+		if (enter(1) == false) {
+			return -1;
+		}
+		reap();
+	}
+}
+
+void PSILogUringOutput::drain() {
+	if (_failed == true) {
+		return;
+	}
+
+	if (_buffers[_current].length > 0 && submit_current() == false) {
+		return;
+	}
+
+	while (_ring_fd >= 0 && _in_flight > 0 && _failed == false) {
+		if (enter(1) == false) {
+			return;
+		}
+		reap();
+	}
+}
+
+void PSILogUringOutput::set_flush_bytes(size_t flush_bytes) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_flush_policy.set_flush_bytes(flush_bytes);
+}
+
+size_t PSILogUringOutput::get_flush_bytes() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _flush_policy.get_flush_bytes();
+}
+
+void PSILogUringOutput::set_flush_interval(std::chrono::milliseconds flush_interval) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_flush_policy.set_flush_interval(flush_interval);
+}
+
+std::chrono::milliseconds PSILogUringOutput::get_flush_interval() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _flush_policy.get_flush_interval();
+}
+
+void PSILogUringOutput::set_flush_levels(int flush_levels) {
+	std::lock_guard<std::mutex> guard(_mutex);
+	_flush_policy.set_flush_levels(flush_levels);
+}
+
+int PSILogUringOutput::get_flush_levels() {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _flush_policy.get_flush_levels();
+}
@@ -0,0 +1,133 @@
+// PSILogUringOutput.h
+//
+// Log output submitting the file writes through io_uring, so the writing thread
+// only copies entries into a buffer and hands full buffers to the kernel
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <stdint.h>
+
+#include "PSILog.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Entries are copied into one of a set of buffers registered with the kernel.
+// Full buffers, and the current one when the flush policy says so, are written with
+// IORING_OP_WRITE_FIXED at their own file offset, and several writes can be in flight
+// at once. Each write is submitted with io_uring_enter() as soon as it's queued, without
+// waiting for it to complete. Writing only waits for the kernel when all of the buffers
+// are in flight. flush() waits for all the writes to complete.
+//
+// When the kernel doesn't support io_uring, the buffers are written with plain pwrite()
+// calls instead. The output owns the file, so it can't be shared with other writers.
+//
+// This pays off only when the writes block, on slow disks or network file systems, as
+// the writing thread keeps filling buffers while the earlier ones are written. Writes
+// that land in the page cache are about as fast with a buffered PSILogFileOutput or
+// PSILogFdOutput. Don't use it to flush every entry, each entry then takes a buffer
+// and an io_uring_enter() call, which is slower than PSILogFdOutput's one writev().
+class PSILogUringOutput : public PSILogOutput {
+public:
+	static const size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+	static const unsigned DEFAULT_BUFFER_COUNT = 8;
+
+	PSILogUringOutput(const char *output_path, size_t buffer_size = DEFAULT_BUFFER_SIZE,
+			  unsigned buffer_count = DEFAULT_BUFFER_COUNT);
+	~PSILogUringOutput();
+
+	bool write_log_entry(const std::string &log_entry, int log_level) override;
+	void flush() override;
+	void tick() override;
+
+	// Writes in flight are written again with pwrite(), at the same offsets,
+	// in case the kernel cancels them when the process dies
+	void flush_emergency() override;
+	void write_emergency(const char *entry, size_t length, int log_level) override;
+
+	// Are the writes going through io_uring, or the pwrite() fallback
+	bool get_uring_enabled() const { return _ring_fd >= 0; }
+
+	// The flush policy decides when partially filled buffers are submitted,
+	// by default they are submitted once full, or when an ERR entry arrives
+	void set_flush_bytes(size_t flush_bytes);
+	size_t get_flush_bytes();
+	void set_flush_interval(std::chrono::milliseconds flush_interval);
+	std::chrono::milliseconds get_flush_interval();
+	void set_flush_levels(int flush_levels);
+	int get_flush_levels();
+
+private:
+	struct Buffer {
+		std::unique_ptr<char[]> data;
+		size_t length = 0;
+
+		// File offset of the buffer, and how much of it the kernel has written
+		uint64_t offset = 0;
+		size_t written = 0;
+		bool in_flight = false;
+	};
+
+	// Set up the ring and register the buffers, false if io_uring is not available
+	bool setup_ring();
+	void teardown_ring();
+
+	// Write the current buffer out, and start filling a free one
+	bool submit_current();
+
+	// Queue a write of the rest of the buffer
+	void queue_write(unsigned index);
+
+	// Submit the queued writes, waiting for min_complete completions
+	bool enter(unsigned min_complete);
+
+	// Handle the completed writes, resubmitting short ones
+	void reap();
+
+	// Find a buffer that is not in flight, waiting for the kernel if needed
+	int acquire_buffer();
+
+	// Submit everything and wait until it's written, the mutex must be held
+	void drain();
+
+	// Write with pwrite() until done or failed, async-signal-safe
+	bool pwrite_fully(const char *data, size_t length, uint64_t offset);
+
+	int _fd = -1;
+	int _ring_fd = -1;
+	bool _failed = false;
+	std::mutex _mutex;
+
+	size_t _buffer_size;
+	std::vector<Buffer> _buffers;
+	int _current = -1;
+	unsigned _in_flight = 0;
+	unsigned _queued = 0;
+	uint64_t _offset = 0;
+
+	// Ring mappings
+	void *_sq_ring = nullptr;
+	size_t _sq_ring_size = 0;
+	void *_cq_ring = nullptr;
+	size_t _cq_ring_size = 0;
+	io_uring_sqe *_sqes = nullptr;
+	size_t _sqes_size = 0;
+
+	unsigned *_sq_head = nullptr;
+	unsigned *_sq_tail = nullptr;
+	unsigned *_sq_mask = nullptr;
+	unsigned *_sq_array = nullptr;
+	unsigned *_cq_head = nullptr;
+	unsigned *_cq_tail = nullptr;
+	unsigned *_cq_mask = nullptr;
+	io_uring_cqe *_cqes = nullptr;
+
+	PSILogFlushPolicy _flush_policy;
+};
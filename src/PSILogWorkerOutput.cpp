@@ -0,0 +1,285 @@
+// PSILogWorkerOutput.cpp
+//
+// Log output running another output on a worker thread of its own, behind a
+// bounded queue, so a slow or stalled output doesn't hold up the others
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#include <algorithm>
+
+#include "PSILogWorkerOutput.h"
+
+// Most entries the worker thread takes from the queue to write at once
+static const size_t WORKER_BATCH_SIZE = 64;
+
+// How often the worker thread ticks the wrapped output when there is nothing to write
+static const int WORKER_IDLE_WAIT_MS = 50;
+
+PSILogWorkerOutput::PSILogWorkerOutput(unique_ptr<PSILogOutput> output, size_t queue_size) :
+	_output(move(output)),
+	_queue(std::max<size_t>(queue_size, 1))
+{
+	_emergency_buffer.reserve(64 * 1024);
+	_worker_thread = std::thread(&PSILogWorkerOutput::worker_thread_main, this);
+}
+
+PSILogWorkerOutput::~PSILogWorkerOutput() {
+	{
+		std::lock_guard<std::mutex> guard(_mutex);
+		_stopping = true;
+	}
+	_not_empty.notify_one();
+	_worker_thread.join();
+}
+
+bool PSILogWorkerOutput::write_log_entry(const std::string &log_entry, int log_level) {
+	PSILogRecord record;
+	record.log_level = log_level;
+	record.timestamp = std::chrono::system_clock::now();
+	record.thread_id = std::this_thread::get_id();
+	record.thread_index = psilog_thread_index();
+	record.message = log_entry.data();
+	record.message_length = log_entry.size();
+
+	return write_log_entries(&record, 1);
+}
+
+bool PSILogWorkerOutput::write_log_record(const PSILogRecord &record) {
+	return write_log_entries(&record, 1);
+}
+
+// The whole batch is queued under one lock
+bool PSILogWorkerOutput::write_log_entries(const PSILogRecord *records, size_t count) {
+	auto now = std::chrono::steady_clock::now();
+	bool success = true;
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	for (size_t i = 0; i < count; i++) {
+		if (push(lock, records[i], now) == false) {
+			success = false;
+		}
+	}
+	lock.unlock();
+
+	_not_empty.notify_one();
+
+	return success;
+}
+
+bool PSILogWorkerOutput::push(std::unique_lock<std::mutex> &lock, const PSILogRecord &record,
+			      std::chrono::steady_clock::time_point now) {
+	// Queue full, apply our overflow policy
+	while (_count == _queue.size()) {
+		if (_overflow == PSILog::OVERFLOW_BLOCK) {
+			_not_empty.notify_one();
+			_not_full.wait(lock);
+			continue;
+		}
+
+		_dropped++;
+		_dropped_total++;
+
+		if (_overflow == PSILog::OVERFLOW_DROP_NEWEST) {
+			return false;
+		}
+
+		_head = (_head + 1) % _queue.size();
+		_count--;
+	}
+
+	// The queued entries keep their string capacity, so copying doesn't allocate
+	QueuedEntry &queued = _queue[(_head + _count) % _queue.size()];
+	PSILogAsyncEntry &entry = queued.entry;
+	if (record.site != nullptr && record.render != nullptr) {
+		entry.entry.assign(record.payload, record.payload_length);
+		entry.site = record.site;
+		entry.render = record.render;
+	} else {
+		entry.entry.assign(record.message != nullptr ? record.message : "", record.message_length);
+		entry.site = nullptr;
+		entry.render = nullptr;
+	}
+	entry.log_level = record.log_level;
+	entry.timestamp = record.timestamp;
+	entry.thread_id = record.thread_id;
+	entry.thread_index = record.thread_index;
+	queued.layout = record.layout;
+	queued.queued = now;
+	_count++;
+
+	return true;
+}
+
+PSILogRecord PSILogWorkerOutput::get_record(const QueuedEntry &queued) {
+	const PSILogAsyncEntry &entry = queued.entry;
+
+	PSILogRecord record;
+	record.log_level = entry.log_level;
+	record.timestamp = entry.timestamp;
+	record.thread_id = entry.thread_id;
+	record.thread_index = entry.thread_index;
+	record.layout = queued.layout;
+
+	if (entry.site != nullptr) {
+		record.site = entry.site;
+		record.render = entry.render;
+		record.payload = entry.entry.data();
+		record.payload_length = entry.entry.size();
+	} else {
+		record.message = entry.entry.data();
+		record.message_length = entry.entry.size();
+	}
+
+	return record;
+}
+
+// Takes batches off the queue and writes them without holding the lock, so
+// writers only wait for the worker when the queue is full and they block
+void PSILogWorkerOutput::worker_thread_main() {
+	std::vector<QueuedEntry> batch(WORKER_BATCH_SIZE);
+	std::vector<PSILogRenderCache> caches(WORKER_BATCH_SIZE);
+	PSILogRecord records[WORKER_BATCH_SIZE];
+	std::string dropped_message;
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (true) {
+		if (_count == 0 && _dropped == 0) {
+			_idle.notify_all();
+			if (_stopping == true) {
+				break;
+			}
+
+			// Let the wrapped output do its timed work while we are idle
+			if (_not_empty.wait_for(lock, std::chrono::milliseconds(WORKER_IDLE_WAIT_MS)) == std::cv_status::timeout &&
+			    _count == 0) {
+				lock.unlock();
+				_output->tick();
+				lock.lock();
+			}
+			continue;
+		}
+
+		size_t count = std::min(_count, WORKER_BATCH_SIZE);
+		for (size_t i = 0; i < count; i++) {
+			const QueuedEntry &queued = _queue[(_head + i) % _queue.size()];
+			QueuedEntry &taken = batch[i];
+			taken.entry.entry.assign(queued.entry.entry);
+			taken.entry.log_level = queued.entry.log_level;
+			taken.entry.site = queued.entry.site;
+			taken.entry.render = queued.entry.render;
+			taken.entry.timestamp = queued.entry.timestamp;
+			taken.entry.thread_id = queued.entry.thread_id;
+			taken.entry.thread_index = queued.entry.thread_index;
+			taken.layout = queued.layout;
+			taken.queued = queued.queued;
+		}
+		_head = (_head + count) % _queue.size();
+		_count -= count;
+
+		uint64_t dropped = _dropped;
+		_dropped = 0;
+
+		if (count > 0) {
+			_writing = true;
+			_writing_since = batch[0].queued;
+		}
+		lock.unlock();
+		_not_full.notify_all();
+
+		for (size_t i = 0; i < count; i++) {
+			caches[i].count = 0;
+			records[i] = get_record(batch[i]);
+			records[i].cache = &caches[i];
+		}
+
+		if (count > 0) {
+			_output->write_log_entries(records, count);
+			_written += count;
+		}
+
+		// Let the output know it has lost entries
+		if (dropped > 0) {
+			dropped_message.clear();
+			psilog_append(dropped_message, (unsigned long long)dropped);
+			dropped_message += " messages dropped\n";
+
+			PSILogRecord record;
+			record.log_level = PSILog::WARN;
+			record.timestamp = std::chrono::system_clock::now();
+			record.thread_id = std::this_thread::get_id();
+			record.thread_index = psilog_thread_index();
+			record.message = dropped_message.data();
+			record.message_length = dropped_message.size();
+			record.layout = count > 0 ? batch[0].layout : nullptr;
+			_output->write_log_record(record);
+		}
+
+		lock.lock();
+		if (count > 0) {
+			_max_lag = std::max<std::chrono::nanoseconds>(_max_lag, std::chrono::steady_clock::now() - _writing_since);
+		}
+		_writing = false;
+	}
+}
+
+void PSILogWorkerOutput::flush() {
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_not_empty.notify_one();
+		_idle.wait(lock, [this] {
+			return _count == 0 && _dropped == 0 && _writing == false;
+		});
+	}
+
+	_output->flush();
+}
+
+size_t PSILogWorkerOutput::get_queued() const {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _count;
+}
+
+// The batch being written was queued before anything still in the queue
+std::chrono::nanoseconds PSILogWorkerOutput::get_lag() const {
+	std::lock_guard<std::mutex> guard(_mutex);
+
+	if (_writing == true) {
+		return std::chrono::steady_clock::now() - _writing_since;
+	}
+
+	if (_count > 0) {
+		return std::chrono::steady_clock::now() - _queue[_head].queued;
+	}
+
+	return std::chrono::nanoseconds(0);
+}
+
+std::chrono::nanoseconds PSILogWorkerOutput::get_max_lag() const {
+	std::lock_guard<std::mutex> guard(_mutex);
+	return _max_lag;
+}
+
+// The crashed thread may hold our lock, so the queue is read as it is. The batch the
+// worker thread was writing is lost if the wrapped output was stuck with it.
+void PSILogWorkerOutput::flush_emergency() {
+	_output->flush_emergency();
+
+	for (size_t i = 0; i < _count; i++) {
+		const QueuedEntry &queued = _queue[(_head + i) % _queue.size()];
+		PSILogRecord record = get_record(queued);
+
+		const PSILogLayout *layout = _output->get_layout() != nullptr ? _output->get_layout() : record.layout;
+		_emergency_buffer.clear();
+		if (layout != nullptr) {
+			layout->render(record, _emergency_buffer);
+		} else {
+			record.append_message(_emergency_buffer);
+		}
+
+		_output->write_emergency(_emergency_buffer.data(), _emergency_buffer.size(), record.log_level);
+	}
+}
+
+void PSILogWorkerOutput::write_emergency(const char *entry, size_t length, int log_level) {
+	_output->write_emergency(entry, length, log_level);
+}
@@ -0,0 +1,124 @@
+// PSILogWorkerOutput.h
+//
+// Log output running another output on a worker thread of its own, behind a
+// bounded queue, so a slow or stalled output doesn't hold up the others
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+#include "PSILog.h"
+
+// Writing only copies the record into the queue, the worker thread takes the queued
+// records in batches and writes them to the wrapped output with write_log_entries().
+// The wrapped output renders them in its own layout, or gets the structured records,
+// just like when it's added to the logger directly.
+//
+// When the queue is full, the overflow policy decides whether the writing thread
+// waits (PSILog::OVERFLOW_BLOCK), or the new (PSILog::OVERFLOW_DROP_NEWEST, the default)
+// or the oldest queued entry (PSILog::OVERFLOW_DROP_OLDEST) is dropped. Dropped entries
+// are reported to the wrapped output with a "N messages dropped" warning entry.
+//
+// The lag of the output, how long the oldest entry not yet written has waited, tells
+// how far behind the wrapped output is.
+class PSILogWorkerOutput : public PSILogOutput {
+public:
+	static const size_t DEFAULT_QUEUE_SIZE = 4096;
+
+	PSILogWorkerOutput(unique_ptr<PSILogOutput> output, size_t queue_size = DEFAULT_QUEUE_SIZE);
+
+	// Writes out everything queued before stopping the worker thread
+	~PSILogWorkerOutput();
+
+	// Entries written without a record are queued with the current time and thread
+	bool write_log_entry(const std::string &log_entry, int log_level) override;
+	bool write_log_record(const PSILogRecord &record) override;
+	bool write_log_entries(const PSILogRecord *records, size_t count) override;
+
+	// Waits until the worker thread has written everything queued so far,
+	// and flushes the wrapped output
+	void flush() override;
+
+	// The worker thread ticks the wrapped output itself when it's idle
+	void tick() override {}
+
+	// Writes out the queued entries, without waiting for the worker thread, which
+	// may be stuck in the wrapped output
+	void flush_emergency() override;
+	void write_emergency(const char *entry, size_t length, int log_level) override;
+
+	PSILogOutput *get_output() const { return _output.get(); }
+
+	size_t get_queue_size() const { return _queue.size(); }
+
+	int get_overflow() const { return _overflow; }
+	void set_overflow(int overflow) { _overflow = overflow; }
+
+	// Entries waiting in the queue
+	size_t get_queued() const;
+
+	// How long the oldest entry not yet written has waited, 0 when all are written
+	std::chrono::nanoseconds get_lag() const;
+
+	// Longest time an entry waited until it was written
+	std::chrono::nanoseconds get_max_lag() const;
+
+	// Entries written to the wrapped output, and dropped by the overflow policy
+	uint64_t get_written() const { return _written; }
+	uint64_t get_dropped() const { return _dropped_total; }
+
+private:
+	struct QueuedEntry {
+		// The text as logged, or the payload of a deferred entry, with the rest of the record
+		PSILogAsyncEntry entry;
+		const PSILogLayout *layout = nullptr;
+		std::chrono::steady_clock::time_point queued;
+	};
+
+	// Copy the record to the back of the queue, the mutex must be held.
+	// Returns false if the entry was dropped.
+	bool push(std::unique_lock<std::mutex> &lock, const PSILogRecord &record,
+		  std::chrono::steady_clock::time_point now);
+
+	// Record of a queued entry, pointing to the entry
+	static PSILogRecord get_record(const QueuedEntry &queued);
+
+	void worker_thread_main();
+
+	unique_ptr<PSILogOutput> _output;
+	int _overflow = PSILog::OVERFLOW_DROP_NEWEST;
+
+	// The queue, a ring of reused entries, so queueing doesn't allocate once warmed up
+	mutable std::mutex _mutex;
+	std::condition_variable _not_empty;
+	std::condition_variable _not_full;
+	std::condition_variable _idle;
+	std::vector<QueuedEntry> _queue;
+	size_t _head = 0;
+	size_t _count = 0;
+
+	// The worker thread is writing a batch taken from the queue, queued at _writing_since
+	bool _writing = false;
+	std::chrono::steady_clock::time_point _writing_since;
+	std::chrono::nanoseconds _max_lag { 0 };
+
+	uint64_t _dropped = 0;
+	std::atomic<uint64_t> _dropped_total { 0 };
+	std::atomic<uint64_t> _written { 0 };
+	bool _stopping = false;
+
+	// Rendered queued entries in an emergency, reserved up front
+	std::string _emergency_buffer;
+
+	std::thread _worker_thread;
+};
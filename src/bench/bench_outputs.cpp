@@ -0,0 +1,95 @@
+// bench_outputs.cpp
+//
+// Throughput benchmark of the file outputs, writing the same entries through each
+// output into a file in the given directory, /tmp by default. The outputs are
+// compared buffered, and flushing every entry.
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../PSILog.h"
+#include "../PSILogUringOutput.h"
+#include "../PSILogRingOutput.h"
+#include "../PSILogWorkerOutput.h"
+
+static const int BENCH_ENTRIES = 1000000;
+
+// Write the entries through output, returning entries per second
+static double bench_output(unique_ptr<PSILogOutput> output, int entries) {
+	std::string entry = "[12:34:56] [140234567890] Benchmark entry with some typical length text 1234567890\n";
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < entries; i++) {
+		output->write_log_entry(entry, PSILog::INFO);
+	}
+	output->flush();
+	output.reset();
+	auto end = std::chrono::steady_clock::now();
+
+	double seconds = std::chrono::duration<double>(end - start).count();
+	return entries / seconds;
+}
+
+static void report(const char *name, double entries_per_second, double baseline) {
+	std::cout << std::left << std::setw(34) << name
+		  << std::right << std::setw(12) << (long long)entries_per_second << " entries/s"
+		  << std::setw(8) << std::fixed << std::setprecision(2) << entries_per_second / baseline << "x"
+		  << std::endl;
+}
+
+int main(int argc, char **argv) {
+	std::string dir = argc > 1 ? argv[1] : "/tmp";
+	int entries = argc > 2 ? atoi(argv[2]) : BENCH_ENTRIES;
+	std::string path = dir + "/psilog_bench.log";
+
+	std::remove(path.c_str());
+	double file_flushed = bench_output(make_unique<PSILogFileOutput>(path.c_str()), entries / 10) ;
+	report("PSILogFileOutput, flush per entry", file_flushed, file_flushed);
+
+	std::remove(path.c_str());
+	auto buffered = make_unique<PSILogFileOutput>(path.c_str());
+	buffered->set_flush_bytes(64 * 1024);
+	report("PSILogFileOutput, buffered", bench_output(move(buffered), entries), file_flushed);
+
+	std::remove(path.c_str());
+	auto fd = make_unique<PSILogFdOutput>(path.c_str());
+	fd->set_flush_bytes(64 * 1024);
+	report("PSILogFdOutput, buffered", bench_output(move(fd), entries), file_flushed);
+
+	std::remove(path.c_str());
+	auto uring = make_unique<PSILogUringOutput>(path.c_str());
+	const char *name = uring->get_uring_enabled() == true ? "PSILogUringOutput" : "PSILogUringOutput, pwrite fallback";
+	report(name, bench_output(move(uring), entries), file_flushed);
+
+	std::remove(path.c_str());
+	report("PSILogRingOutput", bench_output(make_unique<PSILogRingOutput>(path.c_str()), entries), file_flushed);
+
+	// Blocking when the queue is full, so every entry is written
+	std::remove(path.c_str());
+	auto worker_file = make_unique<PSILogFileOutput>(path.c_str());
+	worker_file->set_flush_bytes(64 * 1024);
+	auto worker = make_unique<PSILogWorkerOutput>(move(worker_file));
+	worker->set_overflow(PSILog::OVERFLOW_BLOCK);
+	report("PSILogWorkerOutput, buffered file", bench_output(move(worker), entries), file_flushed);
+
+	// Every entry written out right away, where io_uring pays a submission per entry
+	std::cout << std::endl;
+	std::remove(path.c_str());
+	double fd_flushed = bench_output(make_unique<PSILogFdOutput>(path.c_str()), entries / 10);
+	report("PSILogFdOutput, flush per entry", fd_flushed, fd_flushed);
+
+	std::remove(path.c_str());
+	auto uring_flushed = make_unique<PSILogUringOutput>(path.c_str());
+	uring_flushed->set_flush_bytes(1);
+	report("PSILogUringOutput, flush per entry", bench_output(move(uring_flushed), entries / 10), fd_flushed);
+
+	std::remove(path.c_str());
+
+	return 0;
+}
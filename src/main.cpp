@@ -76,6 +76,12 @@ int main(int argc, char *argv[]) {
 	drive.set_status(WarpDrive::ACTIVE);
 	log(PSILog::INFO) << drive << std::endl;
 
+	// Format string logging, the format is checked against the arguments at compile time
+	log.info(PSILOG_FMT("Warp drive {} at {:.1f} % power"), drive.get_model_name(), 99.5);
+
+	// Deferred logging, only the raw argument values are copied by the logging call
+	PSILOG_DEFERRED(log, PSILog::INFO, "Warp core output at {} %, {} drives online", 87.5, 2);
+
 	// lambda functions for testing threading
 	auto t_func1 = [&log] (int level) {
 		int delay = 500 + level*250;
@@ -9,9 +9,63 @@
 #include <fstream>
 #include <cstdio>
 #include <thread>
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <cstdlib>
+#include <iomanip>
+#include <ctime>
+#include <climits>
+#include <csignal>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef PSILOG_HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "catch.hpp"
 #include "../PSILog.h"
+#include "../PSILogUringOutput.h"
+#include "../PSILogBinaryOutput.h"
+#include "../PSILogRingOutput.h"
+#include "../PSILogWorkerOutput.h"
+
+// Count the heap allocations made by the calling thread while count_allocations is set,
+// and keep the size of the largest one
+static thread_local bool count_allocations = false;
+static thread_local size_t allocation_count = 0;
+static thread_local size_t largest_allocation = 0;
+
+void *operator new(size_t size) {
+	if (count_allocations == true) {
+		allocation_count++;
+		largest_allocation = std::max(largest_allocation, size);
+	}
+
+	void *p = std::malloc(size > 0 ? size : 1);
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	std::free(p);
+}
+
+// Handler the crash handler passes the signal on to, exiting with 0 if the
+// crash handler didn't allocate
+static void exit_with_allocation_count(int signal) {
+	_exit(allocation_count == 0 ? 0 : 1);
+}
 
 // Extending the logger output, so that records to the
 // stringstream we provide to this class, so we can test with a stringstream instead of
@@ -34,6 +88,225 @@ private:
 	std::ostringstream &_dest;
 };
 
+// Output that takes its time writing, for filling up the asynchronous rings
+class PSILogSlowOutput : public PSILogStringOutput {
+public:
+	PSILogSlowOutput(std::ostringstream &dest) : PSILogStringOutput(dest) {}
+
+	bool write_log_entry(const std::string &log_entry, int log_level) override {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		return PSILogStringOutput::write_log_entry(log_entry, log_level);
+	}
+};
+
+// Output that only counts what it gets, so that it doesn't allocate itself
+class PSILogCountingOutput : public PSILogOutput {
+public:
+	PSILogCountingOutput(size_t &entries, size_t &bytes) : _entries(entries), _bytes(bytes) {}
+
+	bool write_log_entry(const std::string &log_entry, int log_level) override {
+		_entries++;
+		_bytes += log_entry.size();
+		return true;
+	}
+
+	void flush() override {}
+
+private:
+	size_t &_entries;
+	size_t &_bytes;
+};
+
+// Output counting entries from any thread, and its own destruction
+class PSILogSharedCountingOutput : public PSILogOutput {
+public:
+	PSILogSharedCountingOutput(std::atomic<size_t> &entries, std::atomic<size_t> &destroyed) :
+		_entries(entries),
+		_destroyed(destroyed)
+	{}
+
+	~PSILogSharedCountingOutput() {
+		_destroyed++;
+	}
+
+	bool write_log_entry(const std::string &log_entry, int log_level) override {
+		_entries++;
+		return true;
+	}
+
+	void flush() override {}
+
+private:
+	std::atomic<size_t> &_entries;
+	std::atomic<size_t> &_destroyed;
+};
+
+// Output that hangs the writer thread once blocked, keeping the entries after it queued
+class PSILogBlockingOutput : public PSILogOutput {
+public:
+	PSILogBlockingOutput(std::atomic<bool> &blocked) : _blocked(blocked) {}
+
+	bool write_log_entry(const std::string &log_entry, int log_level) override {
+		while (_blocked.load() == true) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		return true;
+	}
+
+	void flush() override {}
+
+private:
+	std::atomic<bool> &_blocked;
+};
+
+// Output counting the batches it gets from the writer thread
+class PSILogBatchCountingOutput : public PSILogStringOutput {
+public:
+	PSILogBatchCountingOutput(std::ostringstream &dest, size_t &batches) :
+		PSILogStringOutput(dest),
+		_batches(batches)
+	{}
+
+	bool write_log_entries(const PSILogRecord *records, size_t count) override {
+		_batches++;
+		return PSILogOutput::write_log_entries(records, count);
+	}
+
+private:
+	size_t &_batches;
+};
+
+// Layout counting how many times it renders
+class PSILogCountingLayout : public PSILogTextLayout {
+public:
+	PSILogCountingLayout(size_t &renders) : PSILogTextLayout(false), _renders(renders) {}
+
+	void render(const PSILogRecord &record, std::string &out) const override {
+		_renders++;
+		PSILogTextLayout::render(record, out);
+	}
+
+private:
+	size_t &_renders;
+};
+
+// Output keeping the records it gets without rendering them
+class PSILogRecordOutput : public PSILogOutput {
+public:
+	struct Kept {
+		int log_level;
+		uint32_t thread_index;
+		std::string message;
+		const PSILogCallSite *site;
+	};
+
+	PSILogRecordOutput(std::vector<Kept> &kept) : _kept(kept) {}
+
+	bool write_log_entry(const std::string &log_entry, int log_level) override {
+		return false;
+	}
+
+	bool write_log_record(const PSILogRecord &record) override {
+		Kept kept;
+		kept.log_level = record.log_level;
+		kept.thread_index = record.thread_index;
+		kept.message.assign(record.message != nullptr ? record.message : "", record.message_length);
+		kept.site = record.site;
+		_kept.push_back(kept);
+		return true;
+	}
+
+	void flush() override {}
+
+private:
+	std::vector<Kept> &_kept;
+};
+
+// String output that hangs while blocked, standing in for a stalled destination
+class PSILogStalledOutput : public PSILogStringOutput {
+public:
+	PSILogStalledOutput(std::ostringstream &dest, std::atomic<bool> &blocked) :
+		PSILogStringOutput(dest),
+		_blocked(blocked)
+	{}
+
+	bool write_log_entry(const std::string &log_entry, int log_level) override {
+		while (_blocked.load() == true) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return PSILogStringOutput::write_log_entry(log_entry, log_level);
+	}
+
+private:
+	std::atomic<bool> &_blocked;
+};
+
+// Output failing its writes while failing is set
+class PSILogFailingOutput : public PSILogStringOutput {
+public:
+	PSILogFailingOutput(std::ostringstream &dest, std::atomic<bool> &failing) :
+		PSILogStringOutput(dest),
+		_failing(failing)
+	{}
+
+	bool write_log_entry(const std::string &log_entry, int log_level) override {
+		if (_failing.load() == true) {
+			return false;
+		}
+		return PSILogStringOutput::write_log_entry(log_entry, log_level);
+	}
+
+private:
+	std::atomic<bool> &_failing;
+};
+
+// Output recording where its entries are, to check the outputs share the formatted entry
+class PSILogEntryAddressOutput : public PSILogOutput {
+public:
+	PSILogEntryAddressOutput(std::vector<const void *> &addresses, bool retains) :
+		_addresses(addresses),
+		_retains(retains)
+	{}
+
+	bool write_log_entry(const std::string &log_entry, int log_level) override {
+		_addresses.push_back(&log_entry);
+		return true;
+	}
+
+	bool get_retains_entries() const override { return _retains; }
+
+	bool write_shared_log_entry(const PSILogSharedEntry &log_entry, int log_level) override {
+		_kept.push_back(log_entry);
+		return write_log_entry(*log_entry, log_level);
+	}
+
+	void flush() override {}
+
+	const std::vector<PSILogSharedEntry> &get_kept() const { return _kept; }
+
+private:
+	std::vector<const void *> &_addresses;
+	bool _retains;
+	std::vector<PSILogSharedEntry> _kept;
+};
+
+// User type with a stream operator, for testing logging user types
+struct WarpDriveStatus {
+	friend std::ostream& operator << (std::ostream& os, const WarpDriveStatus &status) {
+		return os << "warp drive online";
+	}
+};
+
+// User type counting how many times it has been formatted
+struct FormatCounter {
+	mutable int count = 0;
+
+	friend std::ostream& operator << (std::ostream& os, const FormatCounter &counter) {
+		counter.count++;
+		return os << "counted";
+	}
+};
+
 TEST_CASE("PSILog", "Test the logger interface") {
 	PSILog log;
 	std::string log_path = "log_tests.txt";
@@ -102,4 +375,1886 @@ TEST_CASE("PSILog", "Test the logger interface") {
 		CAPTURE(contents);
 		REQUIRE_THAT(contents, Catch::EndsWith("Info message to the file\n", Catch::CaseSensitive::Yes) );
 	}
+
+	SECTION("Buffered file output") {
+		auto output = make_unique<PSILogFileOutput>(log_path.c_str());
+		PSILogFileOutput *file_output = output.get();
+		file_output->set_flush_bytes(4096);
+		file_output->set_flush_interval(std::chrono::milliseconds(0));
+		log.add_output(move(output));
+		log.set_filter(PSILog::ALL);
+		log.set_add_prefix(false);
+
+		auto read_log = [&log_path] {
+			std::ifstream in(log_path.c_str());
+			return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		};
+
+		// Entries stay in the buffer until something triggers a flush
+		log(PSILog::INFO) << "Buffered info\n";
+		log(PSILog::WARN) << "Buffered warning\n";
+		REQUIRE( read_log().empty() == true );
+
+		// Flush levels
+		log(PSILog::ERR) << "Error flushes\n";
+		REQUIRE_THAT( read_log(), Catch::EndsWith("Buffered info\nBuffered warning\nError flushes\n") );
+
+		// Flush call
+		log(PSILog::INFO) << "Flushed by call\n";
+		REQUIRE_THAT( read_log(), !Catch::Contains("Flushed by call") );
+		log.flush();
+		REQUIRE_THAT( read_log(), Catch::EndsWith("Flushed by call\n") );
+
+		// Byte threshold
+		std::string long_text(4096, 'x');
+		log(PSILog::INFO) << "Short entry\n";
+		REQUIRE_THAT( read_log(), !Catch::Contains("Short entry") );
+		log(PSILog::INFO) << long_text << "\n";
+		REQUIRE_THAT( read_log(), Catch::EndsWith(long_text + "\n") );
+
+		// Timer, the idle writer thread ticks the output
+		file_output->set_flush_interval(std::chrono::milliseconds(10));
+		log.set_async(true);
+		log(PSILog::INFO) << "Flushed by timer\n";
+
+		bool flushed = false;
+		for (int i = 0; i < 200 && flushed == false; i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			flushed = read_log().find("Flushed by timer") != std::string::npos;
+		}
+		REQUIRE( flushed == true );
+		log.set_async(false);
+	}
+
+	SECTION("File output rotation") {
+		std::string rotate_path = "log_tests_rotate.txt";
+		auto remove_rotated = [&rotate_path] {
+			std::remove(rotate_path.c_str());
+			for (int i = 1; i < 100; i++) {
+				std::string path = rotate_path + "." + std::to_string(i);
+				std::remove(path.c_str());
+				std::remove((path + ".gz").c_str());
+			}
+		};
+		auto file_exists = [] (const std::string &path) {
+			std::ifstream in(path.c_str());
+			return in.good();
+		};
+		remove_rotated();
+
+		auto output = make_unique<PSILogFileOutput>(rotate_path.c_str());
+		PSILogFileOutput *file_output = output.get();
+		file_output->set_rotation_size(1000);
+		file_output->set_rotation_keep(3);
+		log.add_output(move(output));
+		log.set_add_prefix(false);
+
+		// 100 entries of 100 bytes fill 10 files, of which the current one and 3 rotated remain
+		std::string text(99, 'x');
+		for (int i = 0; i < 100; i++) {
+			log(PSILog::INFO) << text << "\n";
+		}
+		file_output->wait_rotation_idle();
+
+		std::ifstream in(rotate_path.c_str());
+		std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		in.close();
+		REQUIRE( contents.size() == 1000 );
+
+		for (int i = 1; i <= 6; i++) {
+			REQUIRE( file_exists(rotate_path + "." + std::to_string(i)) == false );
+		}
+		for (int i = 7; i <= 9; i++) {
+			REQUIRE( file_exists(rotate_path + "." + std::to_string(i)) == true );
+		}
+
+#ifdef PSILOG_HAVE_ZLIB
+		// Rotated files get compressed, and the numbering continues
+		file_output->set_rotation_compress(true);
+		log(PSILog::INFO) << "Compressed entry\n";
+		file_output->wait_rotation_idle();
+
+		std::string compressed_path = rotate_path + ".10.gz";
+		REQUIRE( file_exists(rotate_path + ".10") == false );
+		REQUIRE( file_exists(compressed_path) == true );
+
+		gzFile gz = gzopen(compressed_path.c_str(), "rb");
+		REQUIRE( gz != nullptr );
+		char buffer[2048];
+		int length = gzread(gz, buffer, sizeof(buffer));
+		gzclose(gz);
+		REQUIRE( length == 1000 );
+		REQUIRE( std::string(buffer, length) == contents );
+#endif
+
+		// Time based rotation on the next second
+		file_output->set_rotation_size(0);
+		file_output->set_rotation_keep(0);
+		file_output->set_rotation_interval(std::chrono::seconds(1));
+		log(PSILog::INFO) << "Before the interval\n";
+		std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+		log(PSILog::INFO) << "After the interval\n";
+		file_output->wait_rotation_idle();
+
+		in.open(rotate_path.c_str());
+		contents.assign((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		in.close();
+		REQUIRE( contents == "After the interval\n" );
+
+		remove_rotated();
+	}
+
+	SECTION("File rotation keeps the file when renaming fails") {
+		std::string rotate_path = "log_tests_rotate_fail.txt";
+		std::string blocker_path = rotate_path + ".2";
+		std::string blocker_file = blocker_path + "/file";
+		std::remove(rotate_path.c_str());
+		std::remove((rotate_path + ".1").c_str());
+		std::remove(blocker_file.c_str());
+		rmdir(blocker_path.c_str());
+		std::remove((rotate_path + ".3/file").c_str());
+		rmdir((rotate_path + ".3").c_str());
+		std::remove((rotate_path + ".3").c_str());
+
+		auto output = make_unique<PSILogFileOutput>(rotate_path.c_str());
+		PSILogFileOutput *file_output = output.get();
+		file_output->set_rotation_size(1000);
+		log.add_output(move(output));
+		log.set_add_prefix(false);
+
+		auto file_size = [] (const std::string &path) {
+			struct stat st;
+			return stat(path.c_str(), &st) == 0 ? (long)st.st_size : -1L;
+		};
+
+		std::string text(99, 'x');
+		for (int i = 0; i < 11; i++) {
+			log(PSILog::INFO) << text << "\n";
+		}
+		log.flush();
+		REQUIRE( file_size(rotate_path + ".1") == 1000 );
+
+		// A directory with something in it can't be replaced by renaming
+		REQUIRE( mkdir(blocker_path.c_str(), 0755) == 0 );
+		std::ofstream(blocker_file.c_str()) << "x";
+
+		for (int i = 0; i < 20; i++) {
+			log(PSILog::INFO) << text << "\n";
+		}
+		log.flush();
+		REQUIRE( file_size(rotate_path) == 2100 );
+
+		// Once the rename works again, the full file is rotated with the next entry
+		std::remove(blocker_file.c_str());
+		REQUIRE( rmdir(blocker_path.c_str()) == 0 );
+		std::this_thread::sleep_for(std::chrono::milliseconds(PSILogFileOutput::ROTATION_RETRY_MS + 50));
+		log(PSILog::INFO) << "After the rotation\n";
+		log.flush();
+		file_output->wait_rotation_idle();
+
+		REQUIRE( file_size(blocker_path) == 2100 );
+		REQUIRE( file_size(rotate_path) == 19 );
+		REQUIRE( file_size(rotate_path + ".3") == -1 );
+
+		// An interval rotation skipped while waiting to retry the rename stays due, and
+		// happens with the first entry after the wait, not on the next interval
+		auto sleep_past_second = [] {
+			auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::system_clock::now().time_since_epoch());
+			std::this_thread::sleep_for(std::chrono::milliseconds(1050 - now.count() % 1000));
+		};
+
+		std::string interval_blocker_path = rotate_path + ".3";
+		std::string interval_blocker_file = interval_blocker_path + "/file";
+		REQUIRE( mkdir(interval_blocker_path.c_str(), 0755) == 0 );
+		std::ofstream(interval_blocker_file.c_str()) << "x";
+
+		sleep_past_second();
+		file_output->set_rotation_size(0);
+		file_output->set_rotation_interval(std::chrono::seconds(1));
+		log(PSILog::INFO) << "Before the interval\n";
+		sleep_past_second();
+		log(PSILog::INFO) << "Rename fails\n";
+		log.flush();
+		REQUIRE( file_size(rotate_path) == 19 + 20 + 13 );
+
+		std::remove(interval_blocker_file.c_str());
+		REQUIRE( rmdir(interval_blocker_path.c_str()) == 0 );
+		std::this_thread::sleep_for(std::chrono::milliseconds(PSILogFileOutput::ROTATION_RETRY_MS + 50));
+		log(PSILog::INFO) << "After the rotation\n";
+		log.flush();
+		file_output->wait_rotation_idle();
+
+		REQUIRE( file_size(interval_blocker_path) == 19 + 20 + 13 );
+		REQUIRE( file_size(rotate_path) == 19 );
+
+		std::remove(rotate_path.c_str());
+		std::remove((rotate_path + ".1").c_str());
+		std::remove(blocker_path.c_str());
+		std::remove(interval_blocker_path.c_str());
+	}
+
+	SECTION("File output index") {
+		std::string index_path = "log_tests_index.txt";
+		auto remove_logs = [&index_path] {
+			std::remove(index_path.c_str());
+			std::remove(PSILogFileOutput::get_index_path(index_path).c_str());
+			for (int i = 1; i < 10; i++) {
+				std::string path = index_path + "." + std::to_string(i);
+				std::remove(path.c_str());
+				std::remove(PSILogFileOutput::get_index_path(path).c_str());
+			}
+		};
+		remove_logs();
+
+		// Entries of 50 bytes, numbered from 0, a point every 4 entries
+		auto entry_text = [] (int n) {
+			std::string text = "entry " + std::to_string(n);
+			text.resize(49, '.');
+			return text + "\n";
+		};
+
+		// Separate loggers, so the file can be opened again
+		{
+			PSILog index_log;
+			auto output = make_unique<PSILogFileOutput>(index_path.c_str());
+			PSILogFileOutput *file_output = output.get();
+			file_output->set_index_interval(200);
+			file_output->set_rotation_size(2000);
+			index_log.add_output(move(output));
+			index_log.set_add_prefix(false);
+
+			for (int i = 0; i < 60; i++) {
+				index_log(PSILog::INFO) << entry_text(i);
+			}
+			file_output->wait_rotation_idle();
+		}
+
+		// The first 40 entries went to the rotated file, which kept its index
+		PSILogIndexReader rotated;
+		REQUIRE( rotated.read(PSILogFileOutput::get_index_path(index_path + ".1")) == true );
+		REQUIRE( rotated.get_interval() == 200 );
+		REQUIRE( rotated.get_points().size() == 10 );
+		REQUIRE( rotated.get_points()[1].offset == 200 );
+		REQUIRE( rotated.get_points()[1].sequence == 4 );
+
+		// The numbering continues in the current file
+		PSILogIndexReader index;
+		REQUIRE( index.read(PSILogFileOutput::get_index_path(index_path)) == true );
+		REQUIRE( index.get_points().size() == 5 );
+		REQUIRE( index.get_points()[0].offset == 0 );
+		REQUIRE( index.get_points()[0].sequence == 40 );
+
+		// Finding an entry by sequence number reads at most one interval
+		PSILogIndexPoint point;
+		REQUIRE( index.find_sequence(50, point) == true );
+		REQUIRE( point.sequence == 48 );
+		std::ifstream in(index_path.c_str());
+		in.seekg(point.offset);
+		std::string line;
+		for (uint64_t i = point.sequence; i <= 50; i++) {
+			std::getline(in, line);
+		}
+		in.close();
+		REQUIRE( line + "\n" == entry_text(50) );
+
+		// The entries before the first point are in the rotated file, not this one
+		REQUIRE( index.find_sequence(10, point) == false );
+		REQUIRE( index.find_sequence(39, point) == false );
+		REQUIRE( rotated.find_sequence(10, point) == true );
+		REQUIRE( point.sequence == 8 );
+
+		// Times are in order, a time search starts before the entries logged at the time
+		const auto &points = index.get_points();
+		for (size_t i = 1; i < points.size(); i++) {
+			REQUIRE( points[i].timestamp >= points[i - 1].timestamp );
+		}
+		REQUIRE( index.find_time(points[2].timestamp).offset <= points[2].offset );
+		REQUIRE( index.find_time(points[0].timestamp).offset == 0 );
+
+		// Reopening the file continues the numbering from the entries in it
+		{
+			PSILog index_log;
+			auto output = make_unique<PSILogFileOutput>(index_path.c_str());
+			output->set_index_interval(200);
+			index_log.add_output(move(output));
+			index_log.set_add_prefix(false);
+
+			for (int i = 60; i < 70; i++) {
+				index_log(PSILog::INFO) << entry_text(i);
+			}
+		}
+
+		REQUIRE( index.read(PSILogFileOutput::get_index_path(index_path)) == true );
+		REQUIRE( index.get_points().size() == 8 );
+		REQUIRE( index.get_points()[5].sequence == 60 );
+		REQUIRE( index.get_points()[5].offset == 1000 );
+		REQUIRE( index.get_points()[6].sequence == 64 );
+
+		remove_logs();
+	}
+
+	SECTION("Indexed file output writes one entry per line") {
+		std::string lines_path = "log_tests_index_lines.txt";
+		std::remove(lines_path.c_str());
+		std::remove(PSILogFileOutput::get_index_path(lines_path).c_str());
+
+		auto read_lines = [&lines_path] {
+			std::ifstream in(lines_path.c_str());
+			return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		};
+
+		// Line breaks inside an entry are escaped, and every entry ends its line
+		{
+			PSILog index_log;
+			auto output = make_unique<PSILogFileOutput>(lines_path.c_str());
+			output->set_index_interval(1000);
+			index_log.add_output(move(output));
+			index_log.set_add_prefix(false);
+
+			index_log(PSILog::INFO) << "entry 0\n";
+			index_log(PSILog::INFO) << "entry 1 line a\nline b\n";
+			index_log(PSILog::INFO) << "entry 2";
+			index_log(PSILog::INFO) << "entry 3\n";
+		}
+		REQUIRE( read_lines() == "entry 0\nentry 1 line a\\nline b\nentry 2\nentry 3\n" );
+
+		// So the numbering continues from the entries, not the lines of the messages
+		{
+			PSILog index_log;
+			auto output = make_unique<PSILogFileOutput>(lines_path.c_str());
+			output->set_index_interval(1000);
+			index_log.add_output(move(output));
+			index_log.set_add_prefix(false);
+
+			index_log(PSILog::INFO) << std::string(1000, '.') << "\n";
+			index_log(PSILog::INFO) << "entry 5\n";
+		}
+
+		PSILogIndexReader index;
+		REQUIRE( index.read(PSILogFileOutput::get_index_path(lines_path)) == true );
+		REQUIRE( index.get_points().size() == 2 );
+		PSILogIndexPoint point;
+		REQUIRE( index.find_sequence(5, point) == true );
+		REQUIRE( point.sequence == 5 );
+		REQUIRE( read_lines().substr(point.offset) == "entry 5\n" );
+
+		std::remove(lines_path.c_str());
+		std::remove(PSILogFileOutput::get_index_path(lines_path).c_str());
+	}
+
+	SECTION("File descriptor output") {
+		auto output = make_unique<PSILogFdOutput>(log_path.c_str());
+		PSILogFdOutput *fd_output = output.get();
+		REQUIRE( fd_output->get_fd() >= 0 );
+		log.add_output(move(output));
+		log.set_add_prefix(false);
+
+		auto read_log = [&log_path] {
+			std::ifstream in(log_path.c_str());
+			return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		};
+
+		log(PSILog::INFO) << "Written right away\n";
+		REQUIRE( read_log() == "Written right away\n" );
+
+		// Buffered entries are gathered into writes of whole entries, and entries
+		// longer than PIPE_BUF are written alone
+		fd_output->set_flush_bytes(64 * 1024);
+		std::string expected = "Written right away\n";
+		for (int i = 0; i < 100; i++) {
+			std::string text = i % 10 == 0 ? std::string(PIPE_BUF + i, 'x') : "Batched entry " + std::to_string(i);
+			log(PSILog::INFO) << text << "\n";
+			expected += text + "\n";
+		}
+		REQUIRE( read_log() == "Written right away\n" );
+
+		log.flush();
+		REQUIRE( read_log() == expected );
+		REQUIRE( fd_output->get_dropped() == 0 );
+
+		// Entries that fail to be written are counted as dropped, with the ones queued after them
+		int read_only_fd = open(log_path.c_str(), O_RDONLY | O_CLOEXEC);
+		REQUIRE( read_only_fd >= 0 );
+		PSILogFdOutput failing_output(read_only_fd, true);
+		REQUIRE( failing_output.write_log_entry("Not written\n", PSILog::INFO) == false );
+		REQUIRE( failing_output.get_dropped() == 1 );
+
+		failing_output.set_flush_bytes(64 * 1024);
+		for (int i = 0; i < 10; i++) {
+			REQUIRE( failing_output.write_log_entry("Queued\n", PSILog::INFO) == true );
+		}
+		failing_output.flush();
+		REQUIRE( failing_output.get_dropped() == 11 );
+		REQUIRE( read_log() == expected );
+	}
+
+	SECTION("File descriptor outputs sharing a file don't interleave entries") {
+		// Two loggers appending to the same file, like two processes would
+		const int entries_per_thread = 500;
+		auto log_lines = [&log_path, entries_per_thread] (char fill) {
+			PSILog thread_log;
+			auto output = make_unique<PSILogFdOutput>(log_path.c_str());
+			output->set_flush_bytes(1024);
+			thread_log.add_output(move(output));
+			thread_log.set_add_prefix(false);
+
+			for (int i = 0; i < entries_per_thread; i++) {
+				thread_log(PSILog::INFO) << std::string(50 + i % 50, fill) << "\n";
+			}
+		};
+
+		std::thread first(log_lines, 'a');
+		std::thread second(log_lines, 'b');
+		first.join();
+		second.join();
+
+		std::ifstream in(log_path.c_str());
+		std::string line;
+		int lines = 0;
+		while (std::getline(in, line)) {
+			REQUIRE( line.size() >= 50 );
+			REQUIRE( line.find_first_not_of(line[0]) == std::string::npos );
+			lines++;
+		}
+		REQUIRE( lines == entries_per_thread * 2 );
+	}
+
+	SECTION("io_uring output") {
+		auto output = make_unique<PSILogUringOutput>(log_path.c_str(), 4096, 4);
+		PSILogUringOutput *uring_output = output.get();
+		log.add_output(move(output));
+		log.set_add_prefix(false);
+		log.set_filter(PSILog::ALL);
+
+		auto read_log = [&log_path] {
+			std::ifstream in(log_path.c_str());
+			return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		};
+
+		// Entries fill many buffers, some of them spanning two buffers
+		std::string expected;
+		for (int i = 0; i < 2000; i++) {
+			std::string text = "io_uring entry " + std::to_string(i) + std::string(i % 7 == 0 ? 5000 : 10, '.');
+			log(PSILog::INFO) << text << "\n";
+			expected += text + "\n";
+		}
+		log.flush();
+		REQUIRE( read_log() == expected );
+
+		// Partially filled buffers wait until flushed
+		uring_output->set_flush_interval(std::chrono::milliseconds(0));
+		log(PSILog::WARN) << "Waits in the buffer\n";
+		REQUIRE_THAT( read_log(), !Catch::Contains("Waits in the buffer") );
+		log.flush();
+		REQUIRE_THAT( read_log(), Catch::EndsWith("Waits in the buffer\n") );
+
+		// An ERR entry is submitted right away, and reaches the file without flush()
+		size_t size_before = read_log().size();
+		log(PSILog::ERR) << "Submitted right away\n";
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+		while (read_log().size() == size_before && std::chrono::steady_clock::now() < deadline) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		REQUIRE_THAT( read_log(), Catch::EndsWith("Submitted right away\n") );
+	}
+
+	SECTION("Binary output") {
+		std::string binary_path = "log_tests_binary.bin";
+		std::remove(binary_path.c_str());
+
+		std::ostringstream dest;
+		log.add_output(move(make_unique<PSILogStringOutput>(dest)));
+		log.add_output(move(make_unique<PSILogBinaryOutput>(binary_path.c_str(), 256)));
+		log.set_filter(PSILog::ALL);
+
+		enum class Phaser : int16_t { READY = 3 };
+		auto log_entries = [&log] (int count) {
+			for (int i = 0; i < count; i++) {
+				log(PSILog::INFO) << "Stream entry " << i << "\n";
+				log.warn(PSILOG_FMT("Format entry {}\n"), i);
+				PSILOG_DEFERRED(log, PSILog::ERR, "Deferred {} {} {} {} {} {{}}", i, -2.5, "text",
+						Phaser::READY, (unsigned char)'x');
+				PSILOG_DEFERRED(log, PSILog::INFO, "No arguments");
+			}
+		};
+
+		// Entries logged from other threads, and through the writer thread
+		log_entries(10);
+		std::thread other(log_entries, 10);
+		other.join();
+		log.set_async(true);
+		log_entries(10);
+		log.set_async(false);
+		log.flush();
+
+		// The decoded text matches what the text outputs wrote, with a fraction of the bytes
+		std::ifstream in(binary_path.c_str(), std::ios::binary);
+		std::string binary((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		in.close();
+		REQUIRE( binary.size() < dest.str().size() );
+
+		std::istringstream binary_in(binary);
+		std::ostringstream decoded;
+		PSILogBinaryDecoder decoder;
+		REQUIRE( decoder.decode(binary_in, decoded) == true );
+		REQUIRE( decoder.get_entry_count() == 120 );
+		REQUIRE( decoded.str() == dest.str() );
+		REQUIRE_THAT( decoded.str(), Catch::Contains("Deferred 9 -2.5 text 3 x {}\n") );
+
+		// Corrupt blocks are skipped, and the decoding continues from the next block
+		binary[binary.size() / 2] ^= 0x55;
+		std::istringstream corrupt_in(binary);
+		std::ostringstream corrupt_decoded;
+		PSILogBinaryDecoder corrupt_decoder;
+		REQUIRE( corrupt_decoder.decode(corrupt_in, corrupt_decoded) == false );
+		REQUIRE( corrupt_decoder.get_corrupt_blocks() == 1 );
+		REQUIRE( corrupt_decoder.get_entry_count() > 60 );
+		REQUIRE( corrupt_decoder.get_entry_count() < 120 );
+
+		std::istringstream text_in(dest.str());
+		std::ostringstream text_decoded;
+		REQUIRE( PSILogBinaryDecoder().decode(text_in, text_decoded) == false );
+
+		std::remove(binary_path.c_str());
+	}
+
+	SECTION("Binary decoder checks the payloads and thread numbering") {
+		// A log with arguments running past the end of their payloads
+		auto put = [] (std::string &out, const void *value, size_t size) {
+			out.append((const char *)value, size);
+		};
+		std::string records;
+		uint8_t type = PSILOG_RECORD_CALL_SITE;
+		uint32_t site_id = 1, site_line = 10;
+		uint16_t format_length = 11, file_length = 6, signature_length = 2;
+		put(records, &type, 1);
+		put(records, &site_id, 4);
+		put(records, &site_line, 4);
+		put(records, &format_length, 2);
+		put(records, &file_length, 2);
+		put(records, &signature_length, 2);
+		records += "Value {} {}test.ciz";
+
+		auto put_entry = [&put, &records] (uint32_t site, const std::string &payload) {
+			uint8_t entry_type = PSILOG_RECORD_ENTRY, level = PSILog::INFO;
+			uint16_t thread_index = 0;
+			int64_t timestamp = 0;
+			uint32_t payload_length = (uint32_t)payload.size();
+			put(records, &entry_type, 1);
+			put(records, &level, 1);
+			put(records, &thread_index, 2);
+			put(records, &site, 4);
+			put(records, &timestamp, 8);
+			put(records, &payload_length, 4);
+			records += payload;
+		};
+
+		int32_t value = 7;
+		uint32_t string_length = 1000;
+		std::string short_string((const char *)&value, 4);
+		short_string.append((const char *)&string_length, 4);
+		short_string += "abc";
+		put_entry(1, short_string);
+		put_entry(1, std::string((const char *)&value, 2));
+		put_entry(0, "Text\n");
+
+		std::string binary(PSILOG_BINARY_MAGIC, sizeof(PSILOG_BINARY_MAGIC));
+		uint16_t version = PSILOG_BINARY_VERSION, header_size = PSILOG_BINARY_HEADER_SIZE;
+		uint32_t flags = 0, length = (uint32_t)records.size(), count = 4;
+		uint32_t crc = psilog_crc32(records.data(), records.size());
+		put(binary, &version, 2);
+		put(binary, &header_size, 2);
+		put(binary, &flags, 4);
+		put(binary, &PSILOG_BINARY_BLOCK_MAGIC, 4);
+		put(binary, &length, 4);
+		put(binary, &count, 4);
+		put(binary, &crc, 4);
+		binary += records;
+
+		std::istringstream binary_in(binary);
+		std::ostringstream decoded;
+		PSILogBinaryDecoder decoder;
+		decoder.set_add_prefix(false);
+		REQUIRE( decoder.decode(binary_in, decoded) == true );
+		REQUIRE( decoded.str() == "Value 7 {}\nValue {} {}\nText\n" );
+
+		// A block claiming a length no block can have is corrupt, without reading that much,
+		// with more blocks after it than the decoder reads at a time
+		std::string huge_block = binary.substr(0, PSILOG_BINARY_HEADER_SIZE);
+		uint32_t huge_length = 0xfffffff0;
+		put(huge_block, &PSILOG_BINARY_BLOCK_MAGIC, 4);
+		put(huge_block, &huge_length, 4);
+		put(huge_block, &count, 4);
+		put(huge_block, &crc, 4);
+		std::string expected_decoded;
+		while (huge_block.size() < 256 * 1024) {
+			huge_block += binary.substr(PSILOG_BINARY_HEADER_SIZE);
+			expected_decoded += decoded.str();
+		}
+
+		std::istringstream huge_in(huge_block);
+		std::ostringstream huge_decoded;
+		PSILogBinaryDecoder huge_decoder;
+		huge_decoder.set_add_prefix(false);
+		count_allocations = true;
+		largest_allocation = 0;
+		bool huge_result = huge_decoder.decode(huge_in, huge_decoded);
+		count_allocations = false;
+		REQUIRE( huge_result == false );
+		REQUIRE( largest_allocation < 1024 * 1024 );
+		REQUIRE( huge_decoder.get_corrupt_blocks() == 1 );
+		REQUIRE( huge_decoded.str() == expected_decoded );
+
+		// Entries larger than what the decoder reads at a time, from more threads than
+		// there are thread numbers
+		std::string binary_path = "log_tests_binary_threads.bin";
+		std::remove(binary_path.c_str());
+		{
+			PSILog thread_log;
+			thread_log.add_output(make_unique<PSILogBinaryOutput>(binary_path.c_str()));
+
+			std::string large(200 * 1024, 'x');
+			thread_log(PSILog::INFO) << large << "\n";
+
+			for (int i = 0; i < 65540; i++) {
+				std::thread t([&thread_log, i] {
+					if (i == 0 || i >= 65535) {
+						PSILOG_DEFERRED(thread_log, PSILog::INFO, "Thread {}", i);
+					} else {
+						PSILOG_DEFERRED(thread_log, PSILog::INFO, "Quiet thread {}", i);
+					}
+				});
+				t.join();
+			}
+			thread_log(PSILog::INFO) << "Main thread\n";
+		}
+
+		std::ifstream in(binary_path.c_str(), std::ios::binary);
+		std::ostringstream thread_decoded;
+		PSILogBinaryDecoder thread_decoder;
+		REQUIRE( thread_decoder.decode(in, thread_decoded) == true );
+		REQUIRE( thread_decoder.get_entry_count() == 65542 );
+		in.close();
+
+		// Each entry has the id of the thread that logged it, not of one with the same number
+		std::istringstream lines(thread_decoded.str());
+		std::string line;
+		std::getline(lines, line);
+		std::string main_thread = line.substr(11, line.find("] ", 11) - 10);
+		REQUIRE( line.size() == 11 + main_thread.size() + 1 + 200 * 1024 );
+
+		size_t thread_entries = 0;
+		std::string last;
+		while (std::getline(lines, line)) {
+			if (line.find("] Thread ") != std::string::npos) {
+				REQUIRE( line.substr(11, main_thread.size()) != main_thread );
+				thread_entries++;
+			}
+			last = line;
+		}
+		REQUIRE( thread_entries == 6 );
+		REQUIRE_THAT( last, Catch::EndsWith("] Main thread") );
+		REQUIRE( last.substr(11, main_thread.size()) == main_thread );
+
+		std::remove(binary_path.c_str());
+	}
+
+	SECTION("Memory mapped segment output") {
+		std::string mmap_path = "log_tests_mmap";
+		const int thread_count = 4;
+		const int entries_per_thread = 1000;
+		std::vector<std::string> segment_paths;
+
+		{
+			PSILog mmap_log;
+			auto output = make_unique<PSILogMmapOutput>(mmap_path.c_str(), 4096);
+			PSILogMmapOutput *mmap_output = output.get();
+			mmap_log.add_output(move(output));
+			mmap_log.set_add_prefix(false);
+
+			// Entries longer than a segment don't fit anywhere
+			REQUIRE( mmap_output->write_log_entry(std::string(8192, 'x'), PSILog::INFO) == false );
+
+			std::vector<std::thread> threads;
+			for (int t = 0; t < thread_count; t++) {
+				threads.emplace_back([&mmap_log, t, entries_per_thread] {
+					for (int i = 0; i < entries_per_thread; i++) {
+						mmap_log(PSILog::INFO) << "Thread " << t << " entry " << i << "\n";
+					}
+				});
+			}
+			for (auto &thread : threads) {
+				thread.join();
+			}
+
+			for (unsigned index = 0; ; index++) {
+				std::string path = mmap_output->get_segment_path(index);
+				std::ifstream in(path.c_str());
+				if (in.good() == false) {
+					break;
+				}
+				segment_paths.push_back(path);
+			}
+		}
+
+		// Every entry is in one of the segments, whole and in order per thread
+		REQUIRE( segment_paths.size() > 1 );
+		std::vector<int> next_entry(thread_count, 0);
+		for (const auto &path : segment_paths) {
+			std::ifstream in(path.c_str());
+			std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			REQUIRE( contents.size() <= 4096 );
+			REQUIRE( contents.find('\0') == std::string::npos );
+
+			std::istringstream lines(contents);
+			std::string word;
+			int t, i;
+			while (lines >> word >> t >> word >> i) {
+				REQUIRE( i == next_entry[t] );
+				next_entry[t]++;
+			}
+			std::remove(path.c_str());
+		}
+
+		for (int t = 0; t < thread_count; t++) {
+			REQUIRE( next_entry[t] == entries_per_thread );
+		}
+	}
+
+	SECTION("Memory mapped segment output keeps every entry of concurrently switched segments") {
+		std::string mmap_path = "log_tests_mmap_switch";
+		const int thread_count = 8;
+		const int entries_per_thread = 5000;
+		for (unsigned index = 0; index < 10000; index++) {
+			char suffix[16];
+			snprintf(suffix, sizeof(suffix), ".%06u", index);
+			std::remove((mmap_path + suffix).c_str());
+		}
+
+		// Small segments, so that writers keep racing to switch them
+		std::vector<std::string> segment_paths;
+		{
+			PSILogMmapOutput output(mmap_path.c_str(), 256);
+			std::atomic<int> started { 0 };
+			std::vector<std::thread> threads;
+			for (int t = 0; t < thread_count; t++) {
+				threads.emplace_back([&output, &started, t, thread_count, entries_per_thread] {
+					started++;
+					while (started.load() < thread_count) {
+						std::this_thread::yield();
+					}
+
+					for (int i = 0; i < entries_per_thread; i++) {
+						std::string entry = "Thread " + std::to_string(t) + " entry " + std::to_string(i) + "\n";
+						while (output.write_log_entry(entry, PSILog::INFO) == false) {
+							std::this_thread::yield();
+						}
+					}
+				});
+			}
+			for (auto &thread : threads) {
+				thread.join();
+			}
+
+			for (unsigned index = 0; ; index++) {
+				std::string path = output.get_segment_path(index);
+				if (access(path.c_str(), F_OK) != 0) {
+					break;
+				}
+				segment_paths.push_back(path);
+			}
+		}
+
+		std::vector<int> next_entry(thread_count, 0);
+		for (const auto &path : segment_paths) {
+			std::ifstream in(path.c_str());
+			std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			REQUIRE( contents.find('\0') == std::string::npos );
+
+			std::istringstream lines(contents);
+			std::string word;
+			int t, i;
+			while (lines >> word >> t >> word >> i) {
+				REQUIRE( i == next_entry[t] );
+				next_entry[t]++;
+			}
+			std::remove(path.c_str());
+		}
+
+		for (int t = 0; t < thread_count; t++) {
+			REQUIRE( next_entry[t] == entries_per_thread );
+		}
+	}
+
+	SECTION("Memory mapped segment output recovers from failing to map a segment") {
+		std::string mmap_path = "log_tests_mmap_retry";
+		std::string entry(100, '.');
+		entry.back() = '\n';
+
+		// A directory in the place of the next segment file fails mapping it
+		std::remove((mmap_path + ".000000").c_str());
+		REQUIRE( mkdir((mmap_path + ".000001").c_str(), 0755) == 0 );
+
+		{
+			PSILogMmapOutput output(mmap_path.c_str(), 4096);
+			for (int i = 0; i < 40; i++) {
+				REQUIRE( output.write_log_entry(entry, PSILog::INFO) == true );
+			}
+
+			// The full segment stays, and the entries not fitting are dropped
+			REQUIRE( output.write_log_entry(entry, PSILog::INFO) == false );
+			REQUIRE( output.write_log_entry(entry, PSILog::INFO) == false );
+
+			// Once the segment can be mapped, writing continues in it
+			REQUIRE( rmdir((mmap_path + ".000001").c_str()) == 0 );
+			bool written = false;
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+			while (written == false && std::chrono::steady_clock::now() < deadline) {
+				written = output.write_log_entry("Recovered\n", PSILog::INFO);
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			REQUIRE( written == true );
+		}
+
+		std::ifstream first((mmap_path + ".000000").c_str());
+		std::string contents((std::istreambuf_iterator<char>(first)), std::istreambuf_iterator<char>());
+		REQUIRE( contents.size() == 4000 );
+
+		std::ifstream second((mmap_path + ".000001").c_str());
+		contents.assign((std::istreambuf_iterator<char>(second)), std::istreambuf_iterator<char>());
+		REQUIRE( contents == "Recovered\n" );
+
+		std::remove((mmap_path + ".000000").c_str());
+		std::remove((mmap_path + ".000001").c_str());
+	}
+
+	SECTION("Memory mapped ring output") {
+		std::string ring_path = "log_tests_ring";
+		std::remove(ring_path.c_str());
+
+		{
+			PSILog ring_log;
+			auto output = make_unique<PSILogRingOutput>(ring_path.c_str(), 4096);
+			PSILogRingOutput *ring_output = output.get();
+			REQUIRE( ring_output->good() == true );
+			REQUIRE( ring_output->get_capacity() % 4096 == 0 );
+			ring_log.add_output(move(output));
+			ring_log.set_add_prefix(false);
+
+			for (int i = 0; i < 1000; i++) {
+				ring_log(PSILog::INFO) << "Ring entry " << i << "\n";
+			}
+
+			// The entries are in the file while the output is still writing,
+			// the latest ones in order, up to the capacity
+			PSILogRingReader reader;
+			REQUIRE( reader.read(ring_path) == true );
+			const auto &entries = reader.get_entries();
+			REQUIRE( reader.get_corrupt_regions() == 0 );
+			REQUIRE( entries.size() > 10 );
+			REQUIRE( entries.size() * 48 <= ring_output->get_capacity() );
+			int first = 1000 - (int)entries.size();
+			for (size_t i = 0; i < entries.size(); i++) {
+				REQUIRE( entries[i].text == "Ring entry " + std::to_string(first + i) + "\n" );
+				REQUIRE( entries[i].log_level == PSILog::INFO );
+			}
+		}
+
+		// Damaging a record loses only that record
+		PSILogRingReader reader;
+		REQUIRE( reader.read(ring_path) == true );
+		size_t entry_count = reader.get_entries().size();
+		uint64_t damaged = reader.get_entries()[entry_count / 2].position;
+		{
+			std::fstream fs(ring_path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+			fs.seekp(PSILOG_RING_HEADER_SIZE + damaged % 4096 + PSILOG_RING_RECORD_HEADER_SIZE);
+			fs.put('#');
+		}
+		REQUIRE( reader.read(ring_path) == true );
+		REQUIRE( reader.get_entries().size() == entry_count - 1 );
+		REQUIRE( reader.get_corrupt_regions() == 1 );
+
+		// Opening the ring again continues after the entries of the previous run
+		{
+			PSILog ring_log;
+			ring_log.add_output(make_unique<PSILogRingOutput>(ring_path.c_str(), 4096));
+			ring_log.set_add_prefix(false);
+			ring_log.set_filter(PSILog::ALL);
+			ring_log(PSILog::ERR) << "After restart\n";
+		}
+		REQUIRE( reader.read(ring_path) == true );
+		REQUIRE( reader.get_entries().back().text == "After restart\n" );
+		REQUIRE( reader.get_entries().back().log_level == PSILog::ERR );
+		REQUIRE( reader.get_entries()[reader.get_entries().size() - 2].text == "Ring entry 999\n" );
+
+		std::remove(ring_path.c_str());
+	}
+
+	SECTION("Backtrace of filtered out entries") {
+		std::ostringstream dest;
+		log.add_output(move(make_unique<PSILogStringOutput>(dest)));
+		log.set_add_prefix(false);
+		log.set_filter(PSILog::INFO | PSILog::ERR);
+		log.set_backtrace(3, PSILog::FREQ);
+		REQUIRE( log.get_backtrace_size() == 3 );
+		REQUIRE( log.is_logged(PSILog::FREQ) == true );
+		REQUIRE( log.is_logged(PSILog::WARN) == false );
+
+		log(PSILog::FREQ) << "Frequent 1\n";
+		log(PSILog::FREQ) << "Frequent 2\n";
+		log.freq(PSILOG_FMT("Frequent {}"), 3);
+		log(PSILog::INFO) << "Info\n";
+		PSILOG_DEFERRED(log, PSILog::FREQ, "Frequent {}", 4);
+		log(PSILog::WARN) << "Warning, not kept\n";
+		REQUIRE( dest.str() == "Info\n" );
+
+		// Kept entries of other threads stay with them
+		std::thread([&log] { log(PSILog::FREQ) << "Other thread\n"; }).join();
+
+		// The latest kept entries come before the error, once
+		log(PSILog::ERR) << "Error\n";
+		log(PSILog::ERR) << "Second error\n";
+		REQUIRE( dest.str() == "Info\nFrequent 2\nFrequent 3\nFrequent 4\nError\nSecond error\n" );
+
+		// Also when asynchronous
+		dest.str("");
+		log.set_async(true);
+		log(PSILog::FREQ) << "Async frequent\n";
+		log.error(PSILOG_FMT("Async error"));
+		log.flush();
+		log.set_async(false);
+		REQUIRE( dest.str() == "Async frequent\nAsync error\n" );
+
+		// Disabled backtrace drops filtered entries again
+		dest.str("");
+		log.set_backtrace(0);
+		log(PSILog::FREQ) << "Dropped\n";
+		log(PSILog::ERR) << "Error\n";
+		REQUIRE( dest.str() == "Error\n" );
+	}
+
+	SECTION("Backtraces of short lived threads don't register rings") {
+		std::ostringstream dest;
+		log.add_output(move(make_unique<PSILogStringOutput>(dest)));
+		log.set_add_prefix(false);
+		log.set_filter(PSILog::INFO | PSILog::ERR);
+		log.set_backtrace(8, PSILog::FREQ);
+
+		// Threads logging synchronously keep their backtrace to themselves
+		for (int i = 0; i < 2000; i++) {
+			std::thread([&log, i] { log(PSILog::FREQ) << "Thread " << i << "\n"; }).join();
+		}
+		REQUIRE( log.get_async_ring_count() == 0 );
+
+		std::thread([&log] {
+			log(PSILog::FREQ) << "Kept\n";
+			log(PSILog::ERR) << "Error\n";
+		}).join();
+		REQUIRE( dest.str() == "Kept\nError\n" );
+		REQUIRE( log.get_async_ring_count() == 0 );
+
+		// Asynchronous threads do, and their rings are freed once they exit
+		log.set_async(true);
+		std::thread([&log] { log(PSILog::INFO) << "Async\n"; }).join();
+		log.set_async(false);
+		REQUIRE( log.get_async_ring_count() == 0 );
+		REQUIRE( dest.str() == "Kept\nError\nAsync\n" );
+	}
+
+	SECTION("Crash handler writes the pending entries") {
+		std::string crash_path = "log_tests_crash.txt";
+		std::remove(crash_path.c_str());
+
+		// Crash a child process with buffered and queued entries
+		pid_t pid = fork();
+		REQUIRE( pid >= 0 );
+		if (pid == 0) {
+			PSILog crash_log;
+			std::atomic<bool> blocked { false };
+			crash_log.add_output(make_unique<PSILogBlockingOutput>(blocked));
+			auto output = make_unique<PSILogFileOutput>(crash_path.c_str());
+			output->set_flush_bytes(1024 * 1024);
+			output->set_flush_levels(PSILog::NONE);
+			crash_log.add_output(move(output));
+			crash_log.set_add_prefix(false);
+			crash_log.install_crash_handler();
+
+			for (int i = 0; i < 100; i++) {
+				crash_log(PSILog::INFO) << "Buffered entry " << i << "\n";
+			}
+
+			// The writer thread gets stuck with the first batch of queued entries, if it gets to them
+			blocked = true;
+			crash_log.set_async(true);
+			for (int i = 0; i < 100; i++) {
+				PSILOG_DEFERRED(crash_log, PSILog::INFO, "Queued entry {}", i);
+			}
+			abort();
+		}
+
+		int status = 0;
+		REQUIRE( waitpid(pid, &status, 0) == pid );
+		REQUIRE( WIFSIGNALED(status) == true );
+		REQUIRE( WTERMSIG(status) == SIGABRT );
+
+		std::ifstream in(crash_path.c_str());
+		std::vector<std::string> lines;
+		std::string line;
+		while (std::getline(in, line)) {
+			lines.push_back(line);
+		}
+		in.close();
+
+		REQUIRE( lines.size() > 101 );
+		REQUIRE( lines.size() <= 201 );
+		for (int i = 0; i < 100; i++) {
+			REQUIRE( lines[i] == "Buffered entry " + std::to_string(i) );
+		}
+		// The batch the writer thread got stuck with is lost, it's the first one unless
+		// the writer thread woke up only while the crash handler was writing
+		int previous = -1;
+		for (size_t i = 100; i + 1 < lines.size(); i++) {
+			REQUIRE( lines[i].compare(0, 13, "Queued entry ") == 0 );
+			int queued = std::stoi(lines[i].substr(13));
+			REQUIRE( queued > previous );
+			REQUIRE( (queued == previous + 1 || queued - previous - 1 == 201 - (int)lines.size()) );
+			previous = queued;
+		}
+		REQUIRE( (previous == 99 || previous == (int)lines.size() - 102) );
+		REQUIRE( lines.back() == "*** Crashed with SIGABRT (6), pending log entries written ***" );
+
+		std::remove(crash_path.c_str());
+	}
+
+	SECTION("Crash handler renders the queued entries without allocating") {
+		std::string crash_path = "log_tests_crash_render.txt";
+		std::remove(crash_path.c_str());
+
+		pid_t pid = fork();
+		REQUIRE( pid >= 0 );
+		if (pid == 0) {
+			signal(SIGABRT, exit_with_allocation_count);
+
+			PSILog crash_log;
+			std::atomic<bool> blocked { false };
+			crash_log.add_output(make_unique<PSILogBlockingOutput>(blocked));
+			crash_log.add_output(make_unique<PSILogFileOutput>(crash_path.c_str()));
+			crash_log.install_crash_handler();
+
+			// Logged from another thread, whose id text the crash handler hasn't rendered
+			std::atomic<int> step { 0 };
+			std::thread t([&crash_log, &step] {
+				crash_log(PSILog::INFO) << "Written entry\n";
+				step = 1;
+				while (step.load() != 2) {
+					std::this_thread::yield();
+				}
+
+				for (int i = 0; i < 200; i++) {
+					PSILOG_DEFERRED(crash_log, PSILog::INFO, "Queued entry {} {} {} {} {{}}", i, -5, 2.5, "text");
+				}
+			});
+
+			while (step.load() != 1) {
+				std::this_thread::yield();
+			}
+			blocked = true;
+			crash_log.set_async(true);
+			step = 2;
+			t.join();
+
+			count_allocations = true;
+			allocation_count = 0;
+			abort();
+		}
+
+		int status = 0;
+		REQUIRE( waitpid(pid, &status, 0) == pid );
+		REQUIRE( WIFEXITED(status) == true );
+		REQUIRE( WEXITSTATUS(status) == 0 );
+
+		std::ifstream in(crash_path.c_str());
+		std::vector<std::string> lines;
+		std::string line;
+		while (std::getline(in, line)) {
+			lines.push_back(line);
+		}
+		in.close();
+
+		// The queued entries have the same prefix as the one rendered by the logger
+		REQUIRE( lines.size() > 2 );
+		size_t prefix_length = lines[0].find("Written entry");
+		REQUIRE( prefix_length != std::string::npos );
+		std::string thread_text = lines[0].substr(11, prefix_length - 11);
+
+		for (size_t i = 1; i + 1 < lines.size(); i++) {
+			REQUIRE( lines[i].size() > prefix_length );
+			REQUIRE( lines[i][0] == '[' );
+			REQUIRE( lines[i][3] == ':' );
+			REQUIRE( lines[i][6] == ':' );
+			REQUIRE( lines[i].substr(9, 2) == "] " );
+			REQUIRE( lines[i].substr(11, prefix_length - 11) == thread_text );
+
+			std::string message = lines[i].substr(prefix_length);
+			REQUIRE( message.compare(0, 13, "Queued entry ") == 0 );
+			std::string number = std::to_string(std::stoi(message.substr(13)));
+			REQUIRE( message == "Queued entry " + number + " -5 2.5 text {}" );
+		}
+		REQUIRE( lines.back().find("*** Crashed with SIGABRT (6), pending log entries written ***") != std::string::npos );
+
+		std::remove(crash_path.c_str());
+	}
+
+	SECTION("Outputs are added and removed while logging") {
+		std::atomic<size_t> entries(0);
+		std::atomic<size_t> temporary_entries(0);
+		std::atomic<size_t> destroyed(0);
+		log.add_output(move(make_unique<PSILogSharedCountingOutput>(entries, destroyed)));
+		REQUIRE( log.get_output_count() == 1 );
+
+		auto t_func = [&log] {
+			for (int i = 0; i < 2000; i++) {
+				log(PSILog::INFO) << "Entry " << i << "\n";
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (int i = 0; i < 4; i++) {
+			threads.emplace_back(t_func);
+		}
+
+		// A temporary output comes and goes under load
+		for (int i = 0; i < 50; i++) {
+			auto temporary = make_unique<PSILogSharedCountingOutput>(temporary_entries, destroyed);
+			PSILogOutput *temporary_ptr = temporary.get();
+			log.add_output(move(temporary));
+			std::this_thread::yield();
+			REQUIRE( log.remove_output(temporary_ptr) == true );
+		}
+
+		for (auto &thread : threads) {
+			thread.join();
+		}
+
+		// Every entry reached the permanent output, and the removed ones are gone
+		REQUIRE( entries == 8000 );
+		REQUIRE( temporary_entries <= 8000 );
+		REQUIRE( destroyed == 50 );
+		REQUIRE( log.get_output_count() == 1 );
+
+		PSILogSharedCountingOutput stranger(entries, destroyed);
+		REQUIRE( log.remove_output(&stranger) == false );
+
+		// Also with the writer thread writing
+		log.set_async(true);
+		auto temporary = make_unique<PSILogSharedCountingOutput>(temporary_entries, destroyed);
+		PSILogOutput *temporary_ptr = temporary.get();
+		log.add_output(move(temporary));
+		temporary_entries = 0;
+		log(PSILog::INFO) << "To both\n";
+		log.flush();
+		REQUIRE( temporary_entries == 1 );
+		REQUIRE( log.remove_output(temporary_ptr) == true );
+		log(PSILog::INFO) << "To one\n";
+		log.flush();
+		REQUIRE( temporary_entries == 1 );
+		REQUIRE( entries == 8002 );
+		log.set_async(false);
+	}
+
+	SECTION("Stalled output on a worker thread doesn't hold up the others") {
+		std::ostringstream dest;
+		std::ostringstream stalled_dest;
+		std::atomic<bool> blocked(true);
+
+		auto worker = make_unique<PSILogWorkerOutput>(make_unique<PSILogStalledOutput>(stalled_dest, blocked), 16);
+		PSILogWorkerOutput *worker_ptr = worker.get();
+		REQUIRE( worker_ptr->get_queue_size() == 16 );
+		REQUIRE( worker_ptr->get_overflow() == PSILog::OVERFLOW_DROP_NEWEST );
+		log.add_output(move(worker));
+		log.add_output(move(make_unique<PSILogStringOutput>(dest)));
+		log.set_add_prefix(false);
+
+		// The worker thread gets stuck with the first entries, the rest fill the
+		// queue and get dropped, while the other output gets everything
+		for (int i = 0; i < 100; i++) {
+			log(PSILog::INFO) << "Entry " << i << "\n";
+		}
+		std::string contents = dest.str();
+		REQUIRE( std::count(contents.begin(), contents.end(), '\n') == 100 );
+		REQUIRE( worker_ptr->get_queued() <= 16 );
+		REQUIRE( worker_ptr->get_dropped() > 0 );
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		REQUIRE( worker_ptr->get_lag() >= std::chrono::milliseconds(20) );
+
+		// Once the output recovers, the queued entries are written in order, each
+		// batch followed by a note about the entries dropped while it waited
+		blocked = false;
+		log.flush();
+		REQUIRE( worker_ptr->get_queued() == 0 );
+		REQUIRE( worker_ptr->get_lag() == std::chrono::nanoseconds(0) );
+		REQUIRE( worker_ptr->get_max_lag() >= std::chrono::milliseconds(20) );
+		REQUIRE( worker_ptr->get_written() + worker_ptr->get_dropped() == 100 );
+
+		std::string stalled = stalled_dest.str();
+		REQUIRE_THAT( stalled, Catch::StartsWith("Entry 0\n") );
+
+		std::istringstream stalled_lines(stalled);
+		std::string line;
+		uint64_t written = 0;
+		uint64_t dropped = 0;
+		int previous = -1;
+		while (std::getline(stalled_lines, line)) {
+			if (line.compare(0, 6, "Entry ") == 0) {
+				int entry = std::stoi(line.substr(6));
+				REQUIRE( entry > previous );
+				previous = entry;
+				written++;
+			} else {
+				REQUIRE_THAT( line, Catch::EndsWith(" messages dropped") );
+				dropped += std::stoull(line);
+			}
+		}
+		REQUIRE( written == worker_ptr->get_written() );
+		REQUIRE( dropped == worker_ptr->get_dropped() );
+
+		// Blocking when full loses nothing
+		worker_ptr->set_overflow(PSILog::OVERFLOW_BLOCK);
+		for (int i = 0; i < 100; i++) {
+			log(PSILog::INFO) << "Blocking entry " << i << "\n";
+		}
+		log.flush();
+		REQUIRE_THAT( stalled_dest.str(), Catch::EndsWith("Blocking entry 98\nBlocking entry 99\n") );
+		REQUIRE( worker_ptr->get_written() + worker_ptr->get_dropped() == 200 );
+	}
+
+	SECTION("Failing and slow outputs trip their breakers") {
+		std::ostringstream dest;
+		std::ostringstream failing_dest;
+		std::ostringstream slow_dest;
+		std::atomic<bool> failing(true);
+
+		auto flaky = make_unique<PSILogFailingOutput>(failing_dest, failing);
+		flaky->set_name("flaky");
+		flaky->get_breaker().set_thresholds(3, std::chrono::nanoseconds(0), std::chrono::milliseconds(20));
+		PSILogOutput *flaky_ptr = flaky.get();
+		REQUIRE( flaky_ptr->get_breaker().get_enabled() == true );
+		log.add_output(move(flaky));
+
+		// Every write takes at least 1ms
+		auto slow = make_unique<PSILogSlowOutput>(slow_dest);
+		slow->get_breaker().set_thresholds(2, std::chrono::microseconds(500), std::chrono::hours(1));
+		PSILogOutput *slow_ptr = slow.get();
+		log.add_output(move(slow));
+
+		auto healthy = make_unique<PSILogStringOutput>(dest);
+		REQUIRE( healthy->get_breaker().get_enabled() == false );
+		log.add_output(move(healthy));
+		log.set_add_prefix(false);
+
+		// Both trip, and the healthy output hears about it before the entry tripping them
+		for (int i = 0; i < 10; i++) {
+			log(PSILog::INFO) << "Entry " << i << "\n";
+		}
+		REQUIRE( flaky_ptr->get_breaker().get_tripped() == true );
+		REQUIRE( flaky_ptr->get_breaker().get_trips() == 1 );
+		REQUIRE( flaky_ptr->get_breaker().get_skipped() == 7 );
+		REQUIRE( slow_ptr->get_breaker().get_tripped() == true );
+		REQUIRE( slow_ptr->get_breaker().get_skipped() == 8 );
+		REQUIRE( failing_dest.str().empty() == true );
+		REQUIRE( slow_dest.str() == "Entry 0\nEntry 1\n" );
+		REQUIRE( dest.str() ==
+			 "Entry 0\n"
+			 "Log output #2 tripped after 2 failed or slow writes, skipping it\n"
+			 "Entry 1\n"
+			 "Log output flaky tripped after 3 failed or slow writes, skipping it\n"
+			 "Entry 2\nEntry 3\nEntry 4\nEntry 5\nEntry 6\nEntry 7\nEntry 8\nEntry 9\n" );
+
+		// A failed probe keeps the breaker tripped
+		std::this_thread::sleep_for(std::chrono::milliseconds(25));
+		log(PSILog::INFO) << "Probe 0\n";
+		REQUIRE( flaky_ptr->get_breaker().get_tripped() == true );
+
+		// The first successful probe closes it, the recovery goes to the output too
+		failing = false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(25));
+		dest.str("");
+		log(PSILog::INFO) << "Probe 1\n";
+		log(PSILog::INFO) << "Entry 10\n";
+		REQUIRE( flaky_ptr->get_breaker().get_tripped() == false );
+		REQUIRE( flaky_ptr->get_breaker().get_trips() == 1 );
+		REQUIRE( failing_dest.str() == "Probe 1\nLog output flaky recovered, 7 entries skipped\nEntry 10\n" );
+		REQUIRE( dest.str() == "Log output flaky recovered, 7 entries skipped\nProbe 1\nEntry 10\n" );
+		REQUIRE( slow_dest.str() == "Entry 0\nEntry 1\n" );
+	}
+
+	SECTION("Asynchronous output") {
+		std::ostringstream dest;
+		log.add_output(move(make_unique<PSILogStringOutput>(dest)));
+		log.set_add_prefix(false);
+		log.set_async(true);
+		REQUIRE( log.get_async() == true );
+
+		// Log from multiple threads, everything should be written after flush()
+		auto t_func = [&log] (int id) {
+			for (int i=0; i<100; i++) {
+				log(PSILog::INFO) << "Thread " << id << " entry " << i << "\n";
+			}
+		};
+
+		std::thread t1(t_func, 1);
+		std::thread t2(t_func, 2);
+		t1.join();
+		t2.join();
+		log.flush();
+
+		std::string contents = dest.str();
+		REQUIRE( std::count(contents.begin(), contents.end(), '\n') == 200 );
+		REQUIRE_THAT( contents, Catch::Contains("Thread 1 entry 99\n") );
+		REQUIRE_THAT( contents, Catch::Contains("Thread 2 entry 99\n") );
+
+		// Disabling drains the queue, and we are back to logging synchronously
+		log(PSILog::INFO) << "Last asynchronous entry\n";
+		log.set_async(false);
+		REQUIRE( log.get_async() == false );
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("Last asynchronous entry\n", Catch::CaseSensitive::Yes) );
+
+		log(PSILog::INFO) << "Synchronous entry\n";
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("Synchronous entry\n", Catch::CaseSensitive::Yes) );
+	}
+
+	SECTION("Asynchronous output renders the ids of more threads than it caches") {
+		std::ostringstream dest;
+		log.add_output(move(make_unique<PSILogStringOutput>(dest)));
+		log.set_async(true);
+
+		// All alive at once, so that each has its own id, and their indexes share cache slots
+		const int thread_count = 600;
+		std::vector<std::string> expected(thread_count);
+		std::vector<std::thread> threads;
+		std::atomic<int> started { 0 };
+		for (int i = 0; i < thread_count; i++) {
+			threads.emplace_back([&log, &expected, &started, i] {
+				std::ostringstream ss;
+				ss << "] [" << std::this_thread::get_id() << "] Thread " << i << "\n";
+				expected[i] = ss.str();
+				started++;
+				while (started.load() < thread_count) {
+					std::this_thread::yield();
+				}
+
+				for (int round = 0; round < 2; round++) {
+					log(PSILog::INFO) << "Thread " << i << "\n";
+				}
+			});
+		}
+		for (auto &t : threads) {
+			t.join();
+		}
+		log.flush();
+
+		std::string contents = dest.str();
+		REQUIRE( std::count(contents.begin(), contents.end(), '\n') == 2 * thread_count );
+		for (int i = 0; i < thread_count; i++) {
+			size_t first = contents.find(expected[i]);
+			REQUIRE( first != std::string::npos );
+			REQUIRE( contents.find(expected[i], first + 1) != std::string::npos );
+		}
+	}
+
+	SECTION("Asynchronous output writes batches") {
+		std::ostringstream dest;
+		size_t batches = 0;
+		std::atomic<bool> blocked(true);
+		auto file_output = make_unique<PSILogFileOutput>(log_path.c_str());
+		file_output->set_flush_bytes(4096);
+		log.add_output(move(make_unique<PSILogBlockingOutput>(blocked)));
+		log.add_output(move(make_unique<PSILogBatchCountingOutput>(dest, batches)));
+		log.add_output(move(file_output));
+		log.set_add_prefix(false);
+		log.set_async_queue_size(512);
+		log.set_async(true);
+
+		// The entries pile up while the writer thread is stuck, and are written in batches after
+		for (int i = 0; i < 200; i++) {
+			log(PSILog::INFO) << "Batched entry " << i << "\n";
+		}
+		blocked = false;
+		log.flush();
+
+		std::string contents = dest.str();
+		REQUIRE( std::count(contents.begin(), contents.end(), '\n') == 200 );
+		REQUIRE_THAT( contents, Catch::EndsWith("Batched entry 199\n") );
+		REQUIRE( batches < 200 );
+
+		std::ifstream in(log_path.c_str());
+		std::string line;
+		int lines = 0;
+		while (std::getline(in, line)) {
+			REQUIRE( line == "Batched entry " + std::to_string(lines) );
+			lines++;
+		}
+		REQUIRE( lines == 200 );
+	}
+
+	SECTION("Asynchronous output keeps each thread's entries in order") {
+		std::ostringstream dest;
+		log.add_output(move(make_unique<PSILogStringOutput>(dest)));
+		log.set_add_prefix(false);
+
+		// Small rings, so that the logging threads have to wait for the writer thread
+		log.set_async_queue_size(16);
+		log.set_async(true);
+
+		std::vector<std::thread> threads;
+		for (int id=0; id<8; id++) {
+			threads.emplace_back([&log, id] {
+				for (int i=0; i<500; i++) {
+					log(PSILog::INFO) << id << " " << i << "\n";
+				}
+			});
+		}
+
+		for (auto &t : threads) {
+			t.join();
+		}
+		log.flush();
+
+		// Every thread's entries should be there, in the order they were logged
+		std::vector<int> next(8, 0);
+		std::istringstream in(dest.str());
+		int id, i;
+		while (in >> id >> i) {
+			REQUIRE( i == next[id] );
+			next[id]++;
+		}
+
+		for (int count : next) {
+			REQUIRE( count == 500 );
+		}
+	}
+
+	SECTION("Asynchronous output is drained on destruction") {
+		std::ostringstream dest;
+		{
+			PSILog async_log;
+			async_log.add_output(move(make_unique<PSILogStringOutput>(dest)));
+			async_log.set_async_queue_size(4);
+			async_log.set_async(true);
+
+			for (int i=0; i<50; i++) {
+				async_log(PSILog::INFO) << "Entry " << i << "\n";
+			}
+		}
+
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("Entry 49\n", Catch::CaseSensitive::Yes) );
+	}
+
+	SECTION("Logging threads blocked on a full ring sleep until there is room") {
+		std::ostringstream dest;
+		PSILog block_log;
+		block_log.add_output(move(make_unique<PSILogSlowOutput>(dest)));
+		block_log.set_add_prefix(false);
+		block_log.set_async_queue_size(4);
+		block_log.set_async(true);
+
+		// The slow output keeps the ring full, waiting for it shouldn't use the CPU
+		struct timespec cpu_start, cpu_end;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+		auto start = std::chrono::steady_clock::now();
+		for (int i=0; i<200; i++) {
+			block_log(PSILog::INFO) << "Entry " << i << "\n";
+		}
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+		block_log.flush();
+
+		auto cpu = std::chrono::seconds(cpu_end.tv_sec - cpu_start.tv_sec) +
+			   std::chrono::nanoseconds(cpu_end.tv_nsec - cpu_start.tv_nsec);
+		REQUIRE( cpu < elapsed / 4 );
+
+		std::string expected;
+		for (int i=0; i<200; i++) {
+			expected += "Entry " + std::to_string(i) + "\n";
+		}
+		REQUIRE( dest.str() == expected );
+		REQUIRE( block_log.get_async_dropped() == 0 );
+	}
+
+	SECTION("Asynchronous overflow policies") {
+		for (int overflow : { PSILog::OVERFLOW_DROP_NEWEST, PSILog::OVERFLOW_DROP_OLDEST }) {
+			std::ostringstream dest;
+			PSILog drop_log;
+			drop_log.add_output(move(make_unique<PSILogSlowOutput>(dest)));
+			drop_log.set_add_prefix(false);
+			drop_log.set_async_queue_size(4);
+			drop_log.set_async_overflow(overflow);
+			drop_log.set_async(true);
+
+			for (int i=0; i<200; i++) {
+				drop_log(PSILog::INFO) << "Entry " << i << "\n";
+			}
+			drop_log.flush();
+
+			// Every entry is either written, or counted in a dropped report
+			int written = 0;
+			uint64_t dropped = 0;
+			std::istringstream in(dest.str());
+			std::string line;
+			while (std::getline(in, line)) {
+				if (line.compare(0, 6, "Entry ") == 0) {
+					written++;
+				} else {
+					REQUIRE_THAT( line, Catch::EndsWith(" messages dropped") );
+					dropped += std::stoull(line);
+				}
+			}
+
+			CAPTURE(overflow);
+			REQUIRE( dropped > 0 );
+			REQUIRE( dropped == drop_log.get_async_dropped() );
+			REQUIRE( written + dropped == 200 );
+
+			// Dropping the newest keeps the first entries, dropping the oldest the last ones
+			if (overflow == PSILog::OVERFLOW_DROP_NEWEST) {
+				REQUIRE_THAT( dest.str(), Catch::StartsWith("Entry 0\n") );
+			} else {
+				REQUIRE_THAT( dest.str(), Catch::Contains("Entry 199\n") );
+			}
+		}
+	}
+
+	SECTION("Deferred logging") {
+		std::ostringstream dest;
+		log.add_output(move(make_unique<PSILogStringOutput>(dest)));
+		log.set_filter(PSILog::INFO | PSILog::WARN);
+
+		std::string name = "Enterprise";
+		PSILOG_DEFERRED(log, PSILog::INFO, "Phaser {} ready in {} ms on {}, {{locked}}", 3, 2.5, name);
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("Phaser 3 ready in 2.5 ms on Enterprise, {locked}\n") );
+
+		// Filtered entries are not encoded or written at all
+		PSILOG_DEFERRED(log, PSILog::ERR, "Filtered {}", 1);
+		REQUIRE_THAT( dest.str(), !Catch::Contains("Filtered") );
+
+		// In asynchronous mode the text is rendered by the writer thread,
+		// with the prefix of the logging thread
+		log.set_async(true);
+		enum Warp { WARP_1 = 1, WARP_9 = 9 };
+		PSILOG_DEFERRED(log, PSILog::WARN, "Warp {} engaged, shields {} {}", WARP_9, true, "up");
+		PSILOG_DEFERRED(log, PSILog::INFO, "No arguments");
+		log.flush();
+
+		std::stringstream thread_id;
+		thread_id << "[" << std::this_thread::get_id() << "] ";
+		REQUIRE_THAT( dest.str(), Catch::Contains(thread_id.str() + "Warp 9 engaged, shields 1 up\n") );
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("No arguments\n") );
+
+		// Placeholders with a type are rendered like the format string methods render them
+		PSILOG_DEFERRED(log, PSILog::INFO, "{:s} at {:.2f}, hull {:x}, {:d} {:f} {{{}}}", name, 0.126, 255, -42, 1.5, 'c');
+		log.flush();
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("Enterprise at 0.13, hull ff, -42 1.500000 {c}\n") );
+		log.set_async(false);
+		PSILOG_DEFERRED(log, PSILog::INFO, "Hull {:x} {:x}", (int16_t)-1, (unsigned char)10);
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("Hull ffff a\n") );
+
+		// Placeholders the renderer doesn't support fail the build, as do the others
+		// not matching the arguments:
+		// PSILOG_DEFERRED(log, PSILog::INFO, "Padded {:08d}", 1);
+		// PSILOG_DEFERRED(log, PSILog::INFO, "Hex {:x}", 1.5);
+		// PSILOG_DEFERRED(log, PSILog::INFO, "Two {} {}", 1);
+		auto padded = PSILOG_FMT("Padded {:08d}");
+		REQUIRE( PSILogCompiledFormat<decltype(padded)>::parsed.valid == false );
+		auto hex = PSILOG_FMT("Hex {:x}");
+		REQUIRE( PSILogCompiledFormat<decltype(hex)>::parsed.valid == true );
+	}
+
+	SECTION("Format string logging") {
+		std::ostringstream dest;
+		log.add_output(move(make_unique<PSILogStringOutput>(dest)));
+		log.set_filter(PSILog::ALL);
+		log.set_add_prefix(false);
+
+		log.info(PSILOG_FMT("Phaser {} ready in {} ms"), 3, 2.5);
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("Phaser 3 ready in 2.5 ms\n") );
+
+		std::string name = "Enterprise";
+		log.warn(PSILOG_FMT("{:s} at {:.2f}, hull {:x}, {{{}}} {}"), name, 0.126, 255, -42, 'c');
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("Enterprise at 0.13, hull ff, {-42} c\n") );
+
+		// User types go through their stream operator
+		WarpDriveStatus status;
+		log.error(PSILOG_FMT("Status: {}"), status);
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("Status: warp drive online\n") );
+
+		log.set_filter(PSILog::INFO);
+		log.freq(PSILOG_FMT("Filtered {}"), 1);
+		REQUIRE_THAT( dest.str(), !Catch::Contains("Filtered") );
+
+		// Each of these fails the build:
+		// log.info(PSILOG_FMT("Two {} {}"), 1);
+		// log.info(PSILOG_FMT("Hex {:x}"), 1.5);
+		// log.info(PSILOG_FMT("Unmatched {"), 1);
+		// log.info("Not a compile time format {}", 1);
+	}
+
+	SECTION("Filtered entries are not formatted") {
+		std::ostringstream dest;
+		log.add_output(move(make_unique<PSILogStringOutput>(dest)));
+		log.set_filter(PSILog::INFO);
+
+		FormatCounter counter;
+		log(PSILog::FREQ) << "Frequent " << counter << std::endl;
+		REQUIRE( counter.count == 0 );
+		REQUIRE( log(PSILog::FREQ).get_enabled() == false );
+
+		log(PSILog::INFO) << "Info " << counter << std::hex << 255 << std::endl;
+		REQUIRE( counter.count == 1 );
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("Info countedff\n") );
+
+		// With PSILOG() the arguments are not even evaluated
+		int evaluated = 0;
+		auto expensive = [&evaluated] { evaluated++; return 42; };
+		PSILOG(log, PSILog::FREQ) << "Expensive " << expensive() << std::endl;
+		REQUIRE( evaluated == 0 );
+
+		if (evaluated == 0)
+			PSILOG(log, PSILog::INFO) << "Expensive " << expensive() << std::endl;
+		else
+			FAIL("PSILOG() should be safe to use in an if without braces");
+
+		REQUIRE( evaluated == 1 );
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("Expensive 42\n") );
+	}
+
+	SECTION("Compile time level stripping") {
+		std::ostringstream dest;
+		log.add_output(move(make_unique<PSILogStringOutput>(dest)));
+		log.set_filter(PSILog::ALL);
+		log.set_add_prefix(false);
+
+		// Levels outside PSILOG_COMPILED_LEVELS get a stream that does nothing
+		bool freq_compiled = psilog_level_compiled(PSILog::FREQ);
+		REQUIRE( freq_compiled == ((PSILOG_COMPILED_LEVELS & PSILog::FREQ) != 0) );
+		REQUIRE( std::is_same<decltype(log.stream<PSILog::FREQ>()), PSILogNullStream>::value == !freq_compiled );
+		REQUIRE( std::is_same<decltype(log.stream<PSILog::ERR>()), PSILogStream>::value );
+
+		log.stream<PSILog::ERR>() << "Error through the compile time entry point\n";
+		REQUIRE_THAT( dest.str(), Catch::EndsWith("Error through the compile time entry point\n") );
+
+		int evaluated = 0;
+		auto expensive = [&evaluated] { evaluated++; return 42; };
+		PSILOG(log, PSILog::FREQ) << "Frequent " << expensive() << "\n";
+		log.freq(PSILOG_FMT("Frequent {}"), 1);
+		PSILOG_DEFERRED(log, PSILog::FREQ, "Frequent {}", 2);
+
+		if (freq_compiled == true) {
+			REQUIRE( evaluated == 1 );
+			REQUIRE_THAT( dest.str(), Catch::EndsWith("Frequent 42\nFrequent 1\nFrequent 2\n") );
+		} else {
+			REQUIRE( evaluated == 0 );
+			REQUIRE_THAT( dest.str(), !Catch::Contains("Frequent") );
+		}
+	}
+
+	SECTION("Logging doesn't allocate once warmed up") {
+		size_t entries = 0;
+		size_t bytes = 0;
+		log.add_output(move(make_unique<PSILogCountingOutput>(entries, bytes)));
+		log.set_filter(PSILog::ALL);
+
+		auto log_entries = [&log] (int count) {
+			for (int i = 0; i < count; i++) {
+				log(PSILog::INFO) << "Stream entry " << i << " of " << 3.5 << " " << WarpDriveStatus() << "\n";
+				log.warn(PSILOG_FMT("Format entry {} of {}\n"), i, "many");
+				PSILOG_DEFERRED(log, PSILog::ERR, "Deferred entry {}", i);
+			}
+		};
+
+		// The first entries grow the thread local buffers
+		log_entries(10);
+
+		count_allocations = true;
+		allocation_count = 0;
+		log_entries(100);
+		count_allocations = false;
+
+		REQUIRE( allocation_count == 0 );
+		REQUIRE( entries == 330 );
+
+		// Entries longer than the initial stream buffer grow it
+		std::string long_text(PSILogStreamBuf::INITIAL_CAPACITY * 3, 'x');
+		log(PSILog::INFO) << long_text << "\n";
+		REQUIRE( entries == 331 );
+		REQUIRE( bytes > long_text.size() );
+
+		// Asynchronously the ring slots keep their strings, so once every slot has been
+		// used the logging thread doesn't allocate either
+		log.set_async_queue_size(16);
+		log.set_async(true);
+		log_entries(100);
+		log.flush();
+
+		count_allocations = true;
+		allocation_count = 0;
+		log_entries(100);
+		count_allocations = false;
+
+		log.flush();
+		REQUIRE( allocation_count == 0 );
+		REQUIRE( entries == 931 );
+		log.set_async(false);
+	}
+
+	SECTION("Outputs share the formatted entry") {
+		std::vector<const void *> addresses;
+		std::vector<const void *> retained_addresses;
+		log.add_output(move(make_unique<PSILogEntryAddressOutput>(addresses, false)));
+		log.add_output(move(make_unique<PSILogEntryAddressOutput>(addresses, false)));
+
+		auto retaining = make_unique<PSILogEntryAddressOutput>(retained_addresses, true);
+		auto retaining_other = make_unique<PSILogEntryAddressOutput>(retained_addresses, true);
+		const PSILogEntryAddressOutput *retaining_ptr = retaining.get();
+		const PSILogEntryAddressOutput *retaining_other_ptr = retaining_other.get();
+		log.add_output(move(retaining));
+		log.add_output(move(retaining_other));
+
+		log(PSILog::INFO) << "Shared entry\n";
+
+		// Every output gets the same string, and the outputs keeping
+		// entries share a single copy of it
+		REQUIRE( addresses.size() == 2 );
+		REQUIRE( addresses[0] == addresses[1] );
+		REQUIRE( retained_addresses.size() == 2 );
+		REQUIRE( retained_addresses[0] == retained_addresses[1] );
+		REQUIRE( retaining_ptr->get_kept().size() == 1 );
+		REQUIRE( retaining_ptr->get_kept()[0] == retaining_other_ptr->get_kept()[0] );
+		REQUIRE_THAT( *retaining_ptr->get_kept()[0], Catch::EndsWith("Shared entry\n") );
+	}
+
+	SECTION("Outputs render the records in their layouts") {
+		std::ostringstream text_dest;
+		std::ostringstream json_dest;
+		std::vector<const void *> addresses;
+		std::vector<PSILogRecordOutput::Kept> kept;
+		size_t renders = 0;
+		auto shared_layout = std::make_shared<PSILogCountingLayout>(renders);
+
+		auto json_output = make_unique<PSILogStringOutput>(json_dest);
+		json_output->set_layout(std::make_shared<PSILogJsonLayout>());
+		auto first = make_unique<PSILogEntryAddressOutput>(addresses, false);
+		auto second = make_unique<PSILogEntryAddressOutput>(addresses, false);
+		first->set_layout(shared_layout);
+		second->set_layout(shared_layout);
+
+		log.add_output(move(make_unique<PSILogStringOutput>(text_dest)));
+		log.add_output(move(json_output));
+		log.add_output(move(first));
+		log.add_output(move(second));
+		log.add_output(move(make_unique<PSILogRecordOutput>(kept)));
+		log.set_filter(PSILog::ALL);
+
+		log(PSILog::WARN) << "Shields at \"40%\"\n";
+		PSILOG_DEFERRED(log, PSILog::INFO, "Phaser {} ready", 3);
+
+		// The logger's layout has the prefix, the others render the same records their own way
+		REQUIRE_THAT( text_dest.str(), Catch::Contains("] Shields at \"40%\"\n") );
+		REQUIRE_THAT( text_dest.str(), Catch::EndsWith("] Phaser 3 ready\n") );
+		REQUIRE( text_dest.str()[0] == '[' );
+
+		std::string thread = std::to_string(psilog_thread_index());
+		std::string json = json_dest.str();
+		REQUIRE_THAT( json, Catch::StartsWith("{\"time\":") );
+		REQUIRE_THAT( json, Catch::Contains(",\"level\":\"WARN\",\"thread\":" + thread +
+			",\"message\":\"Shields at \\\"40%\\\"\"}\n") );
+		REQUIRE_THAT( json, Catch::Contains(",\"level\":\"INFO\",\"thread\":" + thread +
+			",\"file\":\"" + std::string(__FILE__) + "\",\"line\":") );
+		REQUIRE_THAT( json, Catch::EndsWith(",\"message\":\"Phaser 3 ready\"}\n") );
+
+		// Outputs sharing a layout share the text, rendered once for each entry
+		REQUIRE( renders == 2 );
+		REQUIRE( addresses.size() == 4 );
+		REQUIRE( addresses[0] == addresses[1] );
+
+		// The record output gets the fields, and the deferred entry is never rendered for it
+		REQUIRE( kept.size() == 2 );
+		REQUIRE( kept[0].log_level == PSILog::WARN );
+		REQUIRE( kept[0].message == "Shields at \"40%\"\n" );
+		REQUIRE( kept[0].site == nullptr );
+		REQUIRE( kept[1].message.empty() == true );
+		REQUIRE( kept[1].site != nullptr );
+		REQUIRE( kept[0].thread_index == psilog_thread_index() );
+
+		// Threads get their own indexes, and the writer thread renders the prefix
+		// of other threads with their ids
+		log.set_async(true);
+		uint32_t other_index = 0;
+		std::thread::id other_id;
+		std::thread other([&log, &other_index, &other_id] {
+			other_index = psilog_thread_index();
+			other_id = std::this_thread::get_id();
+			log(PSILog::INFO) << "From another thread\n";
+		});
+		other.join();
+		log.flush();
+
+		std::ostringstream other_text;
+		other_text << other_id;
+		REQUIRE( other_index != psilog_thread_index() );
+		REQUIRE( kept.size() == 3 );
+		REQUIRE( kept[2].thread_index == other_index );
+		REQUIRE_THAT( text_dest.str(), Catch::EndsWith("[" + other_text.str() + "] From another thread\n") );
+		log.set_async(false);
+	}
+
+	SECTION("Cached prefix matches the local time") {
+		std::thread::id thread_id = std::this_thread::get_id();
+		std::ostringstream thread_text;
+		thread_text << thread_id;
+
+		auto expected_prefix = [&thread_text] (std::time_t time) {
+			std::ostringstream ss;
+			struct tm tm;
+			localtime_r(&time, &tm);
+			ss << std::put_time(&tm, "[%H:%M:%S] ") << "[" << thread_text.str() << "] ";
+			return ss.str();
+		};
+
+		// Consecutive seconds reuse the cached offset, jumps and daylight saving time
+		// changes around 2018-03-25 01:00 UTC in Helsinki look it up again
+		const char *old_tz = getenv("TZ");
+		std::string saved_tz = old_tz != nullptr ? old_tz : "";
+		setenv("TZ", "Europe/Helsinki", 1);
+		tzset();
+
+		std::vector<std::time_t> times;
+		for (std::time_t time = 1521939600 - 3; time < 1521939600 + 3; time++) {
+			times.push_back(time);
+		}
+		times.push_back(1521939600 + 86400 * 100 + 59);
+		times.push_back(0);
+		times.push_back(std::time(nullptr));
+
+		for (std::time_t time : times) {
+			REQUIRE( log.get_log_entry_prefix(time, thread_id) == expected_prefix(time) );
+			REQUIRE( log.get_log_entry_prefix(time, thread_id) == expected_prefix(time) );
+		}
+
+		if (old_tz != nullptr) {
+			setenv("TZ", saved_tz.c_str(), 1);
+		} else {
+			unsetenv("TZ");
+		}
+		tzset();
+
+		// Other threads get their own id in the prefix
+		std::thread::id other_id;
+		std::thread other([&other_id] { other_id = std::this_thread::get_id(); });
+		other.join();
+		std::ostringstream other_text;
+		other_text << other_id;
+		REQUIRE_THAT( log.get_log_entry_prefix(0, other_id), Catch::EndsWith("[" + other_text.str() + "] ") );
+	}
 }
@@ -0,0 +1,48 @@
+// psilog_decode.cpp
+//
+// Turns binary logs written by PSILogBinaryOutput back into text
+// Usage: psilog-decode [--no-prefix] file...
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstring>
+
+#include "../PSILogBinaryOutput.h"
+
+int main(int argc, char **argv) {
+	bool add_prefix = true;
+	bool success = true;
+	int files = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--no-prefix") == 0) {
+			add_prefix = false;
+			continue;
+		}
+
+		std::ifstream in(argv[i], std::ios::binary);
+		if (in.good() == false) {
+			std::cerr << argv[i] << ": can't open file" << std::endl;
+			success = false;
+			continue;
+		}
+
+		PSILogBinaryDecoder decoder;
+		decoder.set_add_prefix(add_prefix);
+		if (decoder.decode(in, std::cout) == false) {
+			std::cerr << argv[i] << ": " << decoder.get_error() << std::endl;
+			success = false;
+		}
+		files++;
+	}
+
+	if (files == 0 && success == true) {
+		std::cerr << "Usage: " << argv[0] << " [--no-prefix] file..." << std::endl;
+		return 2;
+	}
+
+	return success == true ? 0 : 1;
+}
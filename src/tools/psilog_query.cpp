@@ -0,0 +1,147 @@
+// psilog_query.cpp
+//
+// Prints parts of a text log using its sparse index, see PSILogIndex.h
+// Usage: psilog-query [--from TIME] [--to TIME] [--seq FIRST LAST] [--range] file
+//
+// Times are seconds since the epoch, or local time as YYYY-MM-DDTHH:MM:SS. A time range
+// prints the entries between the index points around it, so it can include up to about
+// one index interval of entries outside the range at each end. A sequence range prints
+// exactly the entries numbered FIRST to LAST, an indexed log has one entry on each line.
+// FIRST before the first entry of the file is an error, it's in one of the rotated files.
+// With --range, only the byte range is printed.
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <climits>
+#include <stdint.h>
+
+#include "../PSILogIndex.h"
+
+// Parse the time as ns since the epoch, false if it's not a time
+static bool parse_time(const char *text, int64_t &timestamp) {
+	char *end = nullptr;
+	long long seconds = strtoll(text, &end, 10);
+	if (end != text && *end == '\0') {
+		timestamp = (int64_t)seconds * 1000000000LL;
+		return true;
+	}
+
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(text, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (end == nullptr || *end != '\0') {
+		return false;
+	}
+
+	tm.tm_isdst = -1;
+	timestamp = (int64_t)mktime(&tm) * 1000000000LL;
+	return true;
+}
+
+static int usage(const char *name) {
+	std::cerr << "Usage: " << name << " [--from TIME] [--to TIME] [--seq FIRST LAST] [--range] file" << std::endl;
+	return 2;
+}
+
+int main(int argc, char **argv) {
+	int64_t from = INT64_MIN;
+	int64_t to = INT64_MAX;
+	bool by_sequence = false;
+	uint64_t first = 0;
+	uint64_t last = 0;
+	bool range_only = false;
+	const char *path = nullptr;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+			if (parse_time(argv[++i], from) == false) {
+				return usage(argv[0]);
+			}
+		} else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+			if (parse_time(argv[++i], to) == false) {
+				return usage(argv[0]);
+			}
+		} else if (strcmp(argv[i], "--seq") == 0 && i + 2 < argc) {
+			first = strtoull(argv[++i], nullptr, 10);
+			last = strtoull(argv[++i], nullptr, 10);
+			by_sequence = true;
+		} else if (strcmp(argv[i], "--range") == 0) {
+			range_only = true;
+		} else if (argv[i][0] != '-' && path == nullptr) {
+			path = argv[i];
+		} else {
+			return usage(argv[0]);
+		}
+	}
+
+	if (path == nullptr || (by_sequence == true && last < first)) {
+		return usage(argv[0]);
+	}
+
+	std::string index_path = std::string(path) + ".idx";
+	PSILogIndexReader index;
+	if (index.read(index_path) == false) {
+		std::cerr << index_path << ": not a log index" << std::endl;
+		return 1;
+	}
+
+	std::ifstream in(path, std::ios::binary);
+	if (in.good() == false) {
+		std::cerr << path << ": can't open file" << std::endl;
+		return 1;
+	}
+
+	uint64_t start;
+	uint64_t end = UINT64_MAX;
+	uint64_t skip = 0;
+
+	if (by_sequence == true) {
+		PSILogIndexPoint point;
+		if (index.find_sequence(first, point) == false) {
+			std::cerr << path << ": sequence " << first << " is not in this file" << std::endl;
+			return 1;
+		}
+		start = point.offset;
+		skip = first - point.sequence;
+	} else {
+		start = index.find_time(from).offset;
+		if (to != INT64_MAX) {
+			end = index.find_time_end(to);
+		}
+	}
+
+	in.seekg(start);
+
+	// Skip to the first entry of a sequence range, so the byte range is exact
+	std::string line;
+	for (uint64_t i = 0; i < skip && std::getline(in, line); i++) {
+		start += line.size() + 1;
+	}
+
+	if (range_only == true && by_sequence == false) {
+		std::cout << start << " " << (end == UINT64_MAX ? std::string("end") : std::to_string(end)) << std::endl;
+		return 0;
+	}
+
+	uint64_t offset = start;
+	uint64_t entries = 0;
+	while ((by_sequence == false || entries <= last - first) && offset < end && std::getline(in, line)) {
+		if (range_only == false) {
+			std::cout << line << "\n";
+		}
+		offset += line.size() + 1;
+		entries++;
+	}
+
+	if (range_only == true) {
+		std::cout << start << " " << offset << std::endl;
+	}
+
+	return 0;
+}
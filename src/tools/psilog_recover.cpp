@@ -0,0 +1,40 @@
+// psilog_recover.cpp
+//
+// Prints the entries kept in flight recorder ring files written by PSILogRingOutput,
+// in the order they were written
+// Usage: psilog-recover file...
+//
+// Copyright (c) 2018 Sakari Lehtonen <sakari AT psitriangle DOT net>
+
+#include <iostream>
+#include <string>
+
+#include "../PSILogRingOutput.h"
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " file..." << std::endl;
+		return 2;
+	}
+
+	bool success = true;
+	for (int i = 1; i < argc; i++) {
+		PSILogRingReader reader;
+		if (reader.read(argv[i]) == false) {
+			std::cerr << argv[i] << ": " << reader.get_error() << std::endl;
+			success = false;
+			continue;
+		}
+
+		for (const auto &entry : reader.get_entries()) {
+			std::cout << entry.text;
+		}
+
+		// Damaged records are expected after a crash, so they're only reported
+		if (reader.get_corrupt_regions() > 0) {
+			std::cerr << argv[i] << ": skipped " << reader.get_corrupt_regions() << " damaged regions" << std::endl;
+		}
+	}
+
+	return success == true ? 0 : 1;
+}